@@ -0,0 +1,616 @@
+/*
+ * Copyright (c) 2026 Genome Research Ltd.
+ * Author(s): James Bonfield
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ * 
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* sync_file_range */
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "io_lib_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#include "io_lib/async_io.h"
+
+/* ----------------------------------------------------------------------
+ * Read-ahead.
+ *
+ * The data is held in a ring of fixed size chunks.  The consumer owns
+ * the nfull chunks starting at head; the I/O thread fills the chunk
+ * following those, without holding the lock while reading.
+ */
+
+#define RA_CHUNK (256*1024)
+
+typedef struct {
+    char *data;
+    size_t len;    // bytes read into this chunk
+    size_t pos;    // bytes already consumed
+} ra_chunk;
+
+struct read_ahead {
+    async_read_t rd;
+    async_seek_t seek;
+    async_tell_t tell;
+    void *data;
+
+    ra_chunk *chunk;
+    int nchunk;
+    int head;      // first full chunk
+    int nfull;     // number of full chunks
+
+    int eof;       // no more data until the next seek
+    int busy;      // I/O thread is reading outside the lock
+    int paused;    // I/O thread must not start another read
+    int quit;
+
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t  io_cond;   // signals the I/O thread
+    pthread_cond_t  user_cond; // signals the consumer
+};
+
+static void *read_ahead_thread(void *arg) {
+    read_ahead *ra = (read_ahead *)arg;
+
+    pthread_mutex_lock(&ra->lock);
+    for (;;) {
+	ra_chunk *c;
+	size_t n;
+
+	while (!ra->quit &&
+	       (ra->paused || ra->eof || ra->nfull == ra->nchunk))
+	    pthread_cond_wait(&ra->io_cond, &ra->lock);
+	if (ra->quit)
+	    break;
+
+	c = &ra->chunk[(ra->head + ra->nfull) % ra->nchunk];
+	ra->busy = 1;
+	pthread_mutex_unlock(&ra->lock);
+
+	n = ra->rd(c->data, 1, RA_CHUNK, ra->data);
+
+	pthread_mutex_lock(&ra->lock);
+	ra->busy = 0;
+	c->len = n;
+	c->pos = 0;
+	if (n)
+	    ra->nfull++;
+	else
+	    ra->eof = 1;
+	pthread_cond_broadcast(&ra->user_cond);
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    return NULL;
+}
+
+/*
+ * Starts a read-ahead thread reading from data via the rd callback,
+ * keeping up to ahead bytes buffered.  The seek and tell callbacks
+ * may be NULL if the input does not support them.
+ *
+ * Once started, the underlying input must only be accessed via the
+ * read_ahead_* functions until read_ahead_close() is called.
+ *
+ * Returns read_ahead pointer on success;
+ *         NULL on failure
+ */
+read_ahead *read_ahead_open(async_read_t rd, async_seek_t seek,
+			    async_tell_t tell, void *data, size_t ahead) {
+    read_ahead *ra;
+    int i;
+
+    if (!(ra = calloc(1, sizeof(*ra))))
+	return NULL;
+
+    ra->rd   = rd;
+    ra->seek = seek;
+    ra->tell = tell;
+    ra->data = data;
+
+    /* At least double buffered */
+    ra->nchunk = (ahead + RA_CHUNK-1) / RA_CHUNK;
+    if (ra->nchunk < 2)
+	ra->nchunk = 2;
+
+    if (!(ra->chunk = calloc(ra->nchunk, sizeof(*ra->chunk))))
+	goto err;
+    for (i = 0; i < ra->nchunk; i++)
+	if (!(ra->chunk[i].data = malloc(RA_CHUNK)))
+	    goto err;
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->io_cond, NULL);
+    pthread_cond_init(&ra->user_cond, NULL);
+
+    if (0 != pthread_create(&ra->tid, NULL, read_ahead_thread, ra)) {
+	pthread_mutex_destroy(&ra->lock);
+	pthread_cond_destroy(&ra->io_cond);
+	pthread_cond_destroy(&ra->user_cond);
+	goto err;
+    }
+
+    return ra;
+
+ err:
+    if (ra->chunk) {
+	for (i = 0; i < ra->nchunk; i++)
+	    free(ra->chunk[i].data);
+	free(ra->chunk);
+    }
+    free(ra);
+    return NULL;
+}
+
+/*
+ * Stops the read-ahead thread and frees memory.  Any data buffered but
+ * not yet consumed is lost, so the underlying input position is then
+ * undefined.
+ */
+void read_ahead_close(read_ahead *ra) {
+    int i;
+
+    if (!ra)
+	return;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->quit = 1;
+    pthread_cond_signal(&ra->io_cond);
+    pthread_mutex_unlock(&ra->lock);
+    pthread_join(ra->tid, NULL);
+
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->io_cond);
+    pthread_cond_destroy(&ra->user_cond);
+
+    for (i = 0; i < ra->nchunk; i++)
+	free(ra->chunk[i].data);
+    free(ra->chunk);
+    free(ra);
+}
+
+/*
+ * An fread() equivalent, taking the read_ahead pointer as the last
+ * argument.  This blocks until nmemb items are available or the end of
+ * the input (or an error) is reached.
+ *
+ * Returns the number of items read.
+ */
+size_t read_ahead_read(void *ptr, size_t size, size_t nmemb, void *vra) {
+    read_ahead *ra = (read_ahead *)vra;
+    size_t want = size * nmemb, got = 0;
+    char *cp = (char *)ptr;
+
+    pthread_mutex_lock(&ra->lock);
+    while (got < want) {
+	ra_chunk *c;
+	size_t l;
+
+	while (!ra->nfull && !ra->eof)
+	    pthread_cond_wait(&ra->user_cond, &ra->lock);
+	if (!ra->nfull)
+	    break;
+
+	/* The head chunk is ours alone, so copy without the lock */
+	c = &ra->chunk[ra->head];
+	pthread_mutex_unlock(&ra->lock);
+	l = c->len - c->pos < want - got ? c->len - c->pos : want - got;
+	memcpy(cp + got, c->data + c->pos, l);
+	c->pos += l;
+	got += l;
+	pthread_mutex_lock(&ra->lock);
+
+	if (c->pos == c->len) {
+	    ra->head = (ra->head + 1) % ra->nchunk;
+	    ra->nfull--;
+	    pthread_cond_signal(&ra->io_cond);
+	}
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    return size ? got / size : got;
+}
+
+/*
+ * Stops the I/O thread from issuing further reads and waits for any
+ * current one to finish, so the underlying input may be used directly.
+ * Called and returns with the lock held.
+ *
+ * Returns the number of bytes read ahead but not yet consumed.
+ */
+static off_t read_ahead_pause(read_ahead *ra) {
+    off_t pending = 0;
+    int i;
+
+    ra->paused = 1;
+    while (ra->busy)
+	pthread_cond_wait(&ra->user_cond, &ra->lock);
+
+    for (i = 0; i < ra->nfull; i++) {
+	ra_chunk *c = &ra->chunk[(ra->head + i) % ra->nchunk];
+	pending += c->len - c->pos;
+    }
+
+    return pending;
+}
+
+static void read_ahead_resume(read_ahead *ra) {
+    ra->paused = 0;
+    pthread_cond_signal(&ra->io_cond);
+}
+
+/*
+ * Seeks the input, discarding any data read ahead.  SEEK_CUR is relative
+ * to the consumer's position rather than the underlying input.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int read_ahead_seek(void *vra, off_t offset, int whence) {
+    read_ahead *ra = (read_ahead *)vra;
+    off_t pending;
+    int r;
+
+    if (!ra->seek)
+	return -1;
+
+    pthread_mutex_lock(&ra->lock);
+    pending = read_ahead_pause(ra);
+    if (whence == SEEK_CUR)
+	offset -= pending;
+
+    r = ra->seek(ra->data, offset, whence);
+    if (r == 0) {
+	ra->head = 0;
+	ra->nfull = 0;
+	ra->eof = 0;
+    }
+
+    read_ahead_resume(ra);
+    pthread_mutex_unlock(&ra->lock);
+
+    return r;
+}
+
+/*
+ * Returns the consumer's position in the input;
+ *         -1 on failure
+ */
+off_t read_ahead_tell(void *vra) {
+    read_ahead *ra = (read_ahead *)vra;
+    off_t pos, pending;
+
+    if (!ra->tell)
+	return -1;
+
+    pthread_mutex_lock(&ra->lock);
+    pending = read_ahead_pause(ra);
+    pos = ra->tell(ra->data);
+    read_ahead_resume(ra);
+    pthread_mutex_unlock(&ra->lock);
+
+    return pos < 0 ? pos : pos - pending;
+}
+
+/* ----------------------------------------------------------------------
+ * Write-behind.
+ *
+ * As above, but the producer fills the chunk following the nfull chunks
+ * starting at head, and the I/O thread writes out the head chunk.
+ */
+
+#define WB_CHUNK (256*1024)
+
+struct write_behind {
+    async_write_t wr;
+    void *data;
+    int fd;        // for posix_fadvise, or -1
+    int flags;
+
+    ra_chunk *chunk;
+    int nchunk;
+    int head;      // next chunk to write
+    int nfull;     // chunks queued for writing
+
+    off_t pos;     // position of the end of the queued data, or -1
+    off_t wpos;    // position of the next chunk to write
+    off_t dpos;    // start of data not yet dropped from the page cache
+
+    int err;
+    int quit;
+
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t  io_cond;   // signals the I/O thread
+    pthread_cond_t  user_cond; // signals the producer
+};
+
+/*
+ * Drops data older than the chunk just written from the page cache.
+ *
+ * Dirty pages cannot be dropped, so where possible we start writeback of
+ * the latest chunk and wait for the one before it, which will usually
+ * be complete already.  Other systems just get the fadvise hint.
+ */
+static void write_behind_dontneed(write_behind *wb, off_t end) {
+#if defined(HAVE_SYNC_FILE_RANGE) && defined(HAVE_POSIX_FADVISE)
+    sync_file_range(wb->fd, wb->wpos, end - wb->wpos,
+		    SYNC_FILE_RANGE_WRITE);
+    if (wb->wpos > wb->dpos) {
+	sync_file_range(wb->fd, wb->dpos, wb->wpos - wb->dpos,
+			SYNC_FILE_RANGE_WAIT_BEFORE |
+			SYNC_FILE_RANGE_WRITE |
+			SYNC_FILE_RANGE_WAIT_AFTER);
+	posix_fadvise(wb->fd, wb->dpos, wb->wpos - wb->dpos,
+		      POSIX_FADV_DONTNEED);
+	wb->dpos = wb->wpos;
+    }
+#elif defined(HAVE_POSIX_FADVISE)
+    posix_fadvise(wb->fd, wb->dpos, end - wb->dpos, POSIX_FADV_DONTNEED);
+    wb->dpos = end;
+#endif
+}
+
+static void *write_behind_thread(void *arg) {
+    write_behind *wb = (write_behind *)arg;
+
+    pthread_mutex_lock(&wb->lock);
+    for (;;) {
+	ra_chunk *c;
+	size_t n;
+	int err;
+
+	while (!wb->nfull && !wb->quit)
+	    pthread_cond_wait(&wb->io_cond, &wb->lock);
+	if (!wb->nfull)
+	    break;
+
+	c = &wb->chunk[wb->head];
+	err = wb->err;
+	pthread_mutex_unlock(&wb->lock);
+
+	/* After an error we just discard the data */
+	n = err ? 0 : wb->wr(c->data, 1, c->len, wb->data);
+	if (n == c->len && (wb->flags & WRITE_BEHIND_DONTNEED))
+	    write_behind_dontneed(wb, wb->wpos + n);
+	wb->wpos += n;
+
+	pthread_mutex_lock(&wb->lock);
+	if (n != c->len)
+	    wb->err = 1;
+	c->len = 0;
+	wb->head = (wb->head + 1) % wb->nchunk;
+	wb->nfull--;
+	pthread_cond_broadcast(&wb->user_cond);
+    }
+    pthread_mutex_unlock(&wb->lock);
+
+    return NULL;
+}
+
+/*
+ * Starts a write-behind thread writing to data via the wr callback,
+ * with up to queue bytes waiting to be written.
+ *
+ * The tell callback, which may be NULL, is called once to find the
+ * starting position.  fd is the file descriptor underlying data, or -1
+ * if unknown.  It is only used for WRITE_BEHIND_DONTNEED, which is
+ * ignored unless fd is a regular file.
+ *
+ * Returns write_behind pointer on success;
+ *         NULL on failure
+ */
+write_behind *write_behind_open(async_write_t wr, async_tell_t tell,
+				void *data, int fd, size_t queue, int flags) {
+    write_behind *wb;
+    struct stat st;
+    int i;
+
+    if (!(wb = calloc(1, sizeof(*wb))))
+	return NULL;
+
+    wb->wr    = wr;
+    wb->data  = data;
+    wb->fd    = fd;
+    wb->flags = flags;
+    wb->pos   = tell ? tell(data) : -1;
+    wb->wpos  = wb->dpos = wb->pos < 0 ? 0 : wb->pos;
+
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+	wb->flags &= ~WRITE_BEHIND_DONTNEED;
+
+    wb->nchunk = (queue + WB_CHUNK-1) / WB_CHUNK;
+    if (wb->nchunk < 2)
+	wb->nchunk = 2;
+
+    if (!(wb->chunk = calloc(wb->nchunk, sizeof(*wb->chunk))))
+	goto err;
+    for (i = 0; i < wb->nchunk; i++)
+	if (!(wb->chunk[i].data = malloc(WB_CHUNK)))
+	    goto err;
+
+    pthread_mutex_init(&wb->lock, NULL);
+    pthread_cond_init(&wb->io_cond, NULL);
+    pthread_cond_init(&wb->user_cond, NULL);
+
+    if (0 != pthread_create(&wb->tid, NULL, write_behind_thread, wb)) {
+	pthread_mutex_destroy(&wb->lock);
+	pthread_cond_destroy(&wb->io_cond);
+	pthread_cond_destroy(&wb->user_cond);
+	goto err;
+    }
+
+    return wb;
+
+ err:
+    if (wb->chunk) {
+	for (i = 0; i < wb->nchunk; i++)
+	    free(wb->chunk[i].data);
+	free(wb->chunk);
+    }
+    free(wb);
+    return NULL;
+}
+
+/*
+ * Queues the partially filled chunk, if any.  Called with the lock held.
+ */
+static void write_behind_push(write_behind *wb) {
+    ra_chunk *c = &wb->chunk[(wb->head + wb->nfull) % wb->nchunk];
+
+    if (wb->nfull == wb->nchunk || !c->len)
+	return;
+
+    wb->nfull++;
+    pthread_cond_signal(&wb->io_cond);
+}
+
+/*
+ * An fwrite() equivalent, taking the write_behind pointer as the last
+ * argument.  Data is copied and queued, so this only blocks when the
+ * queue is full.  Errors are reported by the first write, flush or
+ * close following the failure.
+ *
+ * Returns the number of items queued.
+ */
+size_t write_behind_write(void *ptr, size_t size, size_t nmemb, void *vwb) {
+    write_behind *wb = (write_behind *)vwb;
+    size_t len = size * nmemb, done = 0;
+    char *cp = (char *)ptr;
+
+    pthread_mutex_lock(&wb->lock);
+    while (done < len && !wb->err) {
+	ra_chunk *c;
+	size_t l;
+
+	while (wb->nfull == wb->nchunk && !wb->err)
+	    pthread_cond_wait(&wb->user_cond, &wb->lock);
+	if (wb->err)
+	    break;
+
+	/* The chunk being filled is ours alone, so copy without the lock */
+	c = &wb->chunk[(wb->head + wb->nfull) % wb->nchunk];
+	pthread_mutex_unlock(&wb->lock);
+	l = WB_CHUNK - c->len < len - done ? WB_CHUNK - c->len : len - done;
+	memcpy(c->data + c->len, cp + done, l);
+	c->len += l;
+	done += l;
+	pthread_mutex_lock(&wb->lock);
+
+	if (c->len == WB_CHUNK)
+	    write_behind_push(wb);
+    }
+    if (wb->pos >= 0)
+	wb->pos += done;
+    if (wb->err)
+	done = 0;
+    pthread_mutex_unlock(&wb->lock);
+
+    return size ? done / size : done;
+}
+
+/*
+ * Waits until all queued data has been written.
+ *
+ * Returns 0 on success
+ *        -1 if any write failed
+ */
+int write_behind_flush(write_behind *wb) {
+    int err;
+
+    pthread_mutex_lock(&wb->lock);
+    write_behind_push(wb);
+    while (wb->nfull)
+	pthread_cond_wait(&wb->user_cond, &wb->lock);
+    err = wb->err;
+    pthread_mutex_unlock(&wb->lock);
+
+    return err ? -1 : 0;
+}
+
+/*
+ * Writes all queued data and stops the write-behind thread.
+ *
+ * Returns 0 on success
+ *        -1 if any write failed
+ */
+int write_behind_close(write_behind *wb) {
+    int i, r;
+
+    if (!wb)
+	return 0;
+
+    r = write_behind_flush(wb);
+
+    pthread_mutex_lock(&wb->lock);
+    wb->quit = 1;
+    pthread_cond_signal(&wb->io_cond);
+    pthread_mutex_unlock(&wb->lock);
+    pthread_join(wb->tid, NULL);
+
+    pthread_mutex_destroy(&wb->lock);
+    pthread_cond_destroy(&wb->io_cond);
+    pthread_cond_destroy(&wb->user_cond);
+
+    for (i = 0; i < wb->nchunk; i++)
+	free(wb->chunk[i].data);
+    free(wb->chunk);
+    free(wb);
+
+    return r;
+}
+
+/*
+ * Returns the position of the end of the queued data;
+ *         -1 if the starting position was unknown
+ */
+off_t write_behind_tell(void *vwb) {
+    write_behind *wb = (write_behind *)vwb;
+    off_t pos;
+
+    pthread_mutex_lock(&wb->lock);
+    pos = wb->pos;
+    pthread_mutex_unlock(&wb->lock);
+
+    return pos;
+}
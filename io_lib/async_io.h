@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2026 Genome Research Ltd.
+ * Author(s): James Bonfield
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ * 
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Background I/O helpers.
+ *
+ * A read_ahead object sits between a consumer and an fread() style
+ * callback.  A dedicated thread keeps a configurable amount of data
+ * read in advance, so slow storage (eg network file systems) overlaps
+ * with decoding instead of stalling it.
+ *
+ * A write_behind object is the output equivalent.  Writes are copied to
+ * a bounded queue and written by a dedicated thread, so a stalled disk
+ * only blocks the producer once the queue is full.
+ *
+ * The read_ahead_* and write_behind_* callbacks deliberately have the
+ * same signatures as the cram_io_input_t and cram_io_output_t ones, so
+ * they may be substituted for them directly.
+ */
+
+#ifndef _ASYNC_IO_H_
+#define _ASYNC_IO_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef size_t (*async_read_t)(void *ptr, size_t size, size_t nmemb,
+			       void *data);
+typedef int    (*async_seek_t)(void *data, off_t offset, int whence);
+typedef off_t  (*async_tell_t)(void *data);
+typedef size_t (*async_write_t)(void *ptr, size_t size, size_t nmemb,
+				void *data);
+
+typedef struct read_ahead read_ahead;
+
+/*
+ * Starts a read-ahead thread reading from data via the rd callback,
+ * keeping up to ahead bytes buffered.  The seek and tell callbacks
+ * may be NULL if the input does not support them.
+ *
+ * Once started, the underlying input must only be accessed via the
+ * read_ahead_* functions until read_ahead_close() is called.
+ *
+ * Returns read_ahead pointer on success;
+ *         NULL on failure
+ */
+read_ahead *read_ahead_open(async_read_t rd, async_seek_t seek,
+			    async_tell_t tell, void *data, size_t ahead);
+
+/*
+ * Stops the read-ahead thread and frees memory.  Any data buffered but
+ * not yet consumed is lost, so the underlying input position is then
+ * undefined.
+ */
+void read_ahead_close(read_ahead *ra);
+
+/*
+ * An fread() equivalent, taking the read_ahead pointer as the last
+ * argument.  This blocks until nmemb items are available or the end of
+ * the input (or an error) is reached.
+ *
+ * Returns the number of items read.
+ */
+size_t read_ahead_read(void *ptr, size_t size, size_t nmemb, void *ra);
+
+/*
+ * Seeks the input, discarding any data read ahead.  SEEK_CUR is relative
+ * to the consumer's position rather than the underlying input.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int read_ahead_seek(void *ra, off_t offset, int whence);
+
+/*
+ * Returns the consumer's position in the input;
+ *         -1 on failure
+ */
+off_t read_ahead_tell(void *ra);
+
+typedef struct write_behind write_behind;
+
+/* write_behind_open() flags */
+#define WRITE_BEHIND_DONTNEED 1  /* Drop written data from the page cache */
+
+/*
+ * Starts a write-behind thread writing to data via the wr callback,
+ * with up to queue bytes waiting to be written.
+ *
+ * The tell callback, which may be NULL, is called once to find the
+ * starting position.  fd is the file descriptor underlying data, or -1
+ * if unknown.  It is only used for WRITE_BEHIND_DONTNEED, which is
+ * ignored unless fd is a regular file.
+ *
+ * Returns write_behind pointer on success;
+ *         NULL on failure
+ */
+write_behind *write_behind_open(async_write_t wr, async_tell_t tell,
+				void *data, int fd, size_t queue, int flags);
+
+/*
+ * Writes all queued data and stops the write-behind thread.
+ *
+ * Returns 0 on success
+ *        -1 if any write failed
+ */
+int write_behind_close(write_behind *wb);
+
+/*
+ * An fwrite() equivalent, taking the write_behind pointer as the last
+ * argument.  Data is copied and queued, so this only blocks when the
+ * queue is full.  Errors are reported by the first write, flush or
+ * close following the failure.
+ *
+ * Returns the number of items queued.
+ */
+size_t write_behind_write(void *ptr, size_t size, size_t nmemb, void *wb);
+
+/*
+ * Waits until all queued data has been written.
+ *
+ * Returns 0 on success
+ *        -1 if any write failed
+ */
+int write_behind_flush(write_behind *wb);
+
+/*
+ * Returns the position of the end of the queued data;
+ *         -1 if the starting position was unknown
+ */
+off_t write_behind_tell(void *wb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ASYNC_IO_H_ */
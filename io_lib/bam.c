@@ -58,6 +58,8 @@
 
 #include "io_lib/bam.h"
 #include "io_lib/os.h"
+#include "io_lib/seq_simd.h"
+#include "io_lib/async_io.h"
 #include "io_lib/thread_pool.h"
 #include "io_lib/crc32.h"
 #include "io_lib/bgzip.h"
@@ -129,7 +131,12 @@ typedef uint32_t uint32_u;
 
 static int bam_more_input(bam_file_t *b);
 static int bam_uncompress_input(bam_file_t *b);
+static void bgzf_decode_jobs_free(bam_file_t *b);
+static void sam_parse_jobs_free(bam_file_t *b);
+static void sam_format_jobs_free(bam_file_t *fp);
+static int sam_format_jobs_flush(bam_file_t *fp);
 static int reg2bin(int start, int end);
+static size_t bam_fwrite(bam_file_t *b, const void *ptr, size_t len);
 static int bgzf_block_write(bam_file_t *bf, int level, const void *buf, size_t count);
 static int bgzf_write(bam_file_t *bf, int level, const void *buf, size_t count);
 static int bgzf_write_mt(bam_file_t *bf, int level, const void *buf, size_t count);
@@ -425,6 +432,11 @@ static void bam_file_init(bam_file_t *b) {
     b->next_len = -1;
     b->bs       = NULL;
     b->bs_size  = 0;
+    b->bseqs    = NULL;
+    b->nbseqs   = 0;
+    b->bseqs_done = 0;
+    b->view_buf = NULL;
+    b->view_alloc = 0;
     b->z_finish = 1;
     b->bgzf     = 0;
     b->no_aux   = 0;
@@ -435,7 +447,17 @@ static void bam_file_init(bam_file_t *b) {
     b->pool     = NULL;
     b->equeue   = NULL;
     b->dqueue   = NULL;
+    b->squeue   = NULL;
+    b->sam_job  = NULL;
+    b->sam_done = NULL;
+    b->sam_job_free = NULL;
+    b->sam_inflight = 0;
+    b->sam_eof  = 0;
+    b->sam_fjob = NULL;
+    b->sam_fjob_free = NULL;
     b->job_pending = NULL;
+    b->last_job = NULL;
+    b->job_free = NULL;
     b->eof      = 0;
     b->nd_jobs    = 0;
     b->ne_jobs    = 0;
@@ -444,6 +466,16 @@ static void bam_file_init(bam_file_t *b) {
     b->bgbuf_p = b->bgbuf;
     b->bgbuf_sz = 0;
     b->idx_fn = NULL;
+    b->bidx = NULL;
+    b->bidx_fn = NULL;
+    b->c_pos = b->blk_coff = b->prev_coff = 0;
+    b->ra = NULL;
+    b->wb = NULL;
+    b->blk_usz = b->prev_usz = 0;
+    b->next_voff = 0;
+    b->u_queued = b->u_written = 0;
+    b->range_refid = -2;
+    b->range_done = 0;
 }
 
 /*! Opens a SAM or BAM file.
@@ -599,14 +631,25 @@ int bam_close(bam_file_t *b) {
 	    BGZF_FLUSH(b);
 
 	    /* Output a blank BGZF block too to mark EOF */
-	    if (28 != fwrite(EOF_BLOCK, 1, 28, b->fp)) {
+	    if (28 != bam_fwrite(b, EOF_BLOCK, 28)) {
 		fprintf(stderr, "Write failed in bam_close()\n");
 	    }
+
+	    if (b->bidx && b->bidx_fn) {
+		if (bam_index_finish(b->bidx) ||
+		    bam_index_save(b->bidx, b->bidx_fn))
+		    r = -1;
+	    }
 	} else {
+	    if (b->pool && sam_format_jobs_flush(b)) {
+		fprintf(stderr, "Write failed in bam_close()\n");
+		r = -1;
+	    }
+
 	    BGZF_FLUSH(b);
 
 	    if (b->uncomp_p - b->uncomp !=
-		fwrite(b->uncomp, 1, b->uncomp_p - b->uncomp, b->fp)) {
+		bam_fwrite(b, b->uncomp, b->uncomp_p - b->uncomp)) {
 		fprintf(stderr, "Write failed in bam_close()\n");
 	    }
 	}
@@ -615,6 +658,17 @@ int bam_close(bam_file_t *b) {
     if (b->bs)
 	free(b->bs);
 
+    if (b->bseqs) {
+	int i;
+	for (i = 0; i < b->nbseqs; i++)
+	    if (b->bseqs[i])
+		free(b->bseqs[i]);
+	free(b->bseqs);
+    }
+
+    if (b->view_buf)
+	free(b->view_buf);
+
     if (b->header)
 	sam_hdr_free(b->header);
 
@@ -624,8 +678,16 @@ int bam_close(bam_file_t *b) {
     if (b->sam_str)
 	free(b->sam_str);
 
-    if (b->fp)
-	r = fclose(b->fp);
+    if (b->ra)
+	read_ahead_close(b->ra);
+
+    if (b->wb && write_behind_close(b->wb)) {
+	fprintf(stderr, "Write failed in bam_close()\n");
+	r = -1;
+    }
+
+    if (b->fp && fclose(b->fp))
+	r = -1;
 
     if (b->idx) {
 	if ((b->mode == O_RDONLY) && b->idx_fn) {
@@ -634,6 +696,11 @@ int bam_close(bam_file_t *b) {
 	gzi_index_free(b->idx);
     }
 
+    if (b->bidx)
+	bam_index_free(b->bidx);
+    if (b->bidx_fn)
+	free(b->bidx_fn);
+
     if (b->pool) {
 	/* Should be no BAM jobs left in the pool, but if we abort on
 	 * and error and close early then we need to drain the pool of
@@ -646,6 +713,9 @@ int bam_close(bam_file_t *b) {
 	//fprintf(stderr, "BAM: Draining pool\n");
 	t_pool_flush(b->pool);
     }
+    bgzf_decode_jobs_free(b);
+    sam_parse_jobs_free(b);
+    sam_format_jobs_free(b);
 
     //fprintf(stderr, "BAM: destroying equeue %p, dqueue %p\n",
     //	    b->equeue, b->dqueue);
@@ -654,12 +724,43 @@ int bam_close(bam_file_t *b) {
 	t_results_queue_destroy(b->equeue);
     if (b->dqueue)
 	t_results_queue_destroy(b->dqueue);
+    if (b->squeue)
+	t_results_queue_destroy(b->squeue);
 
     free(b);
 
     return r;
 }
 
+/* stdio wrappers for read_ahead_open() and write_behind_open() */
+static size_t bam_fread(void *ptr, size_t size, size_t nmemb, void *fp) {
+    return fread(ptr, size, nmemb, (FILE *)fp);
+}
+
+static int bam_fseek(void *fp, off_t offset, int whence) {
+    return fseeko((FILE *)fp, offset, whence);
+}
+
+static size_t bam_fwrite_cb(void *ptr, size_t size, size_t nmemb, void *fp) {
+    return fwrite(ptr, size, nmemb, (FILE *)fp);
+}
+
+static off_t bam_ftell(void *fp) {
+    return ftello((FILE *)fp);
+}
+
+/*
+ * Writes len bytes to the output file, via the write-behind queue if
+ * BAM_OPT_WRITE_BEHIND is in use.
+ *
+ * Returns the number of bytes written (or queued).
+ */
+static size_t bam_fwrite(bam_file_t *b, const void *ptr, size_t len) {
+    return b->wb
+	? write_behind_write((void *)ptr, 1, len, b->wb)
+	: fwrite(ptr, 1, len, b->fp);
+}
+
 /*
  * Loads more data into the input (compressed) buffer.
  *
@@ -677,7 +778,10 @@ static int bam_more_input(bam_file_t *b) {
 	b->comp_p = b->comp;
     }
 
-    l = fread(&b->comp[b->comp_sz], 1, Z_BUFF_SIZE - b->comp_sz, b->fp);
+    l = b->ra
+	? read_ahead_read(&b->comp[b->comp_sz], 1, Z_BUFF_SIZE - b->comp_sz,
+			  b->ra)
+	: fread(&b->comp[b->comp_sz], 1, Z_BUFF_SIZE - b->comp_sz, b->fp);
     if (l <= 0)
 	return -1;
     
@@ -685,13 +789,123 @@ static int bam_more_input(bam_file_t *b) {
     return 0;
 }
 
-typedef struct {
+typedef struct bgzf_decode_job {
+    struct bgzf_decode_job *next; // free list
     unsigned char comp[Z_BUFF_SIZE];
     unsigned char uncomp[Z_BUFF_SIZE];
     size_t comp_sz, uncomp_sz;
     int ignore_chksum;
+    uint64_t c_off; // file offset of this block
 } bgzf_decode_job;
-static bgzf_decode_job *last_job = NULL;
+
+/*
+ * Decode jobs are large, so rather than freeing them once consumed we
+ * keep them on a free list for reuse by later blocks.  This is only
+ * accessed by the thread reading the file.
+ */
+static bgzf_decode_job *bgzf_decode_job_alloc(bam_file_t *b) {
+    bgzf_decode_job *j = b->job_free;
+
+    if (j)
+	b->job_free = j->next;
+    else
+	j = malloc(sizeof(*j));
+
+    return j;
+}
+
+static void bgzf_decode_job_release(bam_file_t *b, bgzf_decode_job *j) {
+    if (!j)
+	return;
+
+    j->next = b->job_free;
+    b->job_free = j;
+}
+
+/*
+ * Deallocates all decode jobs; the free list, the job holding the current
+ * block and any unread results.  The pool must have been flushed first.
+ */
+static void bgzf_decode_jobs_free(bam_file_t *b) {
+    bgzf_decode_job *j, *next;
+
+    if (b->dqueue) {
+	t_pool_result *res;
+	while ((res = t_pool_next_result(b->dqueue))) {
+	    bgzf_decode_job_release(b, res->data);
+	    t_pool_delete_result(res, 0);
+	}
+    }
+
+    bgzf_decode_job_release(b, b->last_job);
+    bgzf_decode_job_release(b, b->job_pending);
+    b->last_job = b->job_pending = NULL;
+
+    for (j = b->job_free; j; j = next) {
+	next = j->next;
+	free(j);
+    }
+    b->job_free = NULL;
+}
+
+/*
+ * Each thread keeps its own decompressor, created on first use and
+ * destroyed when the thread exits, so worker threads do not have to set
+ * up a new one for every block.
+ */
+static pthread_key_t bgzf_dec_key;
+static pthread_once_t bgzf_dec_once = PTHREAD_ONCE_INIT;
+
+static void bgzf_dec_free(void *z) {
+#ifdef HAVE_LIBDEFLATE
+    libdeflate_free_decompressor((struct libdeflate_decompressor *)z);
+#else
+    inflateEnd((z_stream *)z);
+    free(z);
+#endif
+}
+
+static void bgzf_dec_init_once(void) {
+    pthread_key_create(&bgzf_dec_key, bgzf_dec_free);
+}
+
+/*
+ * Returns the decompressor for this thread: a libdeflate_decompressor
+ * or an initialised raw-deflate z_stream.
+ *
+ * Returns decompressor on success
+ *         NULL on failure
+ */
+static void *bgzf_dec_get(void) {
+    void *z;
+
+    pthread_once(&bgzf_dec_once, bgzf_dec_init_once);
+    if ((z = pthread_getspecific(bgzf_dec_key)))
+	return z;
+
+#ifdef HAVE_LIBDEFLATE
+    if (!(z = libdeflate_alloc_decompressor()))
+	return NULL;
+#else
+    {
+	z_stream *s = calloc(1, sizeof(*s));
+	if (!s)
+	    return NULL;
+	if (inflateInit2(s, -15) != Z_OK) {
+	    free(s);
+	    return NULL;
+	}
+	z = s;
+    }
+#endif
+
+    if (pthread_setspecific(bgzf_dec_key, z) != 0) {
+	bgzf_dec_free(z);
+	return NULL;
+    }
+
+    return z;
+}
 
 
 /*
@@ -700,13 +914,12 @@ static bgzf_decode_job *last_job = NULL;
 #ifdef HAVE_LIBDEFLATE
 void *bgzf_decode_thread(void *arg) {
     bgzf_decode_job *j = (bgzf_decode_job *)arg;
-    struct libdeflate_decompressor *z = libdeflate_alloc_decompressor();
+    struct libdeflate_decompressor *z = bgzf_dec_get();
     if (!z) return NULL;
 
     int err = libdeflate_deflate_decompress(z, j->comp, j->comp_sz,
 					    j->uncomp, Z_BUFF_SIZE, &j->uncomp_sz);
 
-    libdeflate_free_decompressor(z);
     if (err != LIBDEFLATE_SUCCESS) {
 	fprintf(stderr, "Libdeflate returned error code %d\n", err);
 	return NULL;
@@ -730,20 +943,17 @@ void *bgzf_decode_thread(void *arg) {
 void *bgzf_decode_thread(void *arg) {
     bgzf_decode_job *j = (bgzf_decode_job *)arg;
     int err;
-    z_stream s;
+    z_stream *s = bgzf_dec_get();
+    if (!s) return NULL;
 
-    s.avail_in  = j->comp_sz;
-    s.next_in   = j->comp; 
-    s.avail_out = Z_BUFF_SIZE;
-    s.next_out  = j->uncomp;
-    s.total_out = 0;
-    s.zalloc    = NULL;
-    s.zfree     = NULL;
-    s.opaque    = NULL;
+    inflateReset(s);
+    s->avail_in  = j->comp_sz;
+    s->next_in   = j->comp; 
+    s->avail_out = Z_BUFF_SIZE;
+    s->next_out  = j->uncomp;
+    s->total_out = 0;
 
-    inflateInit2(&s, -15);
-    err = inflate(&s, Z_FINISH);
-    inflateEnd(&s);
+    err = inflate(s, Z_FINISH);
 
     if (err != Z_STREAM_END) {
 	fprintf(stderr, "Inflate returned error code %d\n", err);
@@ -751,7 +961,7 @@ void *bgzf_decode_thread(void *arg) {
     }
 
     if (!j->ignore_chksum) {
-	uint32_t crc1=iolib_crc32(0L, (unsigned char *)j->uncomp, s.total_out);
+	uint32_t crc1=iolib_crc32(0L, (unsigned char *)j->uncomp, s->total_out);
 	uint32_t crc2;
 	memcpy(&crc2, j->comp + j->comp_sz, 4);
 	crc2 = le_int4(crc2);
@@ -762,7 +972,7 @@ void *bgzf_decode_thread(void *arg) {
 	}
     }
 
-    j->uncomp_sz  = s.total_out;
+    j->uncomp_sz  = s->total_out;
 
     return j;
 }
@@ -807,7 +1017,7 @@ static int bam_uncompress_input(bam_file_t *b) {
 	    if (b->job_pending) {
 		j = b->job_pending;
 	    } else {
-		if (!(j = malloc(sizeof(*j))))
+		if (!(j = bgzf_decode_job_alloc(b)))
 		    return -1;
 
 	    empty_block_1:
@@ -816,13 +1026,13 @@ static int bam_uncompress_input(bam_file_t *b) {
 			b->eof = 1;
 			if (b->comp_sz < 28) {
 			    b->eof = 2;
-			    free(j);
+			    bgzf_decode_job_release(b, j);
 			    break;
 			}
 		    }
 		} else if (b->comp_sz == 0 && b->eof) {
 		    b->eof = 2;
-		    free(j);
+		    bgzf_decode_job_release(b, j);
 		    break;
 		}
 	    
@@ -830,18 +1040,20 @@ static int bam_uncompress_input(bam_file_t *b) {
 		    if (memcmp(b->comp_p, EOF_BLOCK, 28) == 0) {
 			b->eof_block = 1;
 			b->comp_p += 28; b->comp_sz -= 28;
+			b->c_pos += 28;
 			goto empty_block_1;
 		    } else {
 			b->eof_block = 0;
 		    }
 		}
 
+		j->c_off = b->c_pos;
 		bgzf = b->comp_p;
 		b->comp_p += 10; b->comp_sz -= 10;
 
 		if (bgzf[0] != 31 || bgzf[1] != 139) {
 		    fprintf(stderr, "Zlib magic number failure\n");
-		    free(j);
+		    bgzf_decode_job_release(b, j);
 		    return -1; /* magic number failure */
 		}
 	    
@@ -851,13 +1063,13 @@ static int bam_uncompress_input(bam_file_t *b) {
 		    b->comp_p += 2; b->comp_sz -= 2;
 		} else {
 		    fprintf(stderr, "Not BGZF\n");
-		    free(j);
+		    bgzf_decode_job_release(b, j);
 		    return -1;
 		}
 
 		if (xlen != 6) {
 		    fprintf(stderr, "XLEN != 6\n");
-		    free(j);
+		    bgzf_decode_job_release(b, j);
 		    return -1;
 		}
 
@@ -867,7 +1079,7 @@ static int bam_uncompress_input(bam_file_t *b) {
 		if (bgzf[12] != 'B' || bgzf[13] != 'C' ||
 		    bgzf[14] !=  2  || bgzf[15] !=  0) {
 		    fprintf(stderr, "BGZF XLEN block incorrect\n");
-		    free(j);
+		    bgzf_decode_job_release(b, j);
 		    return -1;
 		}
 		bsize = bgzf[16] + bgzf[17]*256;
@@ -877,7 +1089,7 @@ static int bam_uncompress_input(bam_file_t *b) {
 		    do {
 			if (bam_more_input(b) == -1) {
 			    fprintf(stderr, "EOF - truncated block\n");
-			    free(j);
+			    bgzf_decode_job_release(b, j);
 			    return -1; /* Truncated */
 			}
 		    } while (b->comp_sz < bsize + 8);
@@ -889,6 +1101,7 @@ static int bam_uncompress_input(bam_file_t *b) {
 
 		b->comp_p  += bsize + 8; // crc & isize
 		b->comp_sz -= bsize + 8; // crc & isize
+		b->c_pos   += bsize + 26;
 	    }
 
 	    //nonblock = b->nd_jobs ? 1 : 0;
@@ -932,12 +1145,16 @@ static int bam_uncompress_input(bam_file_t *b) {
 	memcpy(b->uncomp, j->uncomp, j->uncomp_sz);
 	b->uncomp_p = b->uncomp;
 #else
-	if (last_job)
-	    free(last_job);
-	last_job = j;
+	/* The previous block is no longer referenced, so recycle it */
+	bgzf_decode_job_release(b, b->last_job);
+	b->last_job = j;
 	b->uncomp_p = j->uncomp;
 #endif
 	b->uncomp_sz = j->uncomp_sz;
+	b->prev_coff = b->blk_coff;
+	b->prev_usz  = b->blk_usz;
+	b->blk_coff  = j->c_off;
+	b->blk_usz   = j->uncomp_sz;
 	t_pool_delete_result(res, 0);
 	if (b->idx){
 	    if (gzi_index_add_block(b->idx, j->comp_sz + 26, b->uncomp_sz))
@@ -959,6 +1176,7 @@ static int bam_uncompress_input(bam_file_t *b) {
 	if (memcmp(b->comp_p, EOF_BLOCK, 28) == 0) {
 	    b->eof_block = 1;
 	    b->comp_p += 28; b->comp_sz -= 28;
+	    b->c_pos += 28;
 	    goto empty_block_2;
 	} else {
 	    b->eof_block = 0;
@@ -1008,13 +1226,12 @@ static int bam_uncompress_input(bam_file_t *b) {
 	    }
 
 #ifdef HAVE_LIBDEFLATE
-	    struct libdeflate_decompressor *z = libdeflate_alloc_decompressor();
+	    struct libdeflate_decompressor *z = bgzf_dec_get();
 	    if (!z) return -1;
 
 	    err = libdeflate_deflate_decompress(z, b->comp_p, bsize,
 						b->uncomp, Z_BUFF_SIZE, &b->uncomp_sz);
 
-	    libdeflate_free_decompressor(z);
 	    if (err != LIBDEFLATE_SUCCESS) {
 		fprintf(stderr, "Libdeflate returned error code %d\n", err);
 		return -1;
@@ -1050,6 +1267,12 @@ static int bam_uncompress_input(bam_file_t *b) {
 		    return -1;
 	    }
 
+	    b->prev_coff = b->blk_coff;
+	    b->prev_usz  = b->blk_usz;
+	    b->blk_coff  = b->c_pos;
+	    b->blk_usz   = b->uncomp_sz;
+	    b->c_pos    += bsize + 26;
+
 	    if (!b->ignore_chksum) {
 		uint32_t crc1 = iolib_crc32(0L, (unsigned char *)b->uncomp,
 					    b->uncomp_sz);
@@ -1218,14 +1441,21 @@ static int64_t inline STRTOL64(const char *v, const char **rv, int b) {
 }
 
 /*
- * Decodes the next line of SAM into a bam_seq_t struct.
+ * Decodes a single line of SAM, of length used_l, into a bam_seq_t struct.
+ * The line must be nul terminated and readable for 8 bytes beyond that.
+ *
+ * When called from a worker thread (mt != 0) the header must not be
+ * modified, so rather than fabricating @SQ entries for unknown reference
+ * names we return -2 and leave the caller to reparse the line with mt
+ * set to zero.
  *
  * Returns 1 on success
- *         0 on eof
  *        -1 on error
+ *        -2 on unknown reference name (mt mode only)
  */
-static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
-    int used_l, sign;
+static int sam_parse_line(bam_file_t *b, unsigned char *str, int used_l,
+			  bam_seq_t **bsp, int mt) {
+    int sign;
     int64_t n;
     unsigned char *cpf, *cpt, *cp;
     int cigar_len;
@@ -1234,29 +1464,6 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
     int64_t start, end;
     SAM_hdr *sh = b->header;
 
-    static const char lookup[256] = {
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 00 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 10 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 20 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15, 0,15,15, /* 30 */
-	15, 1,14, 2,13,15,15, 4, 11,15,15,12,15, 3,15,15, /* 40 */
-	15,15, 5, 6, 8,15, 7, 9, 15,10,15,15,15,15,15,15, /* 50 */
-	15, 1,14, 2,13,15,15, 4, 11,15,15,12,15, 3,15,15, /* 60 */
-	15,15, 5, 6, 8,15, 7, 9, 15,10,15,15,15,15,15,15, /* 70 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 80 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 90 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* a0 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* b0 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* c0 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* d0 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* e0 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15};/* f0 */
-
-    /* Fetch a single line */
-    if ((used_l = bam_get_line(b, &b->sam_str, &b->alloc_l)) <= 0) {
-	return used_l;
-    }
-
     used_l *= 4; // FIXME, what is the correct max size?
 
     /* Over sized memory, for worst case? FIXME: cigar can break this! */
@@ -1272,7 +1479,7 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
     bs->bin_packed = 0;
     
     /* Decode line */
-    cpf = b->sam_str;
+    cpf = str;
     cpt = (unsigned char *)&bs->data;
     
     /* Name */
@@ -1309,6 +1516,9 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
 	    SAM_hdr *sh = b->header;
 	    HashData hd;
 
+	    if (mt)
+		return -2;
+
 	    fprintf(stderr, "Reference seq %.*s unknown\n", (int)(cpf-cp), cp);
 
 	    /* Fabricate it instead */
@@ -1410,6 +1620,9 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
 	if (!hi) {
 	    HashData hd;
 
+	    if (mt)
+		return -2;
+
 	    fprintf(stderr, "Mate ref seq \"%.*s\" unknown\n", (int)(cpf-cp), cp);
 
 	    /* Fabricate it instead */
@@ -1461,25 +1674,10 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
 	cpf++;
 	bs->len = 0;
     } else {
-	while (cpf[0] > '\t' && cpf[1] > '\t') {
-	    /* 9% of cpu time is here */
-	    *cpt++ = (lookup[cpf[0]]<<4) | lookup[cpf[1]];
-	    cpf+=2;
-	}
-
-	if (*cpf > '\t')
-	    *cpt++ = lookup[*cpf++]<<4;
-
-//	while (*cpf > '\t') {
-//	    *cpt = lookup[*cpf]<<4;
-//	    if (*++cpf <= '\t') {
-//		cpt++;
-//		break;
-//	    }
-//	    *cpt++ |= lookup[*cpf];
-//	    cpf++;
-//	}
+	CPF_SKIP();
 	bs->len = cpf-cp;
+	seq_nt16_pack(cpt, cp, bs->len);
+	cpt += (bs->len+1)/2;
     }
     if (!*cpf++) return -1;
 
@@ -1492,9 +1690,9 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
 	cpt += bs->len;
 	cpf++;
     } else {
-	COPY_CPF_TO_CPTM('!');
-//	while (*cpf > '\t')
-//	    *cpt++ = *cpf++ - '!';
+	CPF_SKIP();
+	seq_qual_add(cpt, cp, cpf-cp, -'!');
+	cpt += cpf-cp;
     }
 
     if ((char *)cpt != (char *)(bam_aux(bs))) return -1;
@@ -1642,6 +1840,373 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
     return 1;
 }
 
+/* ----------------------------------------------------------------------
+ * Multi-threaded SAM parsing.
+ *
+ * The reading thread copies blocks of whole lines into a job, which is
+ * then parsed into an array of bam_seq_t on the thread pool.  Jobs come
+ * back in order via b->squeue and records are handed out one at a time
+ * by sam_next_seq.
+ *
+ * Workers cannot modify the header, so any line they fail to parse (an
+ * unknown reference, an error or an empty line) is left for the reading
+ * thread.  It first waits for all other jobs to complete so nothing else
+ * is looking at the reference hash, and then parses that line and the
+ * remainder of the job itself.
+ */
+#define SAM_JOB_SIZE (256*1024)
+
+typedef struct sam_parse_job {
+    struct sam_parse_job *next; // free list or list of drained jobs
+    bam_file_t *b;
+    unsigned char *text;        // '\n' terminated lines of SAM
+    size_t text_len, text_alloc;
+    size_t end;                 // offset of next unparsed line
+    bam_seq_t **recs;
+    int nrecs, arecs, curr;
+    size_t redo_off;            // line left for the reading thread
+    int redo_len;
+    int redo, serial;
+} sam_parse_job;
+
+static sam_parse_job *sam_parse_job_alloc(bam_file_t *b) {
+    sam_parse_job *j = b->sam_job_free;
+
+    if (j) {
+	b->sam_job_free = j->next;
+    } else {
+	if (!(j = calloc(1, sizeof(*j))))
+	    return NULL;
+	j->b = b;
+    }
+
+    j->next = NULL;
+    j->text_len = j->end = 0;
+    j->nrecs = j->curr = 0;
+    j->redo = j->serial = 0;
+
+    return j;
+}
+
+static void sam_parse_job_release(bam_file_t *b, sam_parse_job *j) {
+    if (!j)
+	return;
+
+    j->next = b->sam_job_free;
+    b->sam_job_free = j;
+}
+
+/*
+ * Deallocates all parse jobs.  The pool must have been flushed first.
+ */
+static void sam_parse_jobs_free(bam_file_t *b) {
+    sam_parse_job *j, *next;
+    int i;
+
+    if (b->squeue) {
+	t_pool_result *res;
+	while ((res = t_pool_next_result(b->squeue))) {
+	    sam_parse_job_release(b, res->data);
+	    t_pool_delete_result(res, 0);
+	}
+    }
+
+    sam_parse_job_release(b, b->sam_job);
+    b->sam_job = NULL;
+    for (j = b->sam_done; j; j = next) {
+	next = j->next;
+	sam_parse_job_release(b, j);
+    }
+    b->sam_done = NULL;
+
+    for (j = b->sam_job_free; j; j = next) {
+	next = j->next;
+	for (i = 0; i < j->arecs; i++)
+	    if (j->recs[i])
+		free(j->recs[i]);
+	free(j->recs);
+	free(j->text);
+	free(j);
+    }
+    b->sam_job_free = NULL;
+}
+
+/*
+ * Returns the next complete line in a job, nul terminated and with its
+ * length in *len, or NULL if none remain.  As with bam_get_line, a final
+ * line lacking a newline is ignored.
+ */
+static unsigned char *sam_job_line(sam_parse_job *j, int *len) {
+    unsigned char *line = j->text + j->end, *nl;
+    int l;
+
+    if (!(nl = memchr(line, '\n', j->text_len - j->end)))
+	return NULL;
+
+    *nl = 0;
+    l = nl - line;
+    if (l && line[l-1] == '\r')
+	line[--l] = 0; // handle \r\n too
+
+    j->end = nl+1 - j->text;
+    *len = l;
+    return line;
+}
+
+/*
+ * The thread pool function: parses as many lines of the job as possible.
+ */
+static void *sam_parse_job_run(void *arg) {
+    sam_parse_job *j = (sam_parse_job *)arg;
+    unsigned char *line;
+    int len;
+
+    while ((line = sam_job_line(j, &len))) {
+	if (j->nrecs == j->arecs) {
+	    int n = j->arecs ? j->arecs*2 : 256;
+	    bam_seq_t **r = realloc(j->recs, n * sizeof(*r));
+	    if (!r)
+		goto redo;
+	    memset(&r[j->arecs], 0, (n - j->arecs) * sizeof(*r));
+	    j->recs = r;
+	    j->arecs = n;
+	}
+
+	if (len && sam_parse_line(j->b, line, len, &j->recs[j->nrecs], 1) == 1) {
+	    j->nrecs++;
+	    continue;
+	}
+
+    redo:
+	j->redo = 1;
+	j->redo_off = line - j->text;
+	j->redo_len = len;
+	break;
+    }
+
+    return j;
+}
+
+/*
+ * Fills out a job with a block of whole lines from the input.
+ * At the end of input the job may be empty.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int sam_fill_job(bam_file_t *b, sam_parse_job *j) {
+    for (;;) {
+	size_t n;
+	int r, done = 0;
+
+	if (!b->uncomp_sz) {
+	    if ((r = bam_uncompress_input(b)) < 0)
+		return -1;
+	    if (r == 0) {
+		b->eof_block = 1; // expected eof
+		b->sam_eof = 1;
+		return 0;
+	    }
+	}
+
+	n = b->uncomp_sz;
+	if (j->text_len + n >= SAM_JOB_SIZE) {
+	    /* Stop at the last complete line, if there is one */
+	    unsigned char *cp = b->uncomp_p + n;
+	    while (cp > b->uncomp_p && cp[-1] != '\n')
+		cp--;
+	    if (cp > b->uncomp_p) {
+		n = cp - b->uncomp_p;
+		done = 1;
+	    }
+	}
+
+	// +8 to cope with the 64-bit copy function in the
+	// COPY_CPF_TO_CPTM macro.
+	if (j->text_len + n + 8 > j->text_alloc) {
+	    size_t a = j->text_len + n + 8 > SAM_JOB_SIZE + 8
+		? (j->text_len + n + 8) * 1.5 : SAM_JOB_SIZE + 8;
+	    unsigned char *t = realloc(j->text, a);
+	    if (!t)
+		return -1;
+	    j->text = t;
+	    j->text_alloc = a;
+	}
+
+	memcpy(j->text + j->text_len, b->uncomp_p, n);
+	j->text_len += n;
+	b->uncomp_p += n;
+	b->uncomp_sz -= n;
+
+	if (done)
+	    return 0;
+    }
+}
+
+/*
+ * Waits for all in-flight parse jobs, appending them to b->sam_done so
+ * that they are still returned in order.  Afterwards no worker is using
+ * the header.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int sam_parse_jobs_drain(bam_file_t *b) {
+    sam_parse_job **tail = (sam_parse_job **)&b->sam_done;
+
+    while (*tail)
+	tail = &(*tail)->next;
+
+    while (b->sam_inflight) {
+	t_pool_result *res = t_pool_next_result_wait(b->squeue);
+	sam_parse_job *j;
+
+	if (!res)
+	    return -1;
+
+	j = (sam_parse_job *)res->data;
+	t_pool_delete_result(res, 0);
+	b->sam_inflight--;
+
+	j->next = NULL;
+	*tail = j;
+	tail = &j->next;
+    }
+
+    return 0;
+}
+
+/*
+ * Parses the next line left in a job by its worker on the reading thread.
+ *
+ * Returns 1 on success
+ *         0 on empty line
+ *        -1 on error
+ *         2 if the job has no more lines
+ */
+static int sam_job_serial(bam_file_t *b, sam_parse_job *j, bam_seq_t **bsp) {
+    unsigned char *line;
+    int len;
+
+    if (j->redo) {
+	if (sam_parse_jobs_drain(b) < 0)
+	    return -1;
+
+	j->redo = 0;
+	j->serial = 1;
+	line = j->text + j->redo_off;
+	len = j->redo_len;
+    } else if (!j->serial || !(line = sam_job_line(j, &len))) {
+	return 2;
+    }
+
+    return len ? sam_parse_line(b, line, len, bsp, 0) : 0;
+}
+
+/*
+ * The multi-threaded equivalent of sam_next_seq.
+ *
+ * Returns 1 on success
+ *         0 on eof
+ *        -1 on error
+ */
+static int sam_next_seq_mt(bam_file_t *b, bam_seq_t **bsp) {
+    sam_parse_job *j;
+    int r;
+
+    for (;;) {
+	if ((j = b->sam_job)) {
+	    if (j->curr < j->nrecs) {
+		/* Swap rather than copy; the caller's struct becomes ours */
+		bam_seq_t *tmp = *bsp;
+		*bsp = j->recs[j->curr];
+		j->recs[j->curr++] = tmp;
+		return 1;
+	    }
+
+	    if ((r = sam_job_serial(b, j, bsp)) != 2)
+		return r;
+
+	    sam_parse_job_release(b, j);
+	    b->sam_job = NULL;
+	}
+
+	/* Keep the pool busy */
+	while (!b->sam_eof && b->sam_inflight < b->pool->qsize) {
+	    if (!(j = sam_parse_job_alloc(b)))
+		return -1;
+
+	    if (sam_fill_job(b, j) < 0)
+		b->sam_eof = -1;
+
+	    if (!j->text_len) {
+		sam_parse_job_release(b, j);
+		break;
+	    }
+
+	    if (t_pool_dispatch(b->pool, b->squeue, sam_parse_job_run, j) < 0) {
+		sam_parse_job_release(b, j);
+		return -1;
+	    }
+	    b->sam_inflight++;
+	}
+
+	/* Then the next job in order */
+	if ((j = b->sam_done)) {
+	    b->sam_done = j->next;
+	} else if (b->sam_inflight) {
+	    t_pool_result *res = t_pool_next_result_wait(b->squeue);
+	    if (!res)
+		return -1;
+	    j = (sam_parse_job *)res->data;
+	    t_pool_delete_result(res, 0);
+	    b->sam_inflight--;
+	} else {
+	    return b->sam_eof < 0 ? -1 : 0;
+	}
+
+	b->sam_job = j;
+    }
+}
+
+/*
+ * Decodes the next line of SAM into a bam_seq_t struct.
+ *
+ * Returns 1 on success
+ *         0 on eof
+ *        -1 on error
+ */
+static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
+    int used_l;
+
+    if (b->squeue)
+	return sam_next_seq_mt(b, bsp);
+
+    /* Fetch a single line */
+    if ((used_l = bam_get_line(b, &b->sam_str, &b->alloc_l)) <= 0) {
+	return used_l;
+    }
+
+    return sam_parse_line(b, b->sam_str, used_l, bsp, 0);
+}
+
+/*
+ * Returns the BGZF virtual offset of the current position in the
+ * uncompressed stream, less 'back' bytes.
+ */
+static uint64_t bam_voff(bam_file_t *b, size_t back) {
+    size_t used;
+
+    if (b->uncomp_sz > b->blk_usz)
+	return 0; // not BGZF
+
+    used = b->blk_usz - b->uncomp_sz;
+    if (used >= back)
+	return (b->blk_coff << 16) | (used - back);
+    else
+	return (b->prev_coff << 16) | (b->prev_usz - (back - used));
+}
+
 /*
  * Fills out the next bam_seq_t struct.
  * bs must be non-null, but *bs may be NULL or an existing bam_seq_t pointer.
@@ -1653,17 +2218,19 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
  *        -1 on error
  */
 #ifdef ALLOW_UAC
-int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
+static int bam_get_seq_unfiltered(bam_file_t *b, bam_seq_t **bsp) {
     int32_t blk_size, blk_ret;
     bam_seq_t *bs;
     uint32_t u32;
     int32_t i32;
+    uint64_t off_beg;
 
     b->line++;
 
     if (!b->bam)
 	return sam_next_seq(b, bsp);
 
+    off_beg = b->next_len > 0 ? b->next_voff : bam_voff(b, 0);
     if (b->next_len > 0) {
 	blk_size = b->next_len;
     } else {
@@ -1699,6 +2266,7 @@ int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
 	((char *)(&bs->ref))[blk_size] = 0;
     }
     b->next_len = le_int4(b->next_len);
+    b->next_voff = bam_voff(b, b->next_len > 0 ? 4 : 0);
 
     bs->blk_size  = blk_size;
     bs->ref       = le_int4(bs->ref);
@@ -1727,22 +2295,28 @@ int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
 	}
     }
 
+    if (b->bidx_fn && b->bidx &&
+	bam_index_push(b->bidx, bs, off_beg, b->next_voff))
+	return -1;
+
     return 1;
 }
 
 #else
 
-int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
+static int bam_get_seq_unfiltered(bam_file_t *b, bam_seq_t **bsp) {
     int32_t blk_size, blk_ret;
     bam_seq_t *bs;
     uint32_t u32;
     int32_t i32;
+    uint64_t off_beg;
 
     b->line++;
 
     if (!b->bam)
 	return sam_next_seq(b, bsp);
 
+    off_beg = b->next_len > 0 ? b->next_voff : bam_voff(b, 0);
     if (b->next_len > 0) {
 	blk_size = b->next_len;
     } else {
@@ -1815,6 +2389,7 @@ int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
 	((char *)bam_cigar(bs))[blk_size] = 0;
     }
     b->next_len = le_int4(b->next_len);
+    b->next_voff = bam_voff(b, b->next_len > 0 ? 4 : 0);
 
     if (10 == be_int4(10)) {
 	int i, cigar_len = bam_cigar_len(bs);
@@ -1824,15 +2399,327 @@ int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
 	}
     }
 
+    if (b->bidx_fn && b->bidx &&
+	bam_index_push(b->bidx, bs, off_beg, b->next_voff))
+	return -1;
+
     return 1;
 }
 #endif
 
-/* Old name */
-int bam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
+/*
+ * Returns the 0-based position one beyond the last reference base
+ * covered by this sequence. Unmapped reads are considered to cover a
+ * single base.
+ */
+int64_t bam_aend(bam_seq_t *b) {
+    uint32_t *cigar = bam_cigar(b);
+    int i, n = bam_cigar_len(b);
+    int64_t end = bam_pos(b);
+
+    if (bam_flag(b) & BAM_FUNMAP)
+	return end+1;
+
+    for (i = 0; i < n; i++)
+	if (BAM_CONSUME_REF(cigar[i] & BAM_CIGAR_MASK))
+	    end += cigar[i] >> BAM_CIGAR_SHIFT;
+
+    return end > bam_pos(b) ? end : end+1;
+}
+
+/*
+ * As bam_get_seq_unfiltered, but honouring any range set by
+ * BAM_OPT_RANGE.  The filtering follows the same rules as CRAM.
+ *
+ * Returns 1 on success
+ *         0 on eof or end of range
+ *        -1 on error
+ */
+int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
+    int r;
+
+    if (b->range_refid == -2)
+	return bam_get_seq_unfiltered(b, bsp);
+
+    if (b->range_done)
+	return 0;
+
+    while ((r = bam_get_seq_unfiltered(b, bsp)) > 0) {
+	bam_seq_t *s = *bsp;
+
+	if (b->range_refid == -1) {
+	    // Unmapped data may be preceded by mapped data, so skip it
+	    if (bam_ref(s) != -1)
+		continue;
+	    return 1;
+	}
+
+	if (bam_ref(s) < b->range_refid && bam_ref(s) != -1)
+	    continue;
+
+	if (bam_ref(s) != b->range_refid || bam_pos(s)+1 > b->range_end)
+	    break;
+
+	if (bam_aend(s) < b->range_start)
+	    continue;
+
+	return 1;
+    }
+
+    if (r > 0) {
+	b->range_done = 1;
+	return 0;
+    }
+
+    return r;
+}
+
+/* Old name */
+int bam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
     return bam_get_seq(b, bsp);
 }
 
+/*
+ * Reads up to n sequences into storage owned by b, which is reused by
+ * subsequent calls.
+ *
+ * Returns the number of sequences filled out in array on success
+ *         0 on eof or end of range
+ *        -1 on error
+ */
+int bam_get_seqs(bam_file_t *b, bam_seq_t **array, int n) {
+    int k, r = 0;
+
+    // A short batch ended on eof or an error, which we report now
+    if (b->bseqs_done)
+	return b->bseqs_done < 0 ? -1 : 0;
+
+    if (n > b->nbseqs) {
+	bam_seq_t **bs = realloc(b->bseqs, n * sizeof(*bs));
+	if (!bs)
+	    return -1;
+	memset(&bs[b->nbseqs], 0, (n - b->nbseqs) * sizeof(*bs));
+	b->bseqs = bs;
+	b->nbseqs = n;
+    }
+
+    for (k = 0; k < n; k++) {
+	if ((r = bam_get_seq(b, &b->bseqs[k])) <= 0) {
+	    b->bseqs_done = r < 0 ? -1 : 1;
+	    break;
+	}
+	array[k] = b->bseqs[k];
+    }
+
+    return k ? k : r;
+}
+
+/* ----------------------------------------------------------------------
+ * Record views.
+ */
+
+static inline uint32_t bam_le32(const unsigned char *cp) {
+    return cp[0] | (cp[1]<<8) | (cp[2]<<16) | ((uint32_t)cp[3]<<24);
+}
+
+/*
+ * Fills out v from a raw BAM record of blk_size bytes, starting at the
+ * refid field.
+ *
+ * Returns 0 on success
+ *        -1 on failure (malformed record)
+ */
+static int bam_view_raw(bam_view_t *v, const unsigned char *rec,
+			size_t blk_size) {
+    uint32_t u32;
+    size_t fixed;
+
+    v->ref       = (int32_t)bam_le32(rec);
+    v->pos       = (int32_t)bam_le32(rec+4);
+    u32          = bam_le32(rec+8);
+    v->bin       = u32 >> 16;
+    v->map_qual  = (u32 >> 8) & 0xff;
+    v->name_len  = u32 & 0xff;
+    u32          = bam_le32(rec+12);
+    v->flag      = u32 >> 16;
+    v->cigar_len = u32 & 0xffff;
+    v->len       = (int32_t)bam_le32(rec+16);
+    v->mate_ref  = (int32_t)bam_le32(rec+20);
+    v->mate_pos  = (int32_t)bam_le32(rec+24);
+    v->ins_size  = (int32_t)bam_le32(rec+28);
+
+    if (v->len < 0)
+	return -1;
+    fixed = 32 + v->name_len + 4*v->cigar_len + (v->len+1)/2 + v->len;
+    if (fixed > blk_size)
+	return -1;
+
+    v->name    = (const char *)rec + 32;
+    v->cigar   = rec + 32 + v->name_len;
+    v->seq     = v->cigar + 4*v->cigar_len;
+    v->qual    = v->seq + (v->len+1)/2;
+    v->aux     = v->qual + v->len;
+    v->aux_len = blk_size - fixed;
+
+    return 0;
+}
+
+/*
+ * Fills out v to refer to the contents of bam_seq_t bs.
+ * On big endian systems this converts the bs cigar to little endian.
+ */
+void bam_seq_view(bam_view_t *v, bam_seq_t *bs) {
+    v->ref       = bam_ref(bs);
+    v->pos       = bam_pos(bs);
+    v->name_len  = bam_name_len(bs);
+    v->map_qual  = bam_map_qual(bs);
+    v->bin       = bam_flag(bs) & BAM_CIGAR32 ? 0 : bs->bin;
+    v->flag      = bam_flag(bs) & ~BAM_CIGAR32;
+    v->cigar_len = bam_cigar_len(bs);
+    v->len       = bam_seq_len(bs);
+    v->mate_ref  = bam_mate_ref(bs);
+    v->mate_pos  = bam_mate_pos(bs);
+    v->ins_size  = bam_ins_size(bs);
+
+    /* Views hold the cigar in little endian, as on disk */
+    if (10 == be_int4(10)) {
+	int i;
+	uint32_t *cigar = bam_cigar(bs);
+	for (i = 0; i < v->cigar_len; i++)
+	    cigar[i] = le_int4(cigar[i]);
+    }
+
+    v->name    = bam_name(bs);
+    v->cigar   = (unsigned char *)bam_cigar(bs);
+    v->seq     = (unsigned char *)bam_seq(bs);
+    v->qual    = (unsigned char *)bam_qual(bs);
+    v->aux     = (unsigned char *)bam_aux(bs);
+    v->aux_len = (char *)&bs->ref + bam_blk_size(bs) - bam_aux(bs);
+}
+
+/* As bam_aend(), but for a view */
+static int64_t bam_view_aend(const bam_view_t *v) {
+    int i;
+    int64_t end = v->pos;
+
+    if (v->flag & BAM_FUNMAP)
+	return end+1;
+
+    for (i = 0; i < v->cigar_len; i++) {
+	uint32_t op = bam_view_cigar_op(v, i);
+	if (BAM_CONSUME_REF(op & BAM_CIGAR_MASK))
+	    end += op >> BAM_CIGAR_SHIFT;
+    }
+
+    return end > v->pos ? end : end+1;
+}
+
+/*
+ * Fetches the next BAM record as a view, ignoring any range.
+ *
+ * Returns 1 on success
+ *         0 on eof
+ *        -1 on error
+ */
+static int bam_get_view_unfiltered(bam_file_t *b, bam_view_t *v) {
+    int32_t blk_size;
+    const unsigned char *rec;
+    int r;
+
+    if (!b->bam || (b->bidx_fn && b->bidx)) {
+	/* Not a binary record we can point to, so decode and copy */
+	if ((r = bam_get_seq_unfiltered(b, &b->bs)) <= 0)
+	    return r;
+	bam_seq_view(v, b->bs);
+	return 1;
+    }
+
+    b->line++;
+
+    if (b->next_len > 0) {
+	/* Length already consumed by bam_get_seq() */
+	blk_size = b->next_len;
+    } else {
+	if (4 != bam_read(b, &blk_size, 4))
+	    return 0;
+	blk_size = le_int4(blk_size);
+    }
+    b->next_len = -1;
+
+    if (blk_size < 36) /* Minimum valid BAM record size */
+	return -1;
+
+    if (b->uncomp_sz >= blk_size) {
+	/* Contained within this block, so point to it */
+	rec = b->uncomp_p;
+	b->uncomp_p  += blk_size;
+	b->uncomp_sz -= blk_size;
+    } else {
+	/* Spans blocks, so copy */
+	if (blk_size > b->view_alloc) {
+	    unsigned char *buf = realloc(b->view_buf, blk_size);
+	    if (!buf)
+		return -1;
+	    b->view_buf = buf;
+	    b->view_alloc = blk_size;
+	}
+	if (bam_read(b, b->view_buf, blk_size) != blk_size)
+	    return -1;
+	rec = b->view_buf;
+    }
+
+    return bam_view_raw(v, rec, blk_size) == 0 ? 1 : -1;
+}
+
+/*
+ * Fetches the next record as a read-only view, without copying.
+ *
+ * The view points into the decompressed BGZF block, so is only valid
+ * until the next call that reads from b.  Records which straddle a
+ * block boundary are copied into a buffer owned by b.  SAM input, and
+ * BAM input while building an index, are decoded into an internal
+ * bam_seq_t instead and the view refers to that.
+ *
+ * Returns 1 on success
+ *         0 on eof or end of range
+ *        -1 on error
+ */
+int bam_get_view(bam_file_t *b, bam_view_t *v) {
+    int r;
+
+    if (b->range_refid == -2)
+	return bam_get_view_unfiltered(b, v);
+
+    if (b->range_done)
+	return 0;
+
+    while ((r = bam_get_view_unfiltered(b, v)) > 0) {
+	if (b->range_refid == -1) {
+	    if (v->ref != -1)
+		continue;
+	    return 1;
+	}
+
+	if (v->ref < b->range_refid && v->ref != -1)
+	    continue;
+
+	if (v->ref != b->range_refid || v->pos+1 > b->range_end)
+	    break;
+
+	if (bam_view_aend(v) < b->range_start)
+	    continue;
+
+	return 1;
+    }
+
+    if (r > 0) {
+	b->range_done = 1;
+	return 0;
+    }
+
+    return r;
+}
+
 static int8_t aux_type_size[256] = {
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
@@ -2170,32 +3057,6 @@ int bam_construct_seq(bam_seq_t **b, size_t extra_len,
     int i;
     uint32_t *ip;
 
-    /*
-     * cp = "=ACMGRSVTWYHKDBN";
-     * memset(L, 15, 256);
-     * for (i = 0; i < 16; i++) {
-     *     L[cp[i]] = L[tolower(cp[i])] = i;
-     * }
-     */
-    static const char L[256] = {
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15, 0,15,15,
-	15, 1,14, 2,13,15,15, 4,11,15,15,12,15, 3,15,15,
-	15,15, 5, 6, 8,15, 7, 9,15,10,15,15,15,15,15,15,
-	15, 1,14, 2,13,15,15, 4,11,15,15,12,15, 3,15,15,
-	15,15, 5, 6, 8,15, 7, 9,15,10,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15
-    };
-
     /* Sanity checks */
     if (NULL == b) return -1;
     if (len < 0) return -1;  /* not sure why the spec has it as an int */
@@ -2260,11 +3121,8 @@ int bam_construct_seq(bam_seq_t **b, size_t extra_len,
     }
 
     /* Seq */
-    for (i = 0; i < len-1; i += 2) {
-	*cp++ = (L[(uc)seq[i]]<<4) + L[(uc)seq[i+1]];
-    }
-    if (i < len)
-	*cp++ = L[(uc)seq[i]]<<4;
+    seq_nt16_pack((uc *)cp, (const uc *)seq, len);
+    cp += (len+1)/2;
 
     /* Qual */
     if (qual) {
@@ -3128,6 +3986,8 @@ static int bgzf_encode(int level,
 
 static int bgzf_block_write(bam_file_t *bf, int level,
 			    const void *buf, size_t count) {
+    bf->u_queued += count;
+
     if (!bf->idx)
 	return BGZF_WRITE(bf, level, buf, count);
 
@@ -3164,6 +4024,24 @@ static int bgzf_block_write(bam_file_t *bf, int level,
 }
 
 
+/*
+ * Accounts for a BGZF block of c_sz bytes, holding u_sz bytes of
+ * uncompressed data, having been written to disk.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int bgzf_block_written(bam_file_t *bf, size_t c_sz, size_t u_sz) {
+    if (bf->bidx && bf->bidx_fn &&
+	bam_index_add_block(bf->bidx, c_sz, u_sz))
+	return -1;
+
+    bf->c_pos += c_sz;
+    bf->u_written += u_sz;
+
+    return 0;
+}
+
 static int bgzf_write(bam_file_t *bf, int level, const void *buf, size_t count) {
     unsigned char blk[Z_BUFF_SIZE+4];
     uint32_t len;
@@ -3171,10 +4049,10 @@ static int bgzf_write(bam_file_t *bf, int level, const void *buf, size_t count)
     if (0 != bgzf_encode(level, buf, count, blk, &len)) 
 	return -1;
 
-    if (len != fwrite(blk, 1, len, bf->fp))
+    if (len != bam_fwrite(bf, blk, len))
 	return -1;
 
-    return 0;
+    return bgzf_block_written(bf, len, count);
 }
 
 typedef struct {
@@ -3207,7 +4085,9 @@ static int bgzf_write_mt(bam_file_t *bf, int level, const void *buf,
 
     while ((r = t_pool_next_result(bf->equeue))) {
 	j = (bgzf_encode_job *)r->data;
-	if (j->out_sz != fwrite(j->out, 1, j->out_sz, bf->fp))
+	if (j->out_sz != bam_fwrite(bf, j->out, j->out_sz))
+	    return -1;
+	if (bgzf_block_written(bf, j->out_sz, j->in_sz))
 	    return -1;
 	t_pool_delete_result(r, 1);
     }
@@ -3227,7 +4107,9 @@ static int bgzf_flush_mt(bam_file_t *bf) {
 
     while ((r = t_pool_next_result(bf->equeue))) {
 	j = (bgzf_encode_job *)r->data;
-	if (j->out_sz != fwrite(j->out, 1, j->out_sz, bf->fp))
+	if (j->out_sz != bam_fwrite(bf, j->out, j->out_sz))
+	    return -1;
+	if (bgzf_block_written(bf, j->out_sz, j->in_sz))
 	    return -1;
 	t_pool_delete_result(r, 1);
     }
@@ -3242,456 +4124,660 @@ static int bgzf_flush(bam_file_t *bf) {
 #endif
 
 /*
- * Writes a single bam sequence object.
+ * A buffer of SAM text being formatted by sam_format_seq().  When full it
+ * is written to bf, or if bf is NULL it is grown instead.  There must be
+ * SAM_BUF_SLACK bytes of usable memory beyond end.
+ */
+typedef struct {
+    unsigned char *buf, *p, *end;
+    bam_file_t *bf;
+} sam_buf;
+
+#define SAM_BUF_SLACK (Z_BUFF_SIZE - BGZF_BUFF_SIZE)
+
+/*
+ * Makes room in a SAM text buffer, by writing it out or by growing it.
+ * Afterwards there are at least BGZF_BUFF_SIZE bytes free.
+ *
  * Returns 0 on success
  *        -1 on failure
  */
-int bam_put_seq(bam_file_t *fp, bam_seq_t *b) {
-    char *auxh, aux_key[3], type;
-    bam_aux_t val;
+static int sam_buf_flush(sam_buf *o) {
+    size_t len = o->p - o->buf;
 
-    /*
-     * Thread safe version of:
-     *
-     *   static int init_done = 0;
-     *   static uint16_t code2base[256];
-     *   
-     *   if (!init_done) {
-     *       int i;
-     *       char c[2];
-     *       uint16_t s;
-     *       for (i = 0; i < 256; i++) {
-     *           c[0] = "=ACMGRSVTWYHKDBN"[i >> 4];
-     *           c[1] = "=ACMGRSVTWYHKDBN"[i & 15];
-     *           s = *(uint16_t *)c;
-     *           code2base[i] = s;
-     *	     
-     *           //printf("%5d,%c", code2base[i],i%8==7?'\n':' ');
-     *       }
-     *       init_done = 1;
-     *   }
-     */
-#ifdef ALLOW_UAC
-    static const uint16_t code2base[256] = {
-	15677, 16701, 17213, 19773, 18237, 21053, 21309, 22077,
-	21565, 22333, 22845, 18493, 19261, 17469, 16957, 20029,
-	15681, 16705, 17217, 19777, 18241, 21057, 21313, 22081,
-	21569, 22337, 22849, 18497, 19265, 17473, 16961, 20033,
-	15683, 16707, 17219, 19779, 18243, 21059, 21315, 22083,
-	21571, 22339, 22851, 18499, 19267, 17475, 16963, 20035,
-	15693, 16717, 17229, 19789, 18253, 21069, 21325, 22093,
-	21581, 22349, 22861, 18509, 19277, 17485, 16973, 20045,
-	15687, 16711, 17223, 19783, 18247, 21063, 21319, 22087,
-	21575, 22343, 22855, 18503, 19271, 17479, 16967, 20039,
-	15698, 16722, 17234, 19794, 18258, 21074, 21330, 22098,
-	21586, 22354, 22866, 18514, 19282, 17490, 16978, 20050,
-	15699, 16723, 17235, 19795, 18259, 21075, 21331, 22099,
-	21587, 22355, 22867, 18515, 19283, 17491, 16979, 20051,
-	15702, 16726, 17238, 19798, 18262, 21078, 21334, 22102,
-	21590, 22358, 22870, 18518, 19286, 17494, 16982, 20054,
-	15700, 16724, 17236, 19796, 18260, 21076, 21332, 22100,
-	21588, 22356, 22868, 18516, 19284, 17492, 16980, 20052,
-	15703, 16727, 17239, 19799, 18263, 21079, 21335, 22103,
-	21591, 22359, 22871, 18519, 19287, 17495, 16983, 20055,
-	15705, 16729, 17241, 19801, 18265, 21081, 21337, 22105,
-	21593, 22361, 22873, 18521, 19289, 17497, 16985, 20057,
-	15688, 16712, 17224, 19784, 18248, 21064, 21320, 22088,
-	21576, 22344, 22856, 18504, 19272, 17480, 16968, 20040,
-	15691, 16715, 17227, 19787, 18251, 21067, 21323, 22091,
-	21579, 22347, 22859, 18507, 19275, 17483, 16971, 20043,
-	15684, 16708, 17220, 19780, 18244, 21060, 21316, 22084,
-	21572, 22340, 22852, 18500, 19268, 17476, 16964, 20036,
-	15682, 16706, 17218, 19778, 18242, 21058, 21314, 22082,
-	21570, 22338, 22850, 18498, 19266, 17474, 16962, 20034,
-	15694, 16718, 17230, 19790, 18254, 21070, 21326, 22094,
-	21582, 22350, 22862, 18510, 19278, 17486, 16974, 20046
-    };
-#endif
+    if (o->bf) {
+	if (len != bam_fwrite(o->bf, o->buf, len))
+	    return -1;
+	o->p = o->buf;
+    } else {
+	size_t sz = (o->end - o->buf) * 2;
+	unsigned char *buf;
 
-    if (!fp->binary) {
-	/* SAM */
-	unsigned char *end = fp->uncomp + BGZF_BUFF_SIZE, *dat;
-	int sz, i, n;
+	if (sz < len + BGZF_BUFF_SIZE)
+	    sz = len + BGZF_BUFF_SIZE;
+	if (!(buf = realloc(o->buf, sz + SAM_BUF_SLACK)))
+	    return -1;
+	o->buf = buf;
+	o->p   = buf + len;
+	o->end = buf + sz;
+    }
 
-#define BF_FLUSH()							\
-	do {								\
-	    if (fp->uncomp_p - fp->uncomp !=				\
-		fwrite(fp->uncomp, 1, fp->uncomp_p - fp->uncomp, fp->fp)) \
-		return -1;						\
-	    fp->uncomp_p=fp->uncomp;					\
-	} while(0)
+    return 0;
+}
 
-	/* QNAME */
-	if (end - fp->uncomp_p < (sz = bam_name_len(b))) BF_FLUSH();
-	if (bam_name(b) - (char *)b + sz-1 >
-	    b->blk_size + offsetof(bam_seq_t, ref)) {
-	    fprintf(stderr, "Name length too large for bam block\n");
-	    return -1;
-	}
-	memcpy(fp->uncomp_p, bam_name(b), sz-1); fp->uncomp_p += sz-1;
-	*fp->uncomp_p++ = '\t';
+/*
+ * Formats a single bam sequence object as a line of SAM, appending it to
+ * the buffer o.  This does not modify fp, so may be called from multiple
+ * threads at once.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int sam_format_seq(bam_file_t *fp, sam_buf *o, bam_seq_t *b) {
+    char *auxh, aux_key[3], type;
+    bam_aux_t val;
+    unsigned char *end = o->end, *dat;
+    int sz, i, n;
 
-	/* FLAG */
-	if (end-fp->uncomp_p < 5) BF_FLUSH();
-	fp->uncomp_p = append_int(fp->uncomp_p, bam_flag(b));
-	*fp->uncomp_p++ = '\t';
+#define BF_FLUSH()							\
+    do {								\
+	if (sam_buf_flush(o))						\
+	    return -1;							\
+	end = o->end;							\
+    } while(0)
+
+    /* QNAME */
+    if (end - o->p < (sz = bam_name_len(b))) BF_FLUSH();
+    if (bam_name(b) - (char *)b + sz-1 >
+	b->blk_size + offsetof(bam_seq_t, ref)) {
+	fprintf(stderr, "Name length too large for bam block\n");
+	return -1;
+    }
+    memcpy(o->p, bam_name(b), sz-1); o->p += sz-1;
+    *o->p++ = '\t';
 
-	/* RNAME */
-	if (b->ref < -1 || b->ref >= fp->header->nref)
-	    return -1;
+    /* FLAG */
+    if (end-o->p < 5) BF_FLUSH();
+    o->p = append_int(o->p, bam_flag(b));
+    *o->p++ = '\t';
 
-	if (b->ref != -1) {
-	    size_t l = strlen(fp->header->ref[b->ref].name);
-	    if (end-fp->uncomp_p < l+1) BF_FLUSH();
-	    memcpy(fp->uncomp_p, fp->header->ref[b->ref].name, l);
-	    fp->uncomp_p += l;
-	} else {
-	    if (end-fp->uncomp_p < 2) BF_FLUSH();
-	    *fp->uncomp_p++ = '*';
-	}
-	*fp->uncomp_p++ = '\t';
+    /* RNAME */
+    if (b->ref < -1 || b->ref >= fp->header->nref)
+	return -1;
 
-	/* POS */
-	if (b->pos < -1) return -1;
-	if (end-fp->uncomp_p < 12) BF_FLUSH();
-	fp->uncomp_p = append_int64(fp->uncomp_p, b->pos+1); *fp->uncomp_p++ = '\t';
+    if (b->ref != -1) {
+	size_t l = strlen(fp->header->ref[b->ref].name);
+	if (end-o->p < l+1) BF_FLUSH();
+	memcpy(o->p, fp->header->ref[b->ref].name, l);
+	o->p += l;
+    } else {
+	if (end-o->p < 2) BF_FLUSH();
+	*o->p++ = '*';
+    }
+    *o->p++ = '\t';
 
-	/* MAPQ */
-	if (end-fp->uncomp_p < 5) BF_FLUSH();
-	fp->uncomp_p = append_int(fp->uncomp_p, bam_map_qual(b)); *fp->uncomp_p++ = '\t';
+    /* POS */
+    if (b->pos < -1) return -1;
+    if (end-o->p < 12) BF_FLUSH();
+    o->p = append_int64(o->p, b->pos+1); *o->p++ = '\t';
 
-	/* CIGAR */
-	n = bam_cigar_len(b);dat = (uc *)bam_cigar(b);
-	if (n < 0 ||
-	    dat - (uc *)b + n*4 > b->blk_size + offsetof(bam_seq_t, ref))
-	    return -1;
-	for (i = 0; i < n; i++, dat+=4) {
-	    uint32_t c = *(uint32_t *)dat;
-	    if (end-fp->uncomp_p < 13) BF_FLUSH();
-	    fp->uncomp_p = append_int(fp->uncomp_p, c>>4);
-	    *fp->uncomp_p++="MIDNSHP=X???????"[c&15];
-	}
-	if (n==0) {
-	    if (end-fp->uncomp_p < 2) BF_FLUSH();
-	    *fp->uncomp_p++='*';
-	}
-	*fp->uncomp_p++='\t';
+    /* MAPQ */
+    if (end-o->p < 5) BF_FLUSH();
+    o->p = append_int(o->p, bam_map_qual(b)); *o->p++ = '\t';
 
-	/* NRNM */
-	if (b->mate_ref < -1 || b->mate_ref >= fp->header->nref)
-	    return -1;
+    /* CIGAR */
+    n = bam_cigar_len(b);dat = (uc *)bam_cigar(b);
+    if (n < 0 ||
+	dat - (uc *)b + n*4 > b->blk_size + offsetof(bam_seq_t, ref))
+	return -1;
+    for (i = 0; i < n; i++, dat+=4) {
+	uint32_t c = *(uint32_t *)dat;
+	if (end-o->p < 13) BF_FLUSH();
+	o->p = append_int(o->p, c>>4);
+	*o->p++="MIDNSHP=X???????"[c&15];
+    }
+    if (n==0) {
+	if (end-o->p < 2) BF_FLUSH();
+	*o->p++='*';
+    }
+    *o->p++='\t';
 
-	if (b->mate_ref != -1) {
-	    if (b->mate_ref == b->ref) {
-		if (end-fp->uncomp_p < 2) BF_FLUSH();
-		*fp->uncomp_p++ = '=';
-	    } else {
-		size_t l = strlen(fp->header->ref[b->mate_ref].name);
-		if (end-fp->uncomp_p < l+1) BF_FLUSH();
-		memcpy(fp->uncomp_p, fp->header->ref[b->mate_ref].name, l);
-		fp->uncomp_p += l;
-	    }
+    /* NRNM */
+    if (b->mate_ref < -1 || b->mate_ref >= fp->header->nref)
+	return -1;
+
+    if (b->mate_ref != -1) {
+	if (b->mate_ref == b->ref) {
+	    if (end-o->p < 2) BF_FLUSH();
+	    *o->p++ = '=';
 	} else {
-	    if (end-fp->uncomp_p < 2) BF_FLUSH();
-	    *fp->uncomp_p++ = '*';
+	    size_t l = strlen(fp->header->ref[b->mate_ref].name);
+	    if (end-o->p < l+1) BF_FLUSH();
+	    memcpy(o->p, fp->header->ref[b->mate_ref].name, l);
+	    o->p += l;
 	}
-	*fp->uncomp_p++ = '\t';
+    } else {
+	if (end-o->p < 2) BF_FLUSH();
+	*o->p++ = '*';
+    }
+    *o->p++ = '\t';
 
-	/* MPOS */
-	if (end-fp->uncomp_p < 12) BF_FLUSH();
-	fp->uncomp_p = append_int64(fp->uncomp_p, b->mate_pos+1); *fp->uncomp_p++ = '\t';
+    /* MPOS */
+    if (end-o->p < 12) BF_FLUSH();
+    o->p = append_int64(o->p, b->mate_pos+1); *o->p++ = '\t';
 
-	/* ISIZE */
-	if (end-fp->uncomp_p < 12) BF_FLUSH();
-	fp->uncomp_p = append_int64(fp->uncomp_p, b->ins_size); *fp->uncomp_p++ = '\t';
+    /* ISIZE */
+    if (end-o->p < 12) BF_FLUSH();
+    o->p = append_int64(o->p, b->ins_size); *o->p++ = '\t';
 
-	/* SEQ */
-	n = (b->len+1)/2;
-	dat = (uc *)bam_seq(b);
+    /* SEQ */
+    n = (b->len+1)/2;
+    dat = (uc *)bam_seq(b);
 
-	if (dat - (uc *)b + b->len > b->blk_size + offsetof(bam_seq_t, ref)) {
-	    fprintf(stderr, "Sequence length too large for bam block\n");
-	    return -1;
-	}
+    if (dat - (uc *)b + b->len > b->blk_size + offsetof(bam_seq_t, ref)) {
+	fprintf(stderr, "Sequence length too large for bam block\n");
+	return -1;
+    }
 
-	/* BAM encoding */
-	//	while (n) {
-	//	    int l = end-fp->uncomp_p < n ? end-fp->uncomp_p : n;
-	//	    memcpy(fp->uncomp_p, dat, l); fp->uncomp_p += l;
-	//	    n -= l; dat += l;
-	//	    if (end == fp->uncomp_p) BF_FLUSH();
-	//	}
-	if (b->len != 0) {
-	    if (end - fp->uncomp_p < b->len + 3) BF_FLUSH();
-	    if (end - fp->uncomp_p < b->len + 3) {
-		/* Extra long seqs need more regular checks */
-		for (i = 0; i < b->len-1; i+=2) {
-		    if (end - fp->uncomp_p < 3) BF_FLUSH();
-		    *fp->uncomp_p++ = "=ACMGRSVTWYHKDBN"[*dat >> 4];
-		    *fp->uncomp_p++ = "=ACMGRSVTWYHKDBN"[*dat++ & 15];
-		}
-		if (i < b->len) {
-		    if (end - fp->uncomp_p < 3) BF_FLUSH();
-		    *fp->uncomp_p++ = "=ACMGRSVTWYHKDBN"[*dat >> 4];
-		}
-	    } else {
-		unsigned char *cp = fp->uncomp_p;
-		int n = b->len & ~1;
-		for (i = 0; i < n; i+=2) {
-#ifdef ALLOW_UAC
-		    *(int16_u *)cp = le_int2(code2base[*dat++]);
-		    cp += 2;
-#else
-		    cp[0] = "=ACMGRSVTWYHKDBN"[*dat >> 4];
-		    cp[1] = "=ACMGRSVTWYHKDBN"[*dat++ & 15];
-		    cp += 2;
-#endif
-		}
-		if (i < b->len) {
-		    *cp++ = "=ACMGRSVTWYHKDBN"[*dat >> 4];
-		}
-		fp->uncomp_p = cp;
+    /* BAM encoding */
+    //      while (n) {
+    //          int l = end-o->p < n ? end-o->p : n;
+    //          memcpy(o->p, dat, l); o->p += l;
+    //          n -= l; dat += l;
+    //          if (end == o->p) BF_FLUSH();
+    //      }
+    if (b->len != 0) {
+	if (end - o->p < b->len + 3) BF_FLUSH();
+	if (end - o->p < b->len + 3) {
+	    /* Extra long seqs need more regular checks */
+	    for (i = 0; i < b->len-1; i+=2) {
+		if (end - o->p < 3) BF_FLUSH();
+		*o->p++ = "=ACMGRSVTWYHKDBN"[*dat >> 4];
+		*o->p++ = "=ACMGRSVTWYHKDBN"[*dat++ & 15];
+	    }
+	    if (i < b->len) {
+		if (end - o->p < 3) BF_FLUSH();
+		*o->p++ = "=ACMGRSVTWYHKDBN"[*dat >> 4];
 	    }
 	} else {
-	    if (end - fp->uncomp_p < 2) BF_FLUSH();
-	    *fp->uncomp_p++ = '*';
+	    seq_nt16_unpack(o->p, dat, b->len);
+	    o->p += b->len;
 	}
-	*fp->uncomp_p++ = '\t';
+    } else {
+	if (end - o->p < 2) BF_FLUSH();
+	*o->p++ = '*';
+    }
+    *o->p++ = '\t';
 
-	/* QUAL */
-	n = b->len;
-	if (b->len < 0) return -1;
-	dat = (uc *)bam_qual(b);
-	if (dat - (uc *)b + b->len > b->blk_size + offsetof(bam_seq_t, ref))
-	    return -1;
-	/* BAM encoding */
-	//	while (n) {
-	//	    int l = end-fp->uncomp_p < n ? end-fp->uncomp_p : n;
-	//	    memcpy(fp->uncomp_p, dat, l); fp->uncomp_p += l;
-	//	    n -= l; dat += l;
-	//	    if (end == fp->uncomp_p) BF_FLUSH();
-	//	}
-	if (b->len != 0) {
-	    if (*dat == 0xff) {
-		if (end - fp->uncomp_p < 2) BF_FLUSH();
-		*fp->uncomp_p++ = '*';
-		dat += b->len;
-	    } else {
-		if (end - fp->uncomp_p < b->len + 3) BF_FLUSH();
-		if (end - fp->uncomp_p < b->len + 3 ||
-		    fp->binning == BINNING_ILLUMINA) {
-
-		    /* Long seqs */
-		    if (fp->binning == BINNING_ILLUMINA) {
-			for (i = 0; i < b->len; i++) {
-			    if (end - fp->uncomp_p < 3) BF_FLUSH();
-			    *fp->uncomp_p++ = illumina_bin_33[(uc)*dat++];
-			}
-		    } else {
-			for (i = 0; i < b->len; i++) {
-			    if (end - fp->uncomp_p < 3) BF_FLUSH();
-			    *fp->uncomp_p++ = *dat++ + '!';
-			}
+    /* QUAL */
+    n = b->len;
+    if (b->len < 0) return -1;
+    dat = (uc *)bam_qual(b);
+    if (dat - (uc *)b + b->len > b->blk_size + offsetof(bam_seq_t, ref))
+	return -1;
+    /* BAM encoding */
+    //      while (n) {
+    //          int l = end-o->p < n ? end-o->p : n;
+    //          memcpy(o->p, dat, l); o->p += l;
+    //          n -= l; dat += l;
+    //          if (end == o->p) BF_FLUSH();
+    //      }
+    if (b->len != 0) {
+	if (*dat == 0xff) {
+	    if (end - o->p < 2) BF_FLUSH();
+	    *o->p++ = '*';
+	    dat += b->len;
+	} else {
+	    if (end - o->p < b->len + 3) BF_FLUSH();
+	    if (end - o->p < b->len + 3 ||
+		fp->binning == BINNING_ILLUMINA) {
+
+		/* Long seqs */
+		if (fp->binning == BINNING_ILLUMINA) {
+		    for (i = 0; i < b->len; i++) {
+			if (end - o->p < 3) BF_FLUSH();
+			*o->p++ = illumina_bin_33[(uc)*dat++];
 		    }
 		} else {
-		    unsigned char *cp = fp->uncomp_p;
-		    i = 0;
-#ifdef ALLOW_UAC
-		    int n = b->len & ~3;
-		    for (; i < n; i+=4) {
-			//*cp++ = *dat++ + '!';
-			*(uint32_u *)cp = *(uint32_u *)dat + 0x21212121;
-			cp  += 4;
-			dat += 4;
+		    for (i = 0; i < b->len; i++) {
+			if (end - o->p < 3) BF_FLUSH();
+			*o->p++ = *dat++ + '!';
 		    }
-#endif
-		    for (; i < b->len; i++) {
-			*cp++ = *dat++ + '!';
-		    }
-		    fp->uncomp_p = cp;
 		}
+	    } else {
+		seq_qual_add(o->p, dat, b->len, '!');
+		o->p += b->len;
+		dat  += b->len;
 	    }
-	} else {
-	    if (end - fp->uncomp_p < 2) BF_FLUSH();
-	    *fp->uncomp_p++ = '*';
-	}
-
-	/* Auxiliary tags */
-	auxh = NULL;
-	while (0 == bam_aux_iter_full(b, &auxh, aux_key, &type, &val)) {
-	    if (end - fp->uncomp_p < 20) BF_FLUSH();
-	    *fp->uncomp_p++ = '\t';
-	    *fp->uncomp_p++ = aux_key[0];
-	    *fp->uncomp_p++ = aux_key[1];
-	    *fp->uncomp_p++ = ':';
-	    *fp->uncomp_p++ = type;
-	    *fp->uncomp_p++ = ':';
-	    switch(aux_key[2]) {
-	    case 'A':
-		*fp->uncomp_p++ = val.i;
-		break;
+	}
+    } else {
+	if (end - o->p < 2) BF_FLUSH();
+	*o->p++ = '*';
+    }
 
-	    case 'C':
-		fp->uncomp_p = append_uint(fp->uncomp_p, (uint8_t)val.i);
-		break;
+    /* Auxiliary tags */
+    auxh = NULL;
+    while (0 == bam_aux_iter_full(b, &auxh, aux_key, &type, &val)) {
+	if (end - o->p < 20) BF_FLUSH();
+	*o->p++ = '\t';
+	*o->p++ = aux_key[0];
+	*o->p++ = aux_key[1];
+	*o->p++ = ':';
+	*o->p++ = type;
+	*o->p++ = ':';
+	switch(aux_key[2]) {
+	case 'A':
+	    *o->p++ = val.i;
+	    break;
 
-	    case 'c':
-		fp->uncomp_p = append_int(fp->uncomp_p, (int8_t)val.i);
-		break;
+	case 'C':
+	    o->p = append_uint(o->p, (uint8_t)val.i);
+	    break;
 
-	    case 'S':
-		fp->uncomp_p = append_uint(fp->uncomp_p, (uint16_t)val.i);
-		break;
+	case 'c':
+	    o->p = append_int(o->p, (int8_t)val.i);
+	    break;
 
-	    case 's':
-		fp->uncomp_p = append_int(fp->uncomp_p, (int16_t)val.i);
-		break;
+	case 'S':
+	    o->p = append_uint(o->p, (uint16_t)val.i);
+	    break;
 
-	    case 'I':
-		fp->uncomp_p = append_uint(fp->uncomp_p, (uint32_t)val.i);
-		break;
+	case 's':
+	    o->p = append_int(o->p, (int16_t)val.i);
+	    break;
 
-	    case 'i':
-		fp->uncomp_p = append_int(fp->uncomp_p, (int32_t)val.i);
-		break;
+	case 'I':
+	    o->p = append_uint(o->p, (uint32_t)val.i);
+	    break;
 
-	    case 'f':
-		fp->uncomp_p += sprintf((char *)fp->uncomp_p, "%g", val.f);
-		break;
+	case 'i':
+	    o->p = append_int(o->p, (int32_t)val.i);
+	    break;
 
-	    case 'd':
-		fp->uncomp_p += sprintf((char *)fp->uncomp_p, "%g", val.d);
-		break;
+	case 'f':
+	    o->p += sprintf((char *)o->p, "%g", val.f);
+	    break;
 
-	    case 'Z':
-	    case 'H': {
-		size_t l = strlen(val.s), l2;
-		char *dat = val.s;
-		do {
-		    if (end - fp->uncomp_p < l+2) BF_FLUSH();
-		    l2 = MIN(l, end-fp->uncomp_p);
-		    memcpy(fp->uncomp_p, dat, l2);
-		    fp->uncomp_p += l2;
-		    l   -= l2;
-		    dat += l2;
-		} while (l);
-		break;
+	case 'd':
+	    o->p += sprintf((char *)o->p, "%g", val.d);
+	    break;
+
+	case 'Z':
+	case 'H': {
+	    size_t l = strlen(val.s), l2;
+	    char *dat = val.s;
+	    do {
+		if (end - o->p < l+2) BF_FLUSH();
+		l2 = MIN(l, end-o->p);
+		memcpy(o->p, dat, l2);
+		o->p += l2;
+		l   -= l2;
+		dat += l2;
+	    } while (l);
+	    break;
+	}
+
+	case 'B': {
+	    uint32_t count = val.B.n, sz, j;
+	    unsigned char *s = val.B.s;
+	    *o->p++ = val.B.t;
+
+	    /*
+	     * Chew through count items 4000 at a time.
+	     * This is because 4000*14 (biggest %g output plus comma?)
+	     * is just shy of 64k, so we avoid buffer overflows.
+	     */
+	    switch (val.B.t) {
+	    case 'C': case 'c': sz = 4; break;
+	    case 'S': case 's': sz = 6; break;
+	    default:            sz = 14; break;
 	    }
 
-	    case 'B': {
-		uint32_t count = val.B.n, sz, j;
-		unsigned char *s = val.B.s;
-		*fp->uncomp_p++ = val.B.t;
+	    for (j = 0; j < count; j += 4000) {
+		int i_start = j;
+		int i_end = j + 4000 < count ? j + 4000 : count;
+
+		if (end - o->p < 5+(i_end-i_start)*sz) BF_FLUSH();
 
-		/*
-		 * Chew through count items 4000 at a time.
-		 * This is because 4000*14 (biggest %g output plus comma?)
-		 * is just shy of 64k, so we avoid buffer overflows.
-		 */
 		switch (val.B.t) {
-		case 'C': case 'c': sz = 4; break;
-		case 'S': case 's': sz = 6; break;
-		default:            sz = 14; break;
-		}
+		    int i;
+		case 'C':
+		    for (i = i_start; i < i_end; i++, s++) {
+			*o->p++ = ',';
+			o->p = append_int(o->p, (uint8_t)s[0]);
+		    }
+		    break;
 
-		for (j = 0; j < count; j += 4000) {
-		    int i_start = j;
-		    int i_end = j + 4000 < count ? j + 4000 : count;
+		case 'c':
+		    for (i = i_start; i < i_end; i++, s++) {
+			*o->p++ = ',';
+			o->p = append_int(o->p, (int8_t)s[0]);
+		    }
+		    break;
 
-		    if (end - fp->uncomp_p < 5+(i_end-i_start)*sz) BF_FLUSH();
+		case 'S':
+		    for (i = i_start; i < i_end; i++, s+=2) {
+			*o->p++ = ',';
+			o->p = append_int(o->p,
+					      (uint16_t)((s[0] << 0) +
+							 (s[1] << 8)));
+		    }
+		    break;
 
-		    switch (val.B.t) {
-			int i;
-		    case 'C':
-			for (i = i_start; i < i_end; i++, s++) {
-			    *fp->uncomp_p++ = ',';
-			    fp->uncomp_p = append_int(fp->uncomp_p, (uint8_t)s[0]);
-			}
-			break;
+		case 's':
+		    for (i = i_start; i < i_end; i++, s+=2) {
+			*o->p++ = ',';
+			o->p = append_int(o->p,
+					      (int16_t)((s[0] << 0) +
+							(s[1] << 8)));
+		    }
+		    break;
 
-		    case 'c':
-			for (i = i_start; i < i_end; i++, s++) {
-			    *fp->uncomp_p++ = ',';
-			    fp->uncomp_p = append_int(fp->uncomp_p, (int8_t)s[0]);
-			}
-			break;
-
-		    case 'S':
-			for (i = i_start; i < i_end; i++, s+=2) {
-			    *fp->uncomp_p++ = ',';
-			    fp->uncomp_p = append_int(fp->uncomp_p,
-						      (uint16_t)((s[0] << 0) +
-								 (s[1] << 8)));
-			}
-			break;
-
-		    case 's':
-			for (i = i_start; i < i_end; i++, s+=2) {
-			    *fp->uncomp_p++ = ',';
-			    fp->uncomp_p = append_int(fp->uncomp_p,
-						      (int16_t)((s[0] << 0) +
-								(s[1] << 8)));
-			}
-			break;
-
-		    case 'I':
-			for (i = i_start; i < i_end; i++, s+=4) {
-			    *fp->uncomp_p++ = ',';
-			    fp->uncomp_p = append_uint(fp->uncomp_p,
-						       (uint32_t)((s[0] << 0) +
-								  (s[1] << 8) +
-								  (s[2] <<16) +
-								  (s[3] <<24)));
-			}
-			break;
-
-		    case 'i':
-			for (i = i_start; i < i_end; i++, s+=4) {
-			    *fp->uncomp_p++ = ',';
-			    fp->uncomp_p = append_int(fp->uncomp_p,
-						      (int32_t)((s[0] << 0) +
-								(s[1] << 8) +
-								(s[2] <<16) +
-								(s[3] <<24)));
-			}
-			break;
-
-		    case 'f': {
-			union {
-			    float f;
-			    unsigned char c[4];
-			} u;
-			for (i = i_start; i < i_end; i++, s+=4) {
-			    *fp->uncomp_p++ = ',';
-			    u.c[0] = s[0];
-			    u.c[1] = s[1];
-			    u.c[2] = s[2];
-			    u.c[3] = s[3];
-			    fp->uncomp_p += sprintf((char *)fp->uncomp_p, "%g", u.f);
-			}
-			break;
+		case 'I':
+		    for (i = i_start; i < i_end; i++, s+=4) {
+			*o->p++ = ',';
+			o->p = append_uint(o->p,
+					       (uint32_t)((s[0] << 0) +
+							  (s[1] << 8) +
+							  (s[2] <<16) +
+							  (s[3] <<24)));
 		    }
+		    break;
+
+		case 'i':
+		    for (i = i_start; i < i_end; i++, s+=4) {
+			*o->p++ = ',';
+			o->p = append_int(o->p,
+					      (int32_t)((s[0] << 0) +
+							(s[1] << 8) +
+							(s[2] <<16) +
+							(s[3] <<24)));
+		    }
+		    break;
 
-		    default:
-			fprintf(stderr, "Unhandled sub-type of aux type B\n");
+		case 'f': {
+		    union {
+			float f;
+			unsigned char c[4];
+		    } u;
+		    for (i = i_start; i < i_end; i++, s+=4) {
+			*o->p++ = ',';
+			u.c[0] = s[0];
+			u.c[1] = s[1];
+			u.c[2] = s[2];
+			u.c[3] = s[3];
+			o->p += sprintf((char *)o->p, "%g", u.f);
 		    }
+		    break;
 		}
-		break;
-	    }
 
-	    default:
-		fprintf(stderr, "Unhandled auxilary type '%c' in "
-			"bam_put_seq()\n", type);
+		default:
+		    fprintf(stderr, "Unhandled sub-type of aux type B\n");
+		}
 	    }
+	    break;
 	}
 
-	*fp->uncomp_p++ = '\n';
+	default:
+	    fprintf(stderr, "Unhandled auxilary type '%c' in "
+		    "bam_put_seq()\n", type);
+	}
+    }
+
+    *o->p++ = '\n';
+
+    return 0;
+}
+
+/* ----------------------------------------------------------------------
+ * Multi-threaded SAM formatting.
+ *
+ * Records passed to bam_put_seq are copied into a job, which once full
+ * is formatted as SAM text on the thread pool.  The formatted jobs come
+ * back in order on fp->equeue, which is otherwise unused when writing
+ * SAM, and are written out by whichever thread is adding records.
+ */
+typedef struct sam_format_job {
+    struct sam_format_job *next; // free list
+    bam_file_t *fp;
+    unsigned char *recs;         // bam_seq_t copies, each of size ->alloc
+    size_t recs_len, recs_alloc;
+    unsigned char *text;         // the formatted SAM
+    size_t text_len, text_alloc;
+    int err;
+} sam_format_job;
+
+static sam_format_job *sam_format_job_alloc(bam_file_t *fp) {
+    sam_format_job *j = fp->sam_fjob_free;
+
+    if (j) {
+	fp->sam_fjob_free = j->next;
+    } else {
+	if (!(j = calloc(1, sizeof(*j))))
+	    return NULL;
+	if (!(j->text = malloc(SAM_JOB_SIZE + SAM_BUF_SLACK))) {
+	    free(j);
+	    return NULL;
+	}
+	j->text_alloc = SAM_JOB_SIZE;
+	j->fp = fp;
+    }
+
+    j->next = NULL;
+    j->recs_len = j->text_len = 0;
+    j->err = 0;
+
+    return j;
+}
+
+static void sam_format_job_release(bam_file_t *fp, sam_format_job *j) {
+    if (!j)
+	return;
+
+    j->next = fp->sam_fjob_free;
+    fp->sam_fjob_free = j;
+}
+
+/*
+ * Deallocates all format jobs.  The pool must have been flushed first.
+ */
+static void sam_format_jobs_free(bam_file_t *fp) {
+    sam_format_job *j, *next;
+
+    if (fp->equeue && !fp->binary) {
+	t_pool_result *res;
+	while ((res = t_pool_next_result(fp->equeue))) {
+	    sam_format_job_release(fp, res->data);
+	    t_pool_delete_result(res, 0);
+	}
+    }
+
+    sam_format_job_release(fp, fp->sam_fjob);
+    fp->sam_fjob = NULL;
+
+    for (j = fp->sam_fjob_free; j; j = next) {
+	next = j->next;
+	free(j->recs);
+	free(j->text);
+	free(j);
+    }
+    fp->sam_fjob_free = NULL;
+}
+
+/*
+ * The thread pool function: formats all records in a job.
+ */
+static void *sam_format_job_run(void *arg) {
+    sam_format_job *j = (sam_format_job *)arg;
+    sam_buf o;
+    size_t off;
+
+    o.buf = o.p = j->text;
+    o.end = j->text + j->text_alloc;
+    o.bf  = NULL;
+
+    for (off = 0; off < j->recs_len; ) {
+	bam_seq_t *b = (bam_seq_t *)(j->recs + off);
+	off += b->alloc;
+
+	if (sam_format_seq(j->fp, &o, b) < 0) {
+	    j->err = 1;
+	    break;
+	}
+    }
+
+    j->text = o.buf;
+    j->text_alloc = o.end - o.buf;
+    j->text_len = o.p - o.buf;
+
+    return j;
+}
+
+/*
+ * Writes out a formatted job and releases it.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int sam_format_job_write(bam_file_t *fp, sam_format_job *j) {
+    int r = 0;
+
+    /* Anything written before the thread pool was added comes first */
+    if (fp->uncomp_p != fp->uncomp) {
+	if (fp->uncomp_p - fp->uncomp !=
+	    bam_fwrite(fp, fp->uncomp, fp->uncomp_p - fp->uncomp))
+	    r = -1;
+	fp->uncomp_p = fp->uncomp;
+    }
+
+    if (j->err || j->text_len != bam_fwrite(fp, j->text, j->text_len))
+	r = -1;
+
+    sam_format_job_release(fp, j);
+    return r;
+}
+
+/*
+ * Dispatches the current job to the pool and writes out any which have
+ * completed.  If too many are in flight we wait for the oldest.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int sam_format_job_dispatch(bam_file_t *fp) {
+    sam_format_job *j = fp->sam_fjob;
+    t_pool_result *res;
+    int r = 0;
+
+    fp->sam_fjob = NULL;
+    if (t_pool_dispatch(fp->pool, fp->equeue, sam_format_job_run, j) < 0) {
+	sam_format_job_release(fp, j);
+	return -1;
+    }
+    fp->ne_jobs++;
+
+    while ((res = fp->ne_jobs > fp->pool->qsize
+	    ? t_pool_next_result_wait(fp->equeue)
+	    : t_pool_next_result(fp->equeue))) {
+	if (sam_format_job_write(fp, res->data) < 0)
+	    r = -1;
+	t_pool_delete_result(res, 0);
+	fp->ne_jobs--;
+    }
+
+    return r;
+}
+
+/*
+ * Dispatches any partially filled job and writes out all jobs.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int sam_format_jobs_flush(bam_file_t *fp) {
+    int r = 0;
+
+    if (fp->sam_fjob && sam_format_job_dispatch(fp) < 0)
+	r = -1;
 
+    while (fp->ne_jobs) {
+	t_pool_result *res = t_pool_next_result_wait(fp->equeue);
+	if (!res)
+	    return -1;
+	if (sam_format_job_write(fp, res->data) < 0)
+	    r = -1;
+	t_pool_delete_result(res, 0);
+	fp->ne_jobs--;
+    }
+
+    return r;
+}
+
+/*
+ * The multi-threaded SAM part of bam_put_seq.  Errors formatting the
+ * record may not be reported until a later call.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int sam_put_seq_mt(bam_file_t *fp, bam_seq_t *b) {
+    sam_format_job *j = fp->sam_fjob;
+    size_t len = offsetof(bam_seq_t, ref) + b->blk_size;
+    size_t sz = (len + 1 + 7) & ~7;
+    bam_seq_t *c;
+
+    if (!j && !(j = fp->sam_fjob = sam_format_job_alloc(fp)))
+	return -1;
+
+    if (j->recs_len + sz > j->recs_alloc) {
+	size_t a = j->recs_alloc ? j->recs_alloc : SAM_JOB_SIZE;
+	unsigned char *r;
+
+	while (a < j->recs_len + sz)
+	    a *= 2;
+	if (!(r = realloc(j->recs, a)))
+	    return -1;
+	j->recs = r;
+	j->recs_alloc = a;
+    }
+
+    c = (bam_seq_t *)(j->recs + j->recs_len);
+    memcpy(c, b, len);
+    ((unsigned char *)c)[len] = 0; // aux terminator
+    c->alloc = sz;
+    j->recs_len += sz;
+
+    return j->recs_len >= SAM_JOB_SIZE ? sam_format_job_dispatch(fp) : 0;
+}
+/*
+ * Writes a single bam sequence object.
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int bam_put_seq(bam_file_t *fp, bam_seq_t *b) {
+    if (!fp->binary) {
+	/* SAM */
+	sam_buf o;
+	int r;
+
+	if (fp->pool)
+	    return sam_put_seq_mt(fp, b);
+
+	o.buf = fp->uncomp;
+	o.p   = fp->uncomp_p;
+	o.end = fp->uncomp + BGZF_BUFF_SIZE;
+	o.bf  = fp;
+
+	r = sam_format_seq(fp, &o, b);
+	fp->uncomp_p = o.p;
+
+	return r;
     } else {
 	/* BAM */
 	unsigned char *end = fp->uncomp + BGZF_BUFF_SIZE, *ptr;
 	size_t to_write;
 	uint32_t i32;
+	uint64_t off_beg;
 #ifndef ALLOW_UAC
 	int name_len = bam_name_len(b);
 #endif
@@ -3736,6 +4822,7 @@ int bam_put_seq(bam_file_t *fp, bam_seq_t *b) {
 #ifdef ALLOW_UAC
 	/* Room for fixed size bits + name */
 	if (end - fp->uncomp_p < 4) CF_FLUSH();
+	off_beg = fp->u_queued + (fp->uncomp_p - fp->uncomp);
 	to_write = b->blk_size;
 	STORE_UINT32(fp->uncomp_p, to_write);
 
@@ -3743,6 +4830,7 @@ int bam_put_seq(bam_file_t *fp, bam_seq_t *b) {
 #else
 	/* Room for fixed size bits + name */
 	if (end - fp->uncomp_p < 36+257) CF_FLUSH();
+	off_beg = fp->u_queued + (fp->uncomp_p - fp->uncomp);
 	to_write = b->blk_size - (round4(name_len) - name_len);
 	//to_write = b->blk_size;
 	STORE_UINT32(fp->uncomp_p, to_write);
@@ -3803,6 +4891,15 @@ int bam_put_seq(bam_file_t *fp, bam_seq_t *b) {
 	i32          = b->flag_packed;
 	b->flag      = i32 >> 16;
 	b->cigar_len = i32 & 0xffff;
+
+	if (fp->bidx && fp->bidx_fn &&
+	    bam_index_push(fp->bidx, b, off_beg,
+			   fp->u_queued + (fp->uncomp_p - fp->uncomp))) {
+	    fprintf(stderr, "Unable to index BAM output; no index will be "
+		    "written\n");
+	    bam_index_free(fp->bidx);
+	    fp->bidx = NULL;
+	}
     }
 
     return 0;
@@ -3867,7 +4964,7 @@ int bam_write_header(bam_file_t *out) {
 	    len -= sz;
 	}
     } else {
-	if (hp-header != fwrite(header, 1, hp-header, out->fp))
+	if (hp-header != bam_fwrite(out, header, hp-header))
 	    return -1;
     }
 
@@ -3877,6 +4974,103 @@ int bam_write_header(bam_file_t *out) {
 }
 
 
+/*
+ * Seeks to a BGZF virtual offset, discarding any buffered or in-flight
+ * decompressed data.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int bam_seek_voff(bam_file_t *b, uint64_t voff) {
+    size_t skip = voff & 0xffff;
+
+    if (!b->fp || !b->gzip) {
+	fprintf(stderr, "Seeking is only supported on BGZF files\n");
+	return -1;
+    }
+
+    if (b->pool) {
+	t_pool_result *r;
+
+	bgzf_decode_job_release(b, b->job_pending);
+	b->job_pending = NULL;
+
+	// Wait on our own jobs only; the pool may be shared with other files
+	while (!t_pool_results_queue_empty(b->dqueue)) {
+	    if (!(r = t_pool_next_result_wait(b->dqueue)))
+		return -1;
+	    bgzf_decode_job_release(b, r->data);
+	    t_pool_delete_result(r, 0);
+	}
+	b->nd_jobs = 0;
+    }
+
+    if (b->ra) {
+	if (read_ahead_seek(b->ra, voff >> 16, SEEK_SET) != 0) {
+	    fprintf(stderr, "Failed to seek in read-ahead input\n");
+	    return -1;
+	}
+    } else if (fseeko(b->fp, voff >> 16, SEEK_SET) != 0) {
+	perror("fseeko");
+	return -1;
+    }
+
+    b->comp_p    = b->comp;
+    b->comp_sz   = 0;
+    b->uncomp_p  = b->uncomp;
+    b->uncomp_sz = 0;
+    b->next_len  = -1;
+    b->z_finish  = 1;
+    b->eof       = 0;
+    b->eof_block = 0;
+    b->c_pos     = voff >> 16;
+
+    if (bam_uncompress_input(b) < 0)
+	return -1;
+
+    if (skip > b->uncomp_sz) {
+	fprintf(stderr, "Invalid virtual offset in seek\n");
+	return -1;
+    }
+    b->uncomp_p  += skip;
+    b->uncomp_sz -= skip;
+
+    return 0;
+}
+
+/*
+ * Seeks to the first record that may overlap a region, using the index
+ * loaded by bam_index_load().
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int bam_seek_to_refpos(bam_file_t *b, int refid, int64_t start, int64_t end) {
+    uint64_t voff;
+
+    if (!b->bidx) {
+	fprintf(stderr, "Unable to seek: no BAM index loaded\n");
+	return -1;
+    }
+
+    b->range_done = 0;
+
+    switch (bam_index_query(b->bidx, refid, start, end, &voff)) {
+    case 1:
+	return bam_seek_voff(b, voff);
+
+    case 0:
+	// Nothing to seek to. For refid -1 we scan from the current
+	// location, otherwise there is no data in this region.
+	if (refid != -1)
+	    b->range_done = 1;
+	return 0;
+
+    default:
+	return -1;
+    }
+}
+
 /* 
  * Sets options on the bam_file_t. See BAM_OPT_* definitions in bam.h.
  * Use this immediately after opening.
@@ -3908,6 +5102,8 @@ int bam_set_voption(bam_file_t *fd, enum bam_option opt, va_list args) {
 	fd->pool = va_arg(args, t_pool *);
 	fd->equeue = t_results_queue_init();
 	fd->dqueue = t_results_queue_init();
+	if (!fd->bam && !(fd->mode & O_WRONLY))
+	    fd->squeue = t_results_queue_init();
 	break;
 
     case BAM_OPT_BINNING:
@@ -3923,6 +5119,47 @@ int bam_set_voption(bam_file_t *fd, enum bam_option opt, va_list args) {
     case BAM_OPT_OUTPUT_BGZIP_IDX:
         fd->idx_fn =  va_arg(args, char *);
 	break;
+
+    case BAM_OPT_RANGE: {
+	int refid = va_arg(args, int);
+	int64_t start = va_arg(args, int64_t);
+	int64_t end = va_arg(args, int64_t);
+
+	if (bam_seek_to_refpos(fd, refid, start, end))
+	    return -1;
+	fd->range_refid = refid;
+	fd->range_start = start;
+	fd->range_end = end;
+	fd->bseqs_done = 0;
+	break;
+    }
+
+    case BAM_OPT_READ_AHEAD: {
+	size_t ahead = (size_t)va_arg(args, int) << 20;
+
+	if (!fd->fp || fd->ra || (fd->mode & O_WRONLY) || !ahead)
+	    break;
+
+	if (!(fd->ra = read_ahead_open(bam_fread, bam_fseek, bam_ftell,
+				       fd->fp, ahead)))
+	    return -1;
+	break;
+    }
+
+    case BAM_OPT_WRITE_BEHIND: {
+	size_t queue = (size_t)va_arg(args, int) << 20;
+	int flags = va_arg(args, int);
+
+	if (!fd->fp || fd->wb || !(fd->mode & O_WRONLY) || !queue)
+	    break;
+
+	/* Anything stdio still holds must reach the file first */
+	fflush(fd->fp);
+	if (!(fd->wb = write_behind_open(bam_fwrite_cb, bam_ftell, fd->fp,
+					 fileno(fd->fp), queue, flags)))
+	    return -1;
+	break;
+    }
     }
 
     return 0;
@@ -165,6 +165,15 @@ typedef struct {
     bam_seq_t *bs;
     int bs_size;
 
+    /* Storage for records returned by bam_get_seqs() */
+    bam_seq_t **bseqs;
+    int nbseqs;
+    int bseqs_done;       /* 1 after eof, -1 after an error */
+
+    /* Copies of records spanning blocks, used by bam_get_view() */
+    unsigned char *view_buf;
+    size_t view_alloc;
+
     /* Boolean to indicate if we've finished the most recent z stream */
     int z_finish;
 
@@ -195,9 +204,23 @@ typedef struct {
     /* Decoding queue */
     t_results_queue *dqueue;
     void *job_pending;
+    void *last_job;       /* job holding the block in uncomp_p */
+    void *job_free;       /* free list of decode jobs for reuse */
     int eof;
     int nd_jobs, ne_jobs;
 
+    /* SAM parsing queue */
+    t_results_queue *squeue;
+    void *sam_job;        /* job records are currently returned from */
+    void *sam_done;       /* completed jobs taken early from squeue */
+    void *sam_job_free;   /* free list of parse jobs for reuse */
+    int sam_inflight;
+    int sam_eof;          /* 1 at end of input, -1 on read error */
+
+    /* SAM formatting jobs, using equeue */
+    void *sam_fjob;       /* job records are being added to */
+    void *sam_fjob_free;  /* free list of format jobs for reuse */
+
     /* Quality binning */
     enum quality_binning binning;
 
@@ -211,8 +234,68 @@ typedef struct {
     unsigned char bgbuf[Z_BUFF_SIZE];
     unsigned char *bgbuf_p;
     size_t bgbuf_sz;
+
+    /* BAI / CSI index, either loaded or being built (if bidx_fn is set) */
+    struct bam_index *bidx;
+    char *bidx_fn;
+
+    /* File offset of the next BGZF block to read or write */
+    uint64_t c_pos;
+
+    /* Background reading of the input, set by BAM_OPT_READ_AHEAD */
+    struct read_ahead *ra;
+
+    /* Background writing of the output, set by BAM_OPT_WRITE_BEHIND */
+    struct write_behind *wb;
+
+    /* Offsets of the BGZF block in uncomp and the one prior, if reading */
+    uint64_t blk_coff, prev_coff;
+    size_t blk_usz, prev_usz;
+    uint64_t next_voff;
+
+    /* Uncompressed bytes passed to bgzf_block_write and written out */
+    uint64_t u_queued, u_written;
+
+    /* Region filtering; range_refid of -2 implies no range */
+    int range_refid;
+    int64_t range_start, range_end;
+    int range_done;
 } bam_file_t;
 
+/*
+ * A read-only view of a BAM record.  Rather than copying the record into
+ * a bam_seq_t, the pointers refer directly to the decompressed data held
+ * by the bam_file_t.  See bam_get_view().
+ *
+ * The cigar is stored as on disk; little endian and possibly unaligned,
+ * so use bam_view_cigar_op() to access it.
+ */
+typedef struct {
+    int32_t  ref;
+    int64_t  pos;
+    int      name_len;	/* including the nul terminator */
+    int      map_qual;
+    int      bin;
+    int      flag;
+    int      cigar_len;
+    int32_t  len;
+    int32_t  mate_ref;
+    int64_t  mate_pos;
+    int64_t  ins_size;
+
+    const char          *name;
+    const unsigned char *cigar;
+    const unsigned char *seq;	/* 4-bit encoded, as bam_seq() */
+    const unsigned char *qual;
+    const unsigned char *aux;
+    size_t               aux_len;
+} bam_view_t;
+
+static inline uint32_t bam_view_cigar_op(const bam_view_t *v, int i) {
+    const unsigned char *c = v->cigar + 4*i;
+    return c[0] | (c[1]<<8) | (c[2]<<16) | ((uint32_t)c[3]<<24);
+}
+
 /* BAM flags */
 #define BAM_FPAIRED           1
 #define BAM_FPROPER_PAIR      2
@@ -359,13 +442,61 @@ int bam_next_seq(bam_file_t *b, bam_seq_t **bsp);
  * @param bsp Must be non-null, but *bsp may be NULL or an existing
  * bam_seq_t pointer.
  *
+ * If a range has been set with BAM_OPT_RANGE, only sequences
+ * overlapping that range are returned.
+ *
  * @return
  * Returns 1 on success;
- *         0 on eof;
+ *         0 on eof or end of range;
  *        -1 on error.
  */
 int bam_get_seq(bam_file_t *b, bam_seq_t **bsp);
 
+/*! Reads up to n sequences.
+ *
+ * The sequences are held in storage owned by b, which is reused by
+ * subsequent calls, so they are only valid until the next call reading
+ * from b.  They must not be freed.
+ *
+ * @return
+ * Returns the number of sequences filled out in array on success;
+ *         0 on eof or end of range;
+ *        -1 on error.
+ */
+int bam_get_seqs(bam_file_t *b, bam_seq_t **array, int n);
+
+/*! Returns the end of the alignment.
+ *
+ * @return
+ * Returns the 0-based coordinate one beyond the last reference base
+ * covered by b. Unmapped reads are treated as covering one base.
+ */
+int64_t bam_aend(bam_seq_t *b);
+
+/*! Fetches the next record as a read-only view, without copying.
+ *
+ * The view points into the decompressed BGZF block, so is only valid
+ * until the next call that reads from b. Records which straddle a
+ * block boundary are copied into a buffer owned by b. SAM input, and
+ * BAM input while building an index, are decoded into an internal
+ * bam_seq_t instead and the view refers to that.
+ *
+ * Ranges set with BAM_OPT_RANGE are honoured as for bam_get_seq().
+ *
+ * @return
+ * Returns 1 on success;
+ *         0 on eof or end of range;
+ *        -1 on error.
+ */
+int bam_get_view(bam_file_t *b, bam_view_t *v);
+
+/*! Fills out a view referring to the contents of an existing bam_seq_t.
+ *
+ * On big endian systems this converts the bs cigar to little endian, so
+ * bs should not be used as a bam_seq_t afterwards.
+ */
+void bam_seq_view(bam_view_t *v, bam_seq_t *bs);
+
 /*!Looks for aux field 'key' and returns the value.
  * The type is the first char and the value is the 2nd character onwards.
  *
@@ -747,7 +878,10 @@ enum bam_option {
     BAM_OPT_BINNING,
     BAM_OPT_IGNORE_CHKSUM,
     BAM_OPT_WITH_BGZIP_IDX,
-    BAM_OPT_OUTPUT_BGZIP_IDX
+    BAM_OPT_OUTPUT_BGZIP_IDX,
+    BAM_OPT_RANGE,		// int refid, int64_t start, int64_t end
+    BAM_OPT_READ_AHEAD,		// int MB of input to read in advance
+    BAM_OPT_WRITE_BEHIND	// int MB output queue, int WRITE_BEHIND_* flags
 };
 
 /*! Sets options on the bam_file_t.
@@ -780,6 +914,8 @@ int bam_set_voption(bam_file_t *fd, enum bam_option opt, va_list args);
 unsigned char *append_int(unsigned char *cp, int32_t i);
 unsigned char *append_uint(unsigned char *cp, uint32_t i);
 
+#include "io_lib/bam_index.h"
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,945 @@
+/*
+ * Copyright (c) 2026 Genome Research Ltd.
+ * Author(s): James Bonfield
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Support for the BAM binning indices: foo.bam.bai and foo.bam.csi.
+ *
+ * Both formats hold, per reference, a set of bins. Each bin covers a
+ * fixed region of the reference with the smallest covering 1<<min_shift
+ * bases and each level up being 8 times larger.  A record is placed in
+ * the smallest bin that entirely contains it.  Each bin holds a list of
+ * chunks, being start..end virtual offsets of runs of records in that
+ * bin.
+ *
+ * BAI additionally has a linear index giving the offset of the first
+ * record overlapping each 16kb window.  CSI replaces this with a per-bin
+ * "loffset" and permits min_shift and the number of levels (depth) to
+ * be varied so that references over 512Mb may be indexed.
+ *
+ * Both have a pseudo-bin per reference containing the offset range of
+ * all records for that reference and mapped / unmapped counts.
+ *
+ * See the SAM specification for full details.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "io_lib_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+
+#include "io_lib/bam.h"
+#include "io_lib/os.h"
+#include "io_lib/zfio.h"
+
+#ifndef O_BINARY
+#    define O_BINARY 0
+#endif
+
+/* First bin number at a given level; level 0 is the root bin */
+#define BIN_FIRST(l) (((1LL<<(3*(l)))-1)/7)
+#define BIN_PARENT(b) (((b)-1)>>3)
+#define PSEUDO_BIN(idx) (BIN_FIRST((idx)->depth+1)+1)
+
+/*
+ * The generalised form of reg2bin(), from the SAM specification.
+ * Beg and end are 0-based half open.
+ */
+static int64_t idx_reg2bin(int64_t beg, int64_t end, int min_shift, int depth){
+    int l, s = min_shift;
+    int64_t t = BIN_FIRST(depth);
+
+    for (--end, l = depth; l > 0; l--, s += 3, t -= 1LL << (3*l))
+	if (beg>>s == end>>s)
+	    return t + (beg>>s);
+
+    return 0;
+}
+
+bam_index *bam_index_create(int nref, int min_shift, int depth, int csi) {
+    bam_index *idx = calloc(1, sizeof(*idx));
+    if (!idx)
+	return NULL;
+
+    if (nref && !(idx->ref = calloc(nref, sizeof(*idx->ref)))) {
+	free(idx);
+	return NULL;
+    }
+
+    idx->nref      = nref;
+    idx->min_shift = min_shift;
+    idx->depth     = depth;
+    idx->csi       = csi;
+    idx->last_ref  = -1;
+    idx->last_pos  = -1;
+    idx->save_bin  = -1;
+
+    return idx;
+}
+
+void bam_index_free(bam_index *idx) {
+    int i;
+
+    if (!idx)
+	return;
+
+    for (i = 0; i < idx->nref; i++) {
+	bam_index_ref *r = &idx->ref[i];
+
+	if (r->bins) {
+	    HashIter *iter = HashTableIterCreate();
+	    HashItem *hi;
+
+	    while (iter && (hi = HashTableIterNext(r->bins, iter))) {
+		bam_index_bin *bin = (bam_index_bin *)hi->data.p;
+		free(bin->chunk);
+		free(bin);
+	    }
+	    if (iter)
+		HashTableIterDestroy(iter);
+	    HashTableDestroy(r->bins, 0);
+	}
+
+	if (r->intv)
+	    free(r->intv);
+    }
+
+    if (idx->ref)
+	free(idx->ref);
+    if (idx->blk_c)
+	free(idx->blk_c);
+    if (idx->blk_u)
+	free(idx->blk_u);
+
+    free(idx);
+}
+
+/*
+ * Returns the bin structure for a given bin number, optionally creating
+ * it if not already present.
+ *
+ * Returns bin pointer on success
+ *         NULL on failure or if not found and create is false.
+ */
+static bam_index_bin *idx_get_bin(bam_index_ref *r, uint32_t bin, int create) {
+    HashItem *hi;
+    HashData hd;
+    bam_index_bin *b;
+
+    if (!r->bins) {
+	if (!create)
+	    return NULL;
+	if (!(r->bins = HashTableCreate(256, HASH_DYNAMIC_SIZE |
+					HASH_NONVOLATILE_KEYS |
+					HASH_INT_KEYS)))
+	    return NULL;
+    }
+
+    if ((hi = HashTableSearch(r->bins, (char *)(size_t)bin, 8)))
+	return (bam_index_bin *)hi->data.p;
+
+    if (!create)
+	return NULL;
+
+    if (!(b = calloc(1, sizeof(*b))))
+	return NULL;
+    b->bin = bin;
+
+    hd.p = b;
+    if (!HashTableAdd(r->bins, (char *)(size_t)bin, 8, hd, NULL)) {
+	free(b);
+	return NULL;
+    }
+
+    return b;
+}
+
+/*
+ * Appends a chunk to a bin, merging with the previous chunk if they
+ * are contiguous.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int idx_add_chunk(bam_index_ref *r, uint32_t bin,
+			 uint64_t beg, uint64_t end) {
+    bam_index_bin *b = idx_get_bin(r, bin, 1);
+    if (!b)
+	return -1;
+
+    if (b->nchunk && b->chunk[b->nchunk-1].end == beg) {
+	b->chunk[b->nchunk-1].end = end;
+	return 0;
+    }
+
+    if (b->nchunk >= b->achunk) {
+	int a = b->achunk ? b->achunk*2 : 4;
+	bam_index_chunk *c = realloc(b->chunk, a * sizeof(*c));
+	if (!c)
+	    return -1;
+	b->chunk = c;
+	b->achunk = a;
+    }
+
+    b->chunk[b->nchunk].beg = beg;
+    b->chunk[b->nchunk].end = end;
+    b->nchunk++;
+
+    return 0;
+}
+
+/* Completes the pending chunk for the current bin */
+static int idx_save_chunk(bam_index *idx) {
+    if (idx->last_ref < 0 || idx->last_ref >= idx->nref || idx->save_bin < 0)
+	return 0;
+
+    if (idx_add_chunk(&idx->ref[idx->last_ref], idx->save_bin,
+		      idx->save_off, idx->last_off))
+	return -1;
+
+    idx->save_bin = -1;
+    return 0;
+}
+
+/*
+ * Adds a record occupying offsets off_beg to off_end to the index.
+ * Records must be pushed in coordinate sorted order.
+ *
+ * Returns 0 on success
+ *        -1 on failure (eg unsorted data)
+ */
+int bam_index_push(bam_index *idx, bam_seq_t *s,
+		   uint64_t off_beg, uint64_t off_end) {
+    int refid = bam_ref(s);
+    int64_t beg = bam_pos(s), end, bin;
+    int mapped = !(bam_flag(s) & BAM_FUNMAP);
+    bam_index_ref *r;
+
+    if (refid < 0 || beg < 0) {
+	/* Unplaced reads; these must come last */
+	if (idx_save_chunk(idx))
+	    return -1;
+	idx->last_ref = INT_MAX;
+	idx->n_no_coor++;
+	return 0;
+    }
+
+    if (refid >= idx->nref) {
+	bam_index_ref *r = realloc(idx->ref, (refid+1) * sizeof(*r));
+	if (!r)
+	    return -1;
+	memset(&r[idx->nref], 0, (refid+1 - idx->nref) * sizeof(*r));
+	idx->ref = r;
+	idx->nref = refid+1;
+    }
+
+    if (refid != idx->last_ref) {
+	if (refid < idx->last_ref) {
+	    fprintf(stderr, "BAM file is not sorted by coordinate: "
+		    "reference %d follows %d\n", refid, idx->last_ref);
+	    return -1;
+	}
+	if (idx_save_chunk(idx))
+	    return -1;
+	idx->last_ref = refid;
+	idx->ref[refid].off_beg = off_beg;
+    } else if (beg < idx->last_pos) {
+	fprintf(stderr, "BAM file is not sorted by coordinate: "
+		"position %"PRId64" follows %"PRId64"\n",
+		beg+1, idx->last_pos+1);
+	return -1;
+    }
+    idx->last_pos = beg;
+
+    r = &idx->ref[refid];
+    end = bam_aend(s);
+
+    if (end > 1LL << (idx->min_shift + 3*idx->depth)) {
+	fprintf(stderr, "Position %"PRId64" is beyond the maximum supported "
+		"by this index format\n", end);
+	return -1;
+    }
+
+    if (mapped) {
+	/* Linear index: first record overlapping each window */
+	int w, w0 = beg >> idx->min_shift, w1 = (end-1) >> idx->min_shift;
+
+	if (w1 >= r->a_intv) {
+	    int a = r->a_intv ? r->a_intv : 64;
+	    uint64_t *intv;
+
+	    while (a <= w1)
+		a *= 2;
+	    if (!(intv = realloc(r->intv, a * sizeof(*intv))))
+		return -1;
+	    r->intv = intv;
+	    r->a_intv = a;
+	}
+	for (w = r->n_intv; w <= w1; w++)
+	    r->intv[w] = (uint64_t)-1;
+	if (r->n_intv <= w1)
+	    r->n_intv = w1+1;
+
+	for (w = w0; w <= w1; w++)
+	    if (r->intv[w] == (uint64_t)-1)
+		r->intv[w] = off_beg;
+
+	r->n_mapped++;
+    } else {
+	r->n_unmapped++;
+    }
+
+    bin = idx_reg2bin(beg, end, idx->min_shift, idx->depth);
+    if (bin != idx->save_bin) {
+	if (idx_save_chunk(idx))
+	    return -1;
+	idx->save_bin = bin;
+	idx->save_off = off_beg;
+    }
+
+    idx->last_off = off_end;
+    r->off_end = off_end;
+
+    return 0;
+}
+
+/*
+ * When building in uncompressed offset mode, records that a BGZF block
+ * of c_sz bytes, holding u_sz bytes of uncompressed data, has been
+ * written.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int bam_index_add_block(bam_index *idx, uint64_t c_sz, uint64_t u_sz) {
+    if (idx->nblk >= idx->ablk) {
+	uint64_t a = idx->ablk ? idx->ablk*2 : 1024;
+	uint64_t *c = realloc(idx->blk_c, a * sizeof(*c));
+	uint64_t *u = c ? realloc(idx->blk_u, a * sizeof(*u)) : NULL;
+	if (c) idx->blk_c = c;
+	if (u) idx->blk_u = u;
+	if (!c || !u)
+	    return -1;
+	idx->ablk = a;
+    }
+
+    idx->blk_c[idx->nblk] = idx->c_tot;
+    idx->blk_u[idx->nblk] = idx->u_tot;
+    idx->nblk++;
+
+    idx->c_tot += c_sz;
+    idx->u_tot += u_sz;
+
+    return 0;
+}
+
+/* Converts an uncompressed offset to a virtual offset */
+static uint64_t idx_u2v(bam_index *idx, uint64_t u) {
+    uint64_t lo = 0, hi = idx->nblk;
+
+    if (u >= idx->u_tot || !idx->nblk)
+	return idx->c_tot << 16;
+
+    /* Find the last block starting at or before u */
+    while (hi - lo > 1) {
+	uint64_t mid = (lo + hi) / 2;
+	if (idx->blk_u[mid] <= u)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+
+    return (idx->blk_c[lo] << 16) | (u - idx->blk_u[lo]);
+}
+
+/*
+ * Completes an index after the last record has been pushed.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int bam_index_finish(bam_index *idx) {
+    int i, j;
+
+    if (idx_save_chunk(idx))
+	return -1;
+
+    for (i = 0; i < idx->nref; i++) {
+	bam_index_ref *r = &idx->ref[i];
+	HashIter *iter;
+	HashItem *hi;
+	uint64_t last;
+
+	if (!r->bins)
+	    continue;
+
+	if (idx->uoff) {
+	    r->off_beg = idx_u2v(idx, r->off_beg);
+	    r->off_end = idx_u2v(idx, r->off_end);
+	    for (j = 0; j < r->n_intv; j++)
+		if (r->intv[j] != (uint64_t)-1)
+		    r->intv[j] = idx_u2v(idx, r->intv[j]);
+	}
+
+	/*
+	 * Fill in holes in the linear index. No record overlaps a hole, so
+	 * the first record overlapping any later window is a valid bound.
+	 * The last window is never a hole.
+	 */
+	for (last = 0, j = r->n_intv-1; j >= 0; j--) {
+	    if (r->intv[j] == (uint64_t)-1)
+		r->intv[j] = last;
+	    else
+		last = r->intv[j];
+	}
+
+	if (!(iter = HashTableIterCreate()))
+	    return -1;
+
+	while ((hi = HashTableIterNext(r->bins, iter))) {
+	    bam_index_bin *b = (bam_index_bin *)hi->data.p;
+	    int l, n;
+	    int64_t w;
+
+	    if (idx->uoff) {
+		for (j = 0; j < b->nchunk; j++) {
+		    b->chunk[j].beg = idx_u2v(idx, b->chunk[j].beg);
+		    b->chunk[j].end = idx_u2v(idx, b->chunk[j].end);
+		}
+	    }
+
+	    /* Merge chunks that share a BGZF block */
+	    for (n = 0, j = 1; j < b->nchunk; j++) {
+		if (b->chunk[n].end >> 16 >= b->chunk[j].beg >> 16) {
+		    if (b->chunk[n].end < b->chunk[j].end)
+			b->chunk[n].end = b->chunk[j].end;
+		} else {
+		    b->chunk[++n] = b->chunk[j];
+		}
+	    }
+	    if (b->nchunk)
+		b->nchunk = n+1;
+
+	    /* Lowest offset for CSI, from the linear index */
+	    for (l = 0; l < idx->depth && BIN_FIRST(l+1) <= b->bin; l++)
+		;
+	    w = (b->bin - BIN_FIRST(l)) << (3*(idx->depth - l));
+	    b->loff = w < r->n_intv ? r->intv[w] : b->chunk[0].beg;
+	    if (b->loff > b->chunk[0].beg)
+		b->loff = b->chunk[0].beg;
+	}
+
+	HashTableIterDestroy(iter);
+    }
+
+    return 0;
+}
+
+
+/* ----------------------------------------------------------------------
+ * File I/O
+ */
+
+static int zf_put_u32(zfp *fp, uint32_t v) {
+    v = le_int4(v);
+    return zfwrite(&v, 4, 1, fp) == 1 ? 0 : -1;
+}
+
+static int zf_put_u64(zfp *fp, uint64_t v) {
+    v = le_int8(v);
+    return zfwrite(&v, 8, 1, fp) == 1 ? 0 : -1;
+}
+
+static int zf_get_u32(zfp *fp, uint32_t *v) {
+    if (zfread(v, 4, 1, fp) != 1)
+	return -1;
+    *v = le_int4(*v);
+    return 0;
+}
+
+static int zf_get_u64(zfp *fp, uint64_t *v) {
+    if (zfread(v, 8, 1, fp) != 1)
+	return -1;
+    *v = le_int8(*v);
+    return 0;
+}
+
+/*
+ * Writes the index to fn. BAI files are uncompressed; CSI files are
+ * gzip compressed.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int bam_index_save(bam_index *idx, const char *fn) {
+    zfp *fp;
+    int i, j, err = 0;
+    uint32_t pseudo = PSEUDO_BIN(idx);
+
+    if (!(fp = zfopen(fn, idx->csi ? "wz" : "wb"))) {
+	perror(fn);
+	return -1;
+    }
+
+    if (idx->csi) {
+	err |= zfwrite("CSI\1", 1, 4, fp) != 4;
+	err |= zf_put_u32(fp, idx->min_shift);
+	err |= zf_put_u32(fp, idx->depth);
+	err |= zf_put_u32(fp, 0); /* l_aux */
+    } else {
+	err |= zfwrite("BAI\1", 1, 4, fp) != 4;
+    }
+    err |= zf_put_u32(fp, idx->nref);
+
+    for (i = 0; i < idx->nref && !err; i++) {
+	bam_index_ref *r = &idx->ref[i];
+	HashIter *iter;
+	HashItem *hi;
+
+	if (!r->bins) {
+	    err |= zf_put_u32(fp, 0);	    /* n_bin */
+	    if (!idx->csi)
+		err |= zf_put_u32(fp, 0);   /* n_intv */
+	    continue;
+	}
+
+	err |= zf_put_u32(fp, r->bins->nused + 1);
+
+	if (!(iter = HashTableIterCreate())) {
+	    err = 1;
+	    break;
+	}
+	while ((hi = HashTableIterNext(r->bins, iter))) {
+	    bam_index_bin *b = (bam_index_bin *)hi->data.p;
+
+	    err |= zf_put_u32(fp, b->bin);
+	    if (idx->csi)
+		err |= zf_put_u64(fp, b->loff);
+	    err |= zf_put_u32(fp, b->nchunk);
+	    for (j = 0; j < b->nchunk; j++) {
+		err |= zf_put_u64(fp, b->chunk[j].beg);
+		err |= zf_put_u64(fp, b->chunk[j].end);
+	    }
+	}
+	HashTableIterDestroy(iter);
+
+	/* Pseudo-bin */
+	err |= zf_put_u32(fp, pseudo);
+	if (idx->csi)
+	    err |= zf_put_u64(fp, 0);
+	err |= zf_put_u32(fp, 2);
+	err |= zf_put_u64(fp, r->off_beg);
+	err |= zf_put_u64(fp, r->off_end);
+	err |= zf_put_u64(fp, r->n_mapped);
+	err |= zf_put_u64(fp, r->n_unmapped);
+
+	if (!idx->csi) {
+	    err |= zf_put_u32(fp, r->n_intv);
+	    for (j = 0; j < r->n_intv; j++)
+		err |= zf_put_u64(fp, r->intv[j]);
+	}
+    }
+
+    err |= zf_put_u64(fp, idx->n_no_coor);
+
+    if (zfclose(fp) != 0 || err) {
+	fprintf(stderr, "Failed to write index %s\n", fn);
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Reads a BAI or CSI index from an open file.
+ *
+ * Returns index on success
+ *         NULL on failure
+ */
+static bam_index *bam_index_read(zfp *fp) {
+    char magic[4];
+    uint32_t nref, i, j, k, u32;
+    int csi, min_shift = 14, depth = 5;
+    bam_index *idx;
+
+    if (zfread(magic, 1, 4, fp) != 4)
+	return NULL;
+
+    if (memcmp(magic, "BAI\1", 4) == 0) {
+	csi = 0;
+    } else if (memcmp(magic, "CSI\1", 4) == 0) {
+	uint32_t l_aux;
+	char aux[256];
+
+	csi = 1;
+	if (zf_get_u32(fp, &u32)) return NULL;
+	min_shift = u32;
+	if (zf_get_u32(fp, &u32)) return NULL;
+	depth = u32;
+	if (zf_get_u32(fp, &l_aux)) return NULL;
+	while (l_aux) {
+	    size_t l = l_aux < 256 ? l_aux : 256;
+	    if (zfread(aux, 1, l, fp) != l)
+		return NULL;
+	    l_aux -= l;
+	}
+	if (min_shift < 1 || min_shift > 32 || depth < 0 || depth > 10)
+	    return NULL;
+    } else {
+	return NULL;
+    }
+
+    if (zf_get_u32(fp, &nref) || nref > INT_MAX)
+	return NULL;
+
+    if (!(idx = bam_index_create(nref, min_shift, depth, csi)))
+	return NULL;
+
+    for (i = 0; i < nref; i++) {
+	bam_index_ref *r = &idx->ref[i];
+	uint32_t n_bin;
+
+	if (zf_get_u32(fp, &n_bin))
+	    goto err;
+
+	for (j = 0; j < n_bin; j++) {
+	    uint32_t bin, n_chunk;
+	    uint64_t loff = 0;
+	    bam_index_bin *b;
+
+	    if (zf_get_u32(fp, &bin))
+		goto err;
+	    if (csi && zf_get_u64(fp, &loff))
+		goto err;
+	    if (zf_get_u32(fp, &n_chunk) || n_chunk > INT_MAX/2)
+		goto err;
+
+	    if (bin == PSEUDO_BIN(idx)) {
+		if (n_chunk != 2 ||
+		    zf_get_u64(fp, &r->off_beg) ||
+		    zf_get_u64(fp, &r->off_end) ||
+		    zf_get_u64(fp, &r->n_mapped) ||
+		    zf_get_u64(fp, &r->n_unmapped))
+		    goto err;
+		continue;
+	    }
+
+	    if (!(b = idx_get_bin(r, bin, 1)))
+		goto err;
+	    b->loff = loff;
+	    if (n_chunk) {
+		if (!(b->chunk = malloc(n_chunk * sizeof(*b->chunk))))
+		    goto err;
+		b->achunk = n_chunk;
+	    }
+	    for (k = 0; k < n_chunk; k++) {
+		if (zf_get_u64(fp, &b->chunk[k].beg) ||
+		    zf_get_u64(fp, &b->chunk[k].end))
+		    goto err;
+	    }
+	    b->nchunk = n_chunk;
+	}
+
+	if (!csi) {
+	    if (zf_get_u32(fp, &u32) || u32 > INT_MAX)
+		goto err;
+	    if (u32) {
+		if (!(r->intv = malloc(u32 * sizeof(*r->intv))))
+		    goto err;
+		r->n_intv = r->a_intv = u32;
+		for (k = 0; k < u32; k++)
+		    if (zf_get_u64(fp, &r->intv[k]))
+			goto err;
+	    }
+	}
+    }
+
+    /* Optional */
+    if (zf_get_u64(fp, &idx->n_no_coor))
+	idx->n_no_coor = 0;
+
+    return idx;
+
+ err:
+    bam_index_free(idx);
+    return NULL;
+}
+
+/*
+ * Loads a BAM index into memory.
+ *
+ * fn may either be the index filename itself or the filename of the BAM
+ * file, in which case fn.bai and fn.csi are tried in turn.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int bam_index_load(bam_file_t *b, const char *fn) {
+    char fn2[PATH_MAX];
+    zfp *fp = NULL;
+    size_t l = strlen(fn);
+    bam_index *idx;
+
+    if (l >= 4 && (strcmp(fn+l-4, ".bai") == 0 ||
+		   strcmp(fn+l-4, ".csi") == 0)) {
+	snprintf(fn2, PATH_MAX, "%s", fn);
+	fp = zfopen(fn2, "rb");
+    } else {
+	snprintf(fn2, PATH_MAX, "%s.bai", fn);
+	if (!(fp = zfopen(fn2, "rb"))) {
+	    snprintf(fn2, PATH_MAX, "%s.csi", fn);
+	    fp = zfopen(fn2, "rb");
+	}
+    }
+
+    if (!fp) {
+	fprintf(stderr, "Unable to open index for %s\n", fn);
+	return -1;
+    }
+
+    idx = bam_index_read(fp);
+    zfclose(fp);
+
+    if (!idx) {
+	fprintf(stderr, "Malformed index file %s\n", fn2);
+	return -1;
+    }
+
+    if (b->bidx)
+	bam_index_free(b->bidx);
+    b->bidx = idx;
+
+    return 0;
+}
+
+/*
+ * Finds the virtual offset of the first record which may overlap
+ * refid:start-end (1-based inclusive).
+ *
+ * Returns 1 and fills out *voff on success
+ *         0 if no records could overlap
+ *        -1 on failure
+ */
+int bam_index_query(bam_index *idx, int refid, int64_t start, int64_t end,
+		    uint64_t *voff) {
+    int64_t beg, max_end = 1LL << (idx->min_shift + 3*idx->depth);
+    uint64_t min_off = 0, best = (uint64_t)-1;
+    bam_index_ref *r;
+    int l, s;
+    int64_t t;
+
+    if (refid == -1) {
+	/* Unplaced reads follow the last placed read */
+	int i, found = 0;
+	for (i = 0; i < idx->nref; i++) {
+	    if (!idx->ref[i].bins)
+		continue;
+	    if (!found || *voff < idx->ref[i].off_end)
+		*voff = idx->ref[i].off_end;
+	    found = 1;
+	}
+	return found;
+    }
+
+    if (refid < 0 || refid >= idx->nref)
+	return 0;
+
+    r = &idx->ref[refid];
+    if (!r->bins)
+	return 0;
+
+    /* Convert to 0-based half-open */
+    beg = start > 0 ? start-1 : 0;
+    if (end > max_end)
+	end = max_end;
+    if (end <= beg)
+	return 0;
+
+    /* Lower bound on offsets of records overlapping beg */
+    if (idx->csi) {
+	int64_t bin = idx_reg2bin(beg, beg+1, idx->min_shift, idx->depth);
+	for (;;) {
+	    bam_index_bin *b = idx_get_bin(r, bin, 0);
+	    if (b) {
+		min_off = b->loff;
+		break;
+	    }
+	    if (bin == 0)
+		break;
+	    bin = BIN_PARENT(bin);
+	}
+    } else if (r->n_intv) {
+	int64_t w = beg >> idx->min_shift;
+	min_off = r->intv[w < r->n_intv ? w : r->n_intv-1];
+    }
+
+    /* Check all bins overlapping beg..end */
+    for (l = 0, t = 0, s = idx->min_shift + 3*idx->depth;
+	 l <= idx->depth;
+	 s -= 3, t += 1LL << (3*l), l++) {
+	int64_t bin, b1 = t + (beg>>s), b2 = t + ((end-1)>>s);
+
+	for (bin = b1; bin <= b2; bin++) {
+	    bam_index_bin *b = idx_get_bin(r, bin, 0);
+	    int j;
+
+	    if (!b)
+		continue;
+
+	    for (j = 0; j < b->nchunk; j++) {
+		if (b->chunk[j].end > min_off && b->chunk[j].beg < best)
+		    best = b->chunk[j].beg;
+	    }
+	}
+    }
+
+    if (best == (uint64_t)-1)
+	return 0;
+
+    *voff = best > min_off ? best : min_off;
+    return 1;
+}
+
+/*
+ * Builds a BAM index; see bam_index.h for details.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int bam_index_build(bam_file_t *b, const char *fn, int min_shift) {
+    size_t l = strlen(fn);
+    char *fn_idx;
+    int csi, depth = 5, i, r;
+    int64_t max_len = 0, s;
+    bam_index *idx, *old_idx;
+    bam_seq_t *bs = NULL;
+
+    if (!b->header) {
+	fprintf(stderr, "bam_index_build: header has not been set\n");
+	return -1;
+    }
+
+    if (!(fn_idx = malloc(l+5)))
+	return -1;
+    strcpy(fn_idx, fn);
+
+    if (l >= 4 && strcmp(fn+l-4, ".csi") == 0) {
+	csi = 1;
+    } else if (l >= 4 && strcmp(fn+l-4, ".bai") == 0) {
+	csi = 0;
+	if (min_shift && min_shift != 14) {
+	    fprintf(stderr, "BAI indices require a min_shift of 14\n");
+	    free(fn_idx);
+	    return -1;
+	}
+    } else {
+	csi = min_shift ? 1 : 0;
+	strcpy(fn_idx+l, csi ? ".csi" : ".bai");
+    }
+    if (!min_shift)
+	min_shift = 14;
+
+    for (i = 0; i < b->header->nref; i++)
+	if (max_len < b->header->ref[i].len)
+	    max_len = b->header->ref[i].len;
+    max_len += 256;
+
+    if (csi) {
+	for (depth = 0, s = 1LL << min_shift; max_len > s; depth++, s <<= 3)
+	    ;
+    } else if (max_len > 1LL << 29) {
+	fprintf(stderr, "Reference too long for a BAI index; use CSI\n");
+	free(fn_idx);
+	return -1;
+    }
+
+    if (!(idx = bam_index_create(b->header->nref, min_shift, depth, csi))) {
+	free(fn_idx);
+	return -1;
+    }
+
+    if (b->mode & O_WRONLY) {
+	/* Generated on the fly by bam_put_seq and written in bam_close */
+	if (!b->binary) {
+	    fprintf(stderr, "Only BAM output can be indexed\n");
+	    goto err;
+	}
+	idx->uoff = 1;
+
+	/* Blocks written prior to now, eg the header */
+	idx->c_tot = b->c_pos;
+	idx->u_tot = b->u_written;
+
+	if (b->bidx)
+	    bam_index_free(b->bidx);
+	if (b->bidx_fn)
+	    free(b->bidx_fn);
+	b->bidx = idx;
+	b->bidx_fn = fn_idx;
+	return 0;
+    }
+
+    if (!b->bam || !b->gzip) {
+	fprintf(stderr, "Only BGZF compressed BAM files can be indexed\n");
+	goto err;
+    }
+
+    /* bam_get_seq() pushes to b->bidx while b->bidx_fn is set */
+    old_idx = b->bidx;
+    b->bidx = idx;
+    b->bidx_fn = fn_idx;
+
+    while ((r = bam_get_seq(b, &bs)) > 0)
+	;
+    if (bs)
+	free(bs);
+
+    b->bidx = old_idx;
+    b->bidx_fn = NULL;
+
+    if (r < 0 || bam_index_finish(idx) || bam_index_save(idx, fn_idx))
+	goto err;
+
+    bam_index_free(idx);
+    free(fn_idx);
+    return 0;
+
+ err:
+    bam_index_free(idx);
+    free(fn_idx);
+    return -1;
+}
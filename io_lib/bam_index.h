@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2026 Genome Research Ltd.
+ * Author(s): James Bonfield
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*! \file
+ * BAM index support: the binning index formats .bai and .csi.
+ *
+ * This is included from bam.h and should not be included directly.
+ */
+
+#ifndef _BAM_INDEX_H_
+#define _BAM_INDEX_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * File offsets in the index are BGZF "virtual offsets"; the position of
+ * the compressed block in the file shifted left by 16 bits, ORed with
+ * the offset into the uncompressed contents of that block.
+ */
+typedef struct {
+    uint64_t beg, end;
+} bam_index_chunk;
+
+typedef struct {
+    uint32_t bin;
+    uint64_t loff;		/* CSI only: lowest offset of any record */
+    int nchunk, achunk;
+    bam_index_chunk *chunk;
+} bam_index_bin;
+
+typedef struct {
+    HashTable *bins;		/* bin number => bam_index_bin */
+    int n_intv, a_intv;		/* Linear index, BAI only */
+    uint64_t *intv;
+    uint64_t off_beg, off_end;	/* Meta-data held in the pseudo-bin */
+    uint64_t n_mapped, n_unmapped;
+} bam_index_ref;
+
+typedef struct bam_index {
+    int csi;			/* 0 for .bai, 1 for .csi */
+    int min_shift, depth;	/* 14 and 5 for .bai */
+    int nref;
+    bam_index_ref *ref;
+    uint64_t n_no_coor;
+
+    /* Building state */
+    int last_ref;
+    int64_t last_pos;
+    int64_t save_bin;
+    uint64_t save_off, last_off;
+
+    /*
+     * When building while writing we do not know the compressed offsets
+     * of each record until the block holding it has been written, so we
+     * store uncompressed offsets and a map of block boundaries instead.
+     * These are converted to virtual offsets in bam_index_finish().
+     */
+    int uoff;
+    uint64_t nblk, ablk;
+    uint64_t *blk_c, *blk_u;
+    uint64_t c_tot, u_tot;
+} bam_index;
+
+
+/*! Builds a BAM index.
+ *
+ * If 'b' is open for reading then the rest of the file is read and the
+ * index is written immediately.  Normally this would be called on a
+ * newly opened file.
+ *
+ * If 'b' is open for writing then the index is generated on the fly as
+ * bam_put_seq() is called and is written out by bam_close().  Call this
+ * after setting the header, but prior to writing any sequences.
+ *
+ * min_shift of 0 produces a .bai index. Otherwise a .csi index is made
+ * using min_shift as the size of the smallest bin (BAI uses 14).
+ * If fn ends in ".bai" or ".csi" it is used as-is, with .csi implying
+ * a min_shift of 14 when none was specified, otherwise the
+ * appropriate suffix is appended.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure.
+ */
+int bam_index_build(bam_file_t *b, const char *fn, int min_shift);
+
+/*! Loads a BAM index into memory.
+ *
+ * fn may either be the index filename itself or the filename of the BAM
+ * file, in which case fn.bai and fn.csi are tried in turn.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure.
+ */
+int bam_index_load(bam_file_t *b, const char *fn);
+
+/*! Deallocates a bam_index.
+ */
+void bam_index_free(bam_index *idx);
+
+/*! Seeks to the first record that may overlap a region.
+ *
+ * Requires a loaded index. Refid -1 seeks to the unplaced reads at the
+ * end of the file. Start and end are 1-based inclusive coordinates.
+ *
+ * Note this only seeks; use BAM_OPT_RANGE to also filter the records
+ * returned by bam_get_seq() to those overlapping the region.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure.
+ */
+int bam_seek_to_refpos(bam_file_t *b, int refid, int64_t start, int64_t end);
+
+/* ----------------------------------------------------------------------
+ * Lower level functions used by bam.c.
+ */
+
+/*
+ * Creates an empty index for nref references, using depth levels of
+ * bins with the smallest being 1<<min_shift bases.
+ *
+ * Returns index on success
+ *         NULL on failure
+ */
+bam_index *bam_index_create(int nref, int min_shift, int depth, int csi);
+
+/*
+ * Adds a record occupying offsets off_beg to off_end to the index.
+ * Records must be pushed in coordinate sorted order.
+ *
+ * Returns 0 on success
+ *        -1 on failure (eg unsorted data)
+ */
+int bam_index_push(bam_index *idx, bam_seq_t *s,
+		   uint64_t off_beg, uint64_t off_end);
+
+/*
+ * When building in uncompressed offset mode, records that a BGZF block
+ * of c_sz bytes, holding u_sz bytes of uncompressed data, has been
+ * written.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int bam_index_add_block(bam_index *idx, uint64_t c_sz, uint64_t u_sz);
+
+/*
+ * Completes an index after the last record has been pushed.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int bam_index_finish(bam_index *idx);
+
+/*
+ * Writes the index to fn.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int bam_index_save(bam_index *idx, const char *fn);
+
+/*
+ * Finds the virtual offset of the first record which may overlap
+ * refid:start-end (1-based inclusive).
+ *
+ * Returns 1 and fills out *voff on success
+ *         0 if no records could overlap
+ *        -1 on failure
+ */
+int bam_index_query(bam_index *idx, int refid, int64_t start, int64_t end,
+		    uint64_t *voff);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
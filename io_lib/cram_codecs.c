@@ -333,7 +333,7 @@ int cram_external_decode_int(cram_slice *slice, cram_codec *c,
     cram_block *b;
 
     /* Find the external block */
-    b = cram_get_block_by_id(slice, c->external.content_id);
+    b = cram_fetch_block_by_id(slice, c->external.content_id);
     if (!b)
         return *out_size?-1:0;
 
@@ -353,7 +353,7 @@ int cram_external_decode_long(cram_slice *slice, cram_codec *c,
     cram_block *b;
 
     /* Find the external block */
-    b = cram_get_block_by_id(slice, c->external.content_id);
+    b = cram_fetch_block_by_id(slice, c->external.content_id);
     if (!b)
         return *out_size?-1:0;
 
@@ -373,7 +373,7 @@ int cram_external_decode_char(cram_slice *slice, cram_codec *c,
     cram_block *b;
 
     /* Find the external block */
-    b = cram_get_block_by_id(slice, c->external.content_id);
+    b = cram_fetch_block_by_id(slice, c->external.content_id);
     if (!b)
         return *out_size?-1:0;
 
@@ -394,7 +394,7 @@ static int cram_external_decode_block(cram_slice *slice, cram_codec *c,
     cram_block *b = NULL;
 
     /* Find the external block */
-    b = cram_get_block_by_id(slice, c->external.content_id);
+    b = cram_fetch_block_by_id(slice, c->external.content_id);
     if (!b)
         return *out_size?-1:0;
 
@@ -910,6 +910,8 @@ void cram_huffman_decode_free(cram_codec *c) {
 
     if (c->huffman.codes)
 	free(c->huffman.codes);
+    if (c->huffman.lut)
+	free(c->huffman.lut);
     free(c);
 }
 
@@ -932,42 +934,130 @@ int cram_huffman_decode_char0(cram_slice *slice, cram_codec *c,
     return 0;
 }
 
-int cram_huffman_decode_char(cram_slice *slice, cram_codec *c,
-			     cram_block *in, char *out, int *out_size) {
-    int i, n, ncodes = c->huffman.ncodes;
+/*
+ * Loads the bits of 'in' from bit offset pos (of end) into a 64-bit
+ * buffer, MSB first and zero padded.  Returns the number of valid bits.
+ */
+static inline int cram_huffman_fill(cram_block *in, size_t pos, size_t end,
+				    uint64_t *buf) {
+    size_t byte = pos >> 3;
+    uint64_t v = 0;
+    int i, n = in->uncomp_size - byte;
+
+    if (n <= 0) {
+	*buf = 0;
+	return 0;
+    }
+    if (n > 8)
+	n = 8;
+    for (i = 0; i < n; i++)
+	v = (v << 8) | in->data[byte+i];
+    v <<= 8*(8-n);
+
+    *buf = v << (pos & 7);
+    return end - pos < 64 - (pos & 7) ? end - pos : 64 - (pos & 7);
+}
+
+/*
+ * Decodes one symbol a bit at a time, for codes too long for the lookup
+ * table.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_huffman_decode_slow(cram_codec *c, cram_block *in,
+				    int64_t *sym) {
     const cram_huffman_code * const codes = c->huffman.codes;
+    int ncodes = c->huffman.ncodes;
+    int idx = 0;
+    int val = 0, len = 0, last_len = 0;
 
-    for (i = 0, n = *out_size; i < n; i++) {
-	int idx = 0;
-	int val = 0, len = 0, last_len = 0;
+    for (;;) {
+	int dlen = codes[idx].len - last_len;
+	if (cram_not_enough_bits(in, dlen))
+	    return -1;
 
-	for (;;) {
-	    int dlen = codes[idx].len - last_len;
-	    if (cram_not_enough_bits(in, dlen))
-		return -1;
+	//val <<= dlen;
+	//val  |= get_bits_MSB(in, dlen);
+	//last_len = (len += dlen);
 
-	    //val <<= dlen;
-	    //val  |= get_bits_MSB(in, dlen);
-	    //last_len = (len += dlen);
+	last_len = (len += dlen);
+	for (; dlen; dlen--) GET_BIT_MSB(in, val);
 
-	    last_len = (len += dlen);
-	    for (; dlen; dlen--) GET_BIT_MSB(in, val);
+	idx = val - codes[idx].p;
+	if (idx >= ncodes || idx < 0)
+	    return -1;
 
-	    idx = val - codes[idx].p;
-	    if (idx >= ncodes || idx < 0)
+	if (codes[idx].code == val && codes[idx].len == len) {
+	    *sym = codes[idx].symbol;
+	    return 0;
+	}
+    }
+}
+
+/*
+ * Decodes n symbols to out, as 1, 4 or 8 byte integers according to
+ * 'size'.  Most codes are resolved with a single lookup table probe,
+ * peeking at the input via a 64-bit buffer.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static inline int cram_huffman_decode_n(cram_codec *c, cram_block *in,
+					char *out, int n, int size) {
+    const cram_huffman_code * const codes = c->huffman.codes;
+    const uint32_t * const lut = c->huffman.lut;
+    int lut_bits = c->huffman.lut_bits;
+    size_t pos = (size_t)in->byte*8 + 7 - in->bit;
+    size_t end = (size_t)in->uncomp_size*8;
+    uint64_t buf = 0;
+    int nbuf = 0, i;
+
+    if (pos > end)
+	return -1;
+
+    for (i = 0; i < n; i++) {
+	int64_t sym;
+	uint32_t e;
+
+	if (nbuf < lut_bits)
+	    nbuf = cram_huffman_fill(in, pos, end, &buf);
+
+	e = lut[buf >> (64 - lut_bits)];
+	if (e && (e & 31) <= nbuf) {
+	    sym = codes[e >> 5].symbol;
+	    buf <<= e & 31;
+	    nbuf -= e & 31;
+	    pos  += e & 31;
+	} else {
+	    in->byte = pos >> 3;
+	    in->bit = 7 - (pos & 7);
+	    if (cram_huffman_decode_slow(c, in, &sym) < 0)
 		return -1;
+	    pos = (size_t)in->byte*8 + 7 - in->bit;
+	    nbuf = 0;
+	}
 
-	    if (codes[idx].code == val && codes[idx].len == len) {
-		if (out)
-		    out[i] = codes[idx].symbol;
-		break;
+	if (out) {
+	    switch (size) {
+	    case 1: out[i] = sym; break;
+	    case 4: ((int32_t *)out)[i] = sym; break;
+	    case 8: ((int64_t *)out)[i] = sym; break;
 	    }
 	}
     }
 
+    in->byte = pos >> 3;
+    in->bit = 7 - (pos & 7);
+
     return 0;
 }
 
+int cram_huffman_decode_char(cram_slice *slice, cram_codec *c,
+			     cram_block *in, char *out, int *out_size) {
+    return cram_huffman_decode_n(c, in, out, *out_size, 1);
+}
+
 int cram_huffman_decode_int0(cram_slice *slice, cram_codec *c,
 			     cram_block *in, char *out, int *out_size) {
     int32_t *out_i = (int32_t *)out;
@@ -983,39 +1073,7 @@ int cram_huffman_decode_int0(cram_slice *slice, cram_codec *c,
 
 int cram_huffman_decode_int(cram_slice *slice, cram_codec *c,
 			    cram_block *in, char *out, int *out_size) {
-    int32_t *out_i = (int32_t *)out;
-    int i, n, ncodes = c->huffman.ncodes;
-    const cram_huffman_code * const codes = c->huffman.codes;
-
-    for (i = 0, n = *out_size; i < n; i++) {
-	int idx = 0;
-	int val = 0, len = 0, last_len = 0;
-
-	// Now one bit at a time for remaining checks
-	for (;;) {
-	    int dlen = codes[idx].len - last_len;
-	    if (cram_not_enough_bits(in, dlen))
-		return -1;
-	    
-	    //val <<= dlen;
-	    //val  |= get_bits_MSB(in, dlen);
-	    //last_len = (len += dlen);
-
-	    last_len = (len += dlen);
-	    for (; dlen; dlen--) GET_BIT_MSB(in, val);
-
-	    idx = val - codes[idx].p;
-	    if (idx >= ncodes || idx < 0)
-		return -1;
-
-	    if (codes[idx].code == val && codes[idx].len == len) {
-		out_i[i] = codes[idx].symbol;
-		break;
-	    }
-	}
-    }
-
-    return 0;
+    return cram_huffman_decode_n(c, in, out, *out_size, 4);
 }
 
 int cram_huffman_decode_long0(cram_slice *slice, cram_codec *c,
@@ -1033,39 +1091,7 @@ int cram_huffman_decode_long0(cram_slice *slice, cram_codec *c,
 
 int cram_huffman_decode_long(cram_slice *slice, cram_codec *c,
 			     cram_block *in, char *out, int *out_size) {
-    int64_t *out_i = (int64_t *)out;
-    int i, n, ncodes = c->huffman.ncodes;
-    const cram_huffman_code * const codes = c->huffman.codes;
-
-    for (i = 0, n = *out_size; i < n; i++) {
-	int idx = 0;
-	int val = 0, len = 0, last_len = 0;
-
-	// Now one bit at a time for remaining checks
-	for (;;) {
-	    int dlen = codes[idx].len - last_len;
-	    if (cram_not_enough_bits(in, dlen))
-		return -1;
-
-	    //val <<= dlen;
-	    //val  |= get_bits_MSB(in, dlen);
-	    //last_len = (len += dlen);
-
-	    last_len = (len += dlen);
-	    for (; dlen; dlen--) GET_BIT_MSB(in, val);
-
-	    idx = val - codes[idx].p;
-	    if (idx >= ncodes || idx < 0)
-		return -1;
-
-	    if (codes[idx].code == val && codes[idx].len == len) {
-		out_i[i] = codes[idx].symbol;
-		break;
-	    }
-	}
-    }
-
-    return 0;
+    return cram_huffman_decode_n(c, in, out, *out_size, 8);
 }
 
 /*
@@ -1176,6 +1202,35 @@ cram_codec *cram_huffman_decode_init(char *data, int size,
 	codes[i].p = j;
     }
 
+    /*
+     * Build the lookup table.  Each code of up to lut_bits long fills
+     * every entry starting with that code.
+     */
+    if (max_len > 0) {
+	int lut_bits = max_len < HUFF_LUT_BITS ? max_len : HUFF_LUT_BITS;
+	uint32_t *lut = calloc(1 << lut_bits, sizeof(*lut));
+	if (!lut) {
+	    free(codes);
+	    free(h);
+	    return NULL;
+	}
+
+	for (i = 0; i < ncodes; i++) {
+	    int len = codes[i].len, k;
+	    uint32_t base;
+
+	    if (len < 1 || len > lut_bits || (codes[i].code >> len))
+		continue;
+
+	    base = codes[i].code << (lut_bits - len);
+	    for (k = 0; k < 1 << (lut_bits - len); k++)
+		lut[base + k] = (i << 5) | len;
+	}
+
+	h->huffman.lut = lut;
+	h->huffman.lut_bits = lut_bits;
+    }
+
 //    puts("==HUFF LEN==");
 //    for (i = 0; i <= last_len+1; i++) {
 //	printf("len %d=%d prefix %d\n", i, h->huffman.lengths[i], h->huffman.prefix[i]); 
@@ -1751,7 +1806,7 @@ static int cram_byte_array_stop_decode_char(cram_slice *slice, cram_codec *c,
     char *cp, ch;
     cram_block *b = NULL;
 
-    b = cram_get_block_by_id(slice, c->byte_array_stop.content_id);
+    b = cram_fetch_block_by_id(slice, c->byte_array_stop.content_id);
     if (!b)
         return *out_size?-1:0;
 
@@ -1789,7 +1844,7 @@ int cram_byte_array_stop_decode_block(cram_slice *slice, cram_codec *c,
     char *cp, *out_cp, *cp_end;
     char stop;
 
-    b = cram_get_block_by_id(slice, c->byte_array_stop.content_id);
+    b = cram_fetch_block_by_id(slice, c->byte_array_stop.content_id);
     if (!b)
         return *out_size?-1:0;
 
@@ -2096,6 +2151,7 @@ int cram_codec_decoder2encoder(cram_fd *fd, cram_codec *c) {
 	t->codec = E_HUFFMAN;
 	t->free = cram_huffman_encode_free;
 	t->store = cram_huffman_encode_store;
+	free(c->huffman.lut);
 	t->e_huffman.codes = c->huffman.codes;
 	t->e_huffman.nvals = c->huffman.ncodes;
 	for (j = 0; j < t->e_huffman.nvals; j++) {
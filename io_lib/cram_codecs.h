@@ -62,9 +62,18 @@ typedef struct {
     int32_t len;
 } cram_huffman_code;
 
+/*
+ * The lookup table is indexed by the next lut_bits bits of input, giving
+ * (code index << 5) | code length for any code of up to lut_bits long.
+ * Entries of 0 mean a longer (or invalid) code, decoded via codes[].
+ */
+#define HUFF_LUT_BITS 10
+
 typedef struct {
     int ncodes;
     cram_huffman_code *codes;
+    uint32_t *lut;
+    int lut_bits;
 } cram_huffman_decoder;
 
 #define MAX_HUFF 128
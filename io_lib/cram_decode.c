@@ -600,6 +600,63 @@ cram_block_compression_hdr *cram_decode_compression_header(cram_fd *fd,
 }
 
 
+/*
+ * Blocks smaller than this are not worth handing to another thread and
+ * are left to be uncompressed on demand by the codecs.
+ */
+#define PARALLEL_BLOCK_MIN 65536
+
+/* Uncompresses the i-th block of an array; called via t_pool_run_all() */
+static int cram_uncompress_block_i(void *arg, int i) {
+    cram_block **b = (cram_block **)arg;
+    return cram_uncompress_block(b[i]);
+}
+
+/*
+ * With CRAM_OPT_PARALLEL_BLOCKS enabled we uncompress the large external
+ * blocks of a slice up front, sharing them out between any idle threads
+ * in the pool, rather than one at a time as the codecs first read them.
+ * Otherwise a single large slice, as is common with long reads, is
+ * decoded at the speed of one thread.
+ *
+ * block_used[j] is set for each block we need, or is NULL for all blocks.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_uncompress_slice_blocks(cram_fd *fd, cram_slice *s,
+					int *block_used) {
+    cram_block **b;
+    int j, n = 0, r;
+
+    if (!fd->parallel_blocks || !fd->pool)
+	return 0;
+
+    if (!(b = malloc(s->hdr->num_blocks * sizeof(*b))))
+	return -1;
+
+    for (j = 1; j < s->hdr->num_blocks; j++) {
+	cram_block *blk = s->block[j];
+
+	if (block_used && !block_used[j])
+	    continue;
+	if (blk->content_type != EXTERNAL)
+	    continue;
+	if (blk->method == RAW && blk->crc32_checked)
+	    continue;
+	if (blk->comp_size < PARALLEL_BLOCK_MIN)
+	    continue;
+
+	b[n++] = blk;
+    }
+
+    // Nothing gained from a single block
+    r = n > 1 ? t_pool_run_all(fd->pool, n, cram_uncompress_block_i, b) : 0;
+
+    free(b);
+    return r;
+}
+
 /*
  * Note we also need to scan through the record encoding map to
  * see which data series share the same block, either external or
@@ -607,6 +664,12 @@ cram_block_compression_hdr *cram_decode_compression_header(cram_fd *fd,
  * are also encoded in the same block then we need to add those in
  * as a dependency in order to correctly decode BF.
  *
+ * Only the CORE block is uncompressed here, plus with
+ * CRAM_OPT_PARALLEL_BLOCKS any large blocks we know will be needed.
+ * Other external blocks are left for the codecs to uncompress when they
+ * first read from them, so blocks holding unwanted data series are
+ * never inflated.
+ *
  * Returns 0 on success
  *        -1 on failure
  */
@@ -684,12 +747,11 @@ int cram_dependent_data_series(cram_fd *fd,
     } else {
 	s->data_series = CRAM_ALL;
 
-	for (i = 0; i < s->hdr->num_blocks; i++) {
-	    if (cram_uncompress_block(s->block[i]))
-		return -1;
-	}
+	// External blocks are uncompressed on demand by the codecs
+	if (cram_uncompress_block(s->block[0]))
+	    return -1;
 
-	return 0;
+	return cram_uncompress_slice_blocks(fd, s, NULL);
     }
 
     block_used = calloc(s->hdr->num_blocks+1, sizeof(int));
@@ -762,10 +824,6 @@ int cram_dependent_data_series(cram_fd *fd,
 			if (s->block[j]->content_type == EXTERNAL &&
 			    s->block[j]->content_id == bnum1) {
 			    block_used[j] = 1;
-			    if (cram_uncompress_block(s->block[j])) {
-				free(block_used);
-				return -1;
-			    }
 			}
 		    }
 		    break;
@@ -808,10 +866,6 @@ int cram_dependent_data_series(cram_fd *fd,
 				if (s->block[j]->content_type == EXTERNAL &&
 				    s->block[j]->content_id == bnum1) {
 				    block_used[j] = 1;
-				    if (cram_uncompress_block(s->block[j])) {
-					free(block_used);
-					return -1;
-				    }
 				}
 			    }
 			    break;
@@ -920,8 +974,10 @@ int cram_dependent_data_series(cram_fd *fd,
 	}
     } while (orig_ds != s->data_series);
 
+    i = cram_uncompress_slice_blocks(fd, s, block_used);
+
     free(block_used);
-    return 0;
+    return i;
 }
 
 /*
@@ -2273,6 +2329,16 @@ static int bulk_cram_to_bam(SAM_hdr *bfd, cram_fd *fd, cram_slice *s) {
 	len += round8(sz);
     }
 
+    // With a decode memory limit, don't hold a second copy of a slice
+    // bigger than this thread's share.  Up to one slice per thread in
+    // the pool may be converted at once, so a share is the limit over
+    // the pool size.  (The in-flight total in fd->decode_mem belongs to
+    // the main thread, and doesn't include these copies anyway.)  The
+    // records of a larger slice are instead converted one at a time as
+    // they are read.
+    if (fd->decode_mem_max && len > fd->decode_mem_max / fd->pool->tsize)
+	return 0;
+
     s->bl = (bam_seq_t **)malloc(s->hdr->num_records * sizeof(*s->bl) + len + 8);
     if (!s->bl)
 	return -1;
@@ -2379,11 +2445,9 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 			"no embedded reference is available.\n");
 		return -1;
 	    }
-	    b = cram_get_block_by_id(s, s->hdr->ref_base_id);
+	    b = cram_fetch_block_by_id(s, s->hdr->ref_base_id);
 	    if (!b)
 		return -1;
-            if (cram_uncompress_block(b) != 0)
-                return -1;
 	    s->ref = (char *)BLOCK_DATA(b);
 	    s->ref_start = s->hdr->ref_seq_start;
 	    s->ref_end   = s->hdr->ref_seq_start + s->hdr->ref_seq_span-1;
@@ -2460,7 +2524,7 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 		MD5_Update(&md5, s->ref + start, len);
 	    MD5_Final(digest, &md5);
 	} else if (!s->ref && s->hdr->ref_base_id >= 0) {
-	    cram_block *b = cram_get_block_by_id(s, s->hdr->ref_base_id);
+	    cram_block *b = cram_fetch_block_by_id(s, s->hdr->ref_base_id);
 	    if (b) {
 		MD5_Init(&md5);
 		MD5_Update(&md5, b->data, b->uncomp_size);
@@ -2920,8 +2984,13 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
     //
     // Possible future optimisation - check range query and don't
     // convert all reads to BAM.
+    //
+    // Callers of cram_foreach_slice() only want the cram records, so
+    // hand the slice over instead.
 
-    if (fd->pool)
+    if (fd->slice_func)
+	r |= fd->slice_func(fd->slice_arg, fd, s);
+    else if (fd->pool)
 	r |= bulk_cram_to_bam(bfd, fd, s);
 
     return r;
@@ -3168,6 +3237,32 @@ static cram_container *cram_first_slice(cram_fd *fd) {
     return c;
 }
 
+/*
+ * A rough estimate of the memory needed to decode a slice, for use with
+ * CRAM_OPT_DECODE_MEM.  We count the uncompressed blocks twice, as the
+ * decoded sequence, quality and name buffers are about as large again,
+ * plus the cram_record array.
+ */
+static size_t cram_slice_mem_est(cram_slice *s) {
+    size_t sz = s->hdr->num_records * sizeof(cram_record);
+    int i;
+
+    for (i = 0; i < s->hdr->num_blocks; i++)
+	sz += 2 * (size_t)s->block[i]->uncomp_size;
+
+    return sz;
+}
+
+/*
+ * Frees a slice read by cram_next_slice(), returning its estimated
+ * memory to the CRAM_OPT_DECODE_MEM budget.  All slices leaving the
+ * decode pipeline must go through here.
+ */
+static void cram_release_slice(cram_fd *fd, cram_slice *s) {
+    fd->decode_mem -= s->mem_est;
+    cram_free_slice(s);
+}
+
 static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
     cram_container *c_curr;  // container being consumed via cram_get_seq()
     cram_slice *s_curr = NULL;
@@ -3181,7 +3276,7 @@ static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
     // Discard previous slice
     if ((s_curr = c_curr->slice)) {
 	c_curr->slice = NULL;
-	cram_free_slice(s_curr);
+	cram_release_slice(fd, s_curr);
 	s_curr = NULL;
     }
 
@@ -3343,11 +3438,18 @@ static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
 	if (!c_next || !s_next)
 	    break;
 
+	// Size it up before decoding, as that frees the blocks.  A slice
+	// retried from job_pending has already been counted.
+	if (fd->pool && fd->decode_mem_max && !s_next->mem_est) {
+	    s_next->mem_est = cram_slice_mem_est(s_next);
+	    fd->decode_mem += s_next->mem_est;
+	}
+
 	// Decode the slice, either right now (non-threaded) or by pushing
 	// it to the a decode queue (threaded).
 	if (cram_decode_slice_mt(fd, c_next, s_next, fd->header) != 0) {
 	    fprintf(stderr, "Failure to decode slice\n");
-	    cram_free_slice(s_next);
+	    cram_release_slice(fd, s_next);
 	    c_next->slice = NULL;
 	    return NULL;
 	}
@@ -3364,6 +3466,12 @@ static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
 	if (fd->job_pending)
 	    break;
 
+	// Or we have as much data in flight as the memory limit allows.
+	// This is checked after dispatching so there is always at least
+	// one slice being decoded.
+	if (fd->decode_mem_max && fd->decode_mem > fd->decode_mem_max)
+	    break;
+
 	// Otherwise we're threaded with room in the decode input queue, so
 	// keep reading slices for decode.
 	// Push it a bit far, to qsize in queue rather than pending arrival,
@@ -3424,15 +3532,13 @@ static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
 }
 
 /*
- * Read the next cram record and return it.
- * Note that to decode cram_record the caller will need to look up some data
- * in the current slice, pointed to by fd->ctr->slice. This is valid until
- * the next call to cram_get_seq (which may invalidate it).
+ * Read the next cram record within fd->range, or any record if no
+ * range is set.
  *
  * Returns record pointer on success (do not free)
- *        NULL on failure
+ *        NULL on failure or end of range
  */
-cram_record *cram_get_seq(cram_fd *fd) {
+static cram_record *cram_get_seq_range(cram_fd *fd) {
     cram_container *c;
     cram_slice *s;
 
@@ -3464,14 +3570,14 @@ cram_record *cram_get_seq(cram_fd *fd) {
 
 	    if (s->crecs[s->curr_rec].ref_id != fd->range.refid) {
 		fd->eof = 1;
-		cram_free_slice(s);
+		cram_release_slice(fd, s);
 		c->slice = NULL;
 		return NULL;
 	    }
 
 	    if (fd->range.refid != -1 && s->crecs[s->curr_rec].apos > fd->range.end) {
 		fd->eof = 1;
-		cram_free_slice(s);
+		cram_release_slice(fd, s);
 		c->slice = NULL;
 		return NULL;
 	    }
@@ -3490,6 +3596,106 @@ cram_record *cram_get_seq(cram_fd *fd) {
     return &s->crecs[s->curr_rec++];
 }
 
+/*
+ * Discards the slice currently being read along with any still being
+ * decoded ahead in the thread pool, returning their memory to the
+ * CRAM_OPT_DECODE_MEM budget.  Used before seeking elsewhere.
+ */
+void cram_drain_slices(cram_fd *fd) {
+    cram_container *c;
+
+    // Slices decoded ahead in the thread pool need to be consumed first
+    fd->ooc = 1;
+    while (fd->pool &&
+	   (fd->job_pending || !t_pool_results_queue_empty(fd->rqueue))) {
+	if (!cram_next_slice(fd, &c))
+	    break;
+    }
+
+    if (fd->ctr && fd->ctr->slice) {
+	cram_release_slice(fd, fd->ctr->slice);
+	fd->ctr->slice = NULL;
+    }
+}
+
+/*
+ * Completes any outstanding work from the current range, discarding
+ * the decoded data, and moves on to the next set of multi-region ranges.
+ *
+ * Returns 0 on success
+ *         1 if no ranges remain
+ *        -1 on failure
+ */
+static int cram_next_region(cram_fd *fd) {
+    cram_drain_slices(fd);
+    return cram_seek_to_next_region(fd);
+}
+
+/*
+ * Read the next cram record and return it.
+ * Note that to decode cram_record the caller will need to look up some data
+ * in the current slice, pointed to by fd->ctr->slice. This is valid until
+ * the next call to cram_get_seq (which may invalidate it).
+ *
+ * When multiple regions have been specified with cram_set_regions()
+ * records not overlapping any of them are skipped.
+ *
+ * Returns record pointer on success (do not free)
+ *        NULL on failure
+ */
+cram_record *cram_get_seq(cram_fd *fd) {
+    cram_regions *reg = fd->regions;
+    cram_record *cr;
+
+    if (!reg)
+	return cram_get_seq_range(fd);
+
+    while (reg->grp_beg < reg->nr) {
+	if ((cr = cram_get_seq_range(fd))) {
+	    if (cram_region_match(fd, cr->ref_id, cr->apos, cr->aend))
+		return cr;
+	    continue;
+	}
+
+	// Error, or end of this span
+	if (fd->eof != 1 || cram_next_region(fd) != 0)
+	    break;
+    }
+
+    reg->nhits = 0;
+    return NULL;
+}
+
+/*
+ * Decodes all remaining slices in fd, calling func(arg, fd, s) on each
+ * decoded slice instead of converting its records to BAM.  Only the
+ * data series needed by CRAM_OPT_REQUIRED_FIELDS are decoded, so this
+ * is an efficient way to gather summary statistics from s->crecs.
+ *
+ * When fd has a thread pool func is called from the decoding threads,
+ * possibly concurrently and in no particular order, so any shared state
+ * must be locked.  Ranges and regions are ignored; all slices are visited.
+ *
+ * Returns 0 on success
+ *        -1 on failure (including non-zero returns from func)
+ */
+int cram_foreach_slice(cram_fd *fd,
+		       int (*func)(void *arg, cram_fd *fd, cram_slice *s),
+		       void *arg) {
+    cram_container *c;
+
+    fd->slice_func = func;
+    fd->slice_arg = arg;
+
+    while (cram_next_slice(fd, &c))
+	;
+
+    fd->slice_func = NULL;
+    fd->slice_arg = NULL;
+
+    return fd->eof ? 0 : -1;
+}
+
 /*
  * Read the next cram record and convert it to a bam_seq_t struct.
  *
@@ -3539,3 +3745,70 @@ int cram_get_bam_seq(cram_fd *fd, bam_seq_t **bam) {
 
     return cram_to_bam(fd->header, fd, s, cr, s->curr_rec-1, bam) >= 0 ? 0 : -1;
 }
+
+/*
+ * Read up to n cram records, converted to bam_seq_t structs.
+ *
+ * The records are owned by fd and are only valid until the next call
+ * reading from fd; they must not be freed or modified.  When no range
+ * is set and the slice has already been converted to BAM, as is the case
+ * when multi-threaded, the records are returned without copying. In this
+ * case a batch stops at the end of the current slice.
+ *
+ * Returns the number of records filled out in array on success
+ *         0 on EOF or failure (check fd->err)
+ *        -1 on memory allocation failure
+ */
+int cram_get_bam_seqs(cram_fd *fd, bam_seq_t **array, int n) {
+    cram_record *cr;
+    cram_slice *s;
+    int k = 0;
+
+    // A short batch may have hit the end of a range, and reading on would
+    // move into the next container rather than returning EOF again.
+    if (n <= 0 || fd->bseqs_done)
+	return 0;
+
+    if (n > fd->nbseqs) {
+	bam_seq_t **b = realloc(fd->bseqs, n * sizeof(*b));
+	if (!b)
+	    return -1;
+	memset(&b[fd->nbseqs], 0, (n - fd->nbseqs) * sizeof(*b));
+	fd->bseqs = b;
+	fd->nbseqs = n;
+    }
+
+    if (fd->range.refid == -2 && !fd->regions) {
+	if (!(cr = cram_get_seq(fd))) {
+	    fd->bseqs_done = 1;
+	    return 0;
+	}
+
+	s = fd->ctr->slice;
+	if (s->bl) {
+	    // Already in BAM format, so hand back the slice contents
+	    array[k++] = s->bl[s->curr_rec-1];
+	    while (k < n && s->curr_rec < s->max_rec)
+		array[k++] = s->bl[s->curr_rec++];
+	    return k;
+	}
+
+	if (cram_to_bam(fd->header, fd, s, cr, s->curr_rec-1,
+			&fd->bseqs[k]) < 0) {
+	    fd->bseqs_done = 1;
+	    return 0;
+	}
+	array[k] = fd->bseqs[k];
+	k++;
+    }
+
+    for (; k < n; k++) {
+	if (cram_get_bam_seq(fd, &fd->bseqs[k]) < 0) {
+	    fd->bseqs_done = 1;
+	    break;
+	}
+	array[k] = fd->bseqs[k];
+    }
+
+    return k;
+}
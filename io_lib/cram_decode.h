@@ -72,6 +72,38 @@ cram_record *cram_get_seq(cram_fd *fd);
  */
 int cram_get_bam_seq(cram_fd *fd, bam_seq_t **bam);
 
+/*! Decodes all remaining slices, calling func on each in turn.
+ *
+ * func(arg, fd, s) is called on every decoded slice in place of
+ * converting its records to BAM.  Only the data series needed by
+ * CRAM_OPT_REQUIRED_FIELDS are decoded, making this an efficient way to
+ * gather summary statistics from s->crecs.  With a thread pool func is
+ * called from the decoding threads, possibly concurrently and in no
+ * particular order.  Ranges and regions are ignored.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure (including non-zero returns from func)
+ */
+int cram_foreach_slice(cram_fd *fd,
+		       int (*func)(void *arg, cram_fd *fd, cram_slice *s),
+		       void *arg);
+
+/*! Read up to n cram records, converted to bam_seq_t structs.
+ *
+ * The records are owned by fd and are only valid until the next call
+ * reading from fd; they must not be freed or modified.  When no range
+ * is set and the slice has already been converted to BAM, as is the case
+ * when multi-threaded, the records are returned without copying. In this
+ * case a batch stops at the end of the current slice.
+ *
+ * @return
+ * Returns the number of records filled out in array on success;
+ *         0 on EOF or failure (check fd->err)
+ *        -1 on memory allocation failure
+ */
+int cram_get_bam_seqs(cram_fd *fd, bam_seq_t **array, int n);
+
 
 /* ----------------------------------------------------------------------
  * Internal functions
@@ -107,6 +139,12 @@ cram_block_slice_hdr *cram_decode_slice_header(cram_fd *fd, cram_block *b);
 int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 		      SAM_hdr *hdr);
 
+/*! INTERNAL:
+ * Discards the slice currently being read and any still being decoded
+ * in the thread pool, prior to seeking.
+ */
+void cram_drain_slices(cram_fd *fd);
+
 
 #ifdef __cplusplus
 }
@@ -55,6 +55,7 @@
 #include "io_lib/os.h"
 #include "io_lib/md5.h"
 #include "io_lib/binning.h"
+#include "io_lib/seq_simd.h"
 
 #ifdef SAMTOOLS
 #    define bam_copy(dst, src) bam_copy1(*(dst), (src))
@@ -770,20 +771,153 @@ static void squash_qual(cram_block *b) {
 }
 #endif
 
+/*
+ * Block compression is the bulk of the encoding work, so rather than
+ * compressing each block as soon as its slice is built we queue them up
+ * for the whole container.  The job encoding the container then works
+ * through this list, aided by any idle threads in the pool.  See
+ * cram_compress_blocks().
+ */
+typedef struct {
+    cram_slice *s;
+    cram_block *b;
+    cram_metrics *m;
+    int method, level;
+    int next;     // next attempt at the same block, or -1
+    int last;     // last attempt at this block (first attempt only)
+} cram_compress_task;
+
+typedef struct {
+    cram_fd *fd;
+    cram_compress_task *task;
+    int ntask, atask;
+    int *block;   // first task for each distinct block
+    int nblock, ablock;
+} cram_compress_list;
+
+static cram_compress_list *cram_compress_list_new(cram_fd *fd) {
+    cram_compress_list *cl = calloc(1, sizeof(*cl));
+    if (!cl)
+	return NULL;
+
+    cl->fd = fd;
+
+    return cl;
+}
+
+static void cram_compress_list_free(cram_compress_list *cl) {
+    free(cl->task);
+    free(cl->block);
+    free(cl);
+}
+
+/*
+ * Adds a cram_compress_block() call to the list.
+ *
+ * Blocks may be shared between data series, in which case several
+ * attempts are queued for the same block.  These are chained together
+ * and made in order by a single thread, so as before a later attempt
+ * only has an effect if the earlier ones left the block uncompressed.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_queue_block(cram_compress_list *cl, cram_slice *s,
+			    cram_block *b, cram_metrics *m,
+			    int method, int level) {
+    cram_compress_task *t;
+    int i, n;
+
+    if (cl->ntask == cl->atask) {
+	int atask = cl->atask ? cl->atask*2 : 32;
+	t = realloc(cl->task, atask * sizeof(*t));
+	if (!t)
+	    return -1;
+	cl->task = t;
+	cl->atask = atask;
+    }
+
+    t = &cl->task[n = cl->ntask++];
+    t->s = s;
+    t->b = b;
+    t->m = m;
+    t->method = method;
+    t->level = level;
+    t->next = -1;
+    t->last = n;
+
+    for (i = cl->nblock-1; i >= 0; i--) {
+	cram_compress_task *first = &cl->task[cl->block[i]];
+	if (first->b == b) {
+	    cl->task[first->last].next = n;
+	    first->last = n;
+	    return 0;
+	}
+    }
+
+    if (cl->nblock == cl->ablock) {
+	int ablock = cl->ablock ? cl->ablock*2 : 32;
+	int *tmp = realloc(cl->block, ablock * sizeof(*tmp));
+	if (!tmp)
+	    return -1;
+	cl->block = tmp;
+	cl->ablock = ablock;
+    }
+    cl->block[cl->nblock++] = n;
+
+    return 0;
+}
+
+/*
+ * Makes every queued attempt at compressing the i-th distinct block;
+ * called via t_pool_run_all().
+ */
+static int cram_compress_task_run(void *arg, int i) {
+    cram_compress_list *cl = (cram_compress_list *)arg;
+    int n;
+
+    for (n = cl->block[i]; n >= 0; n = cl->task[n].next) {
+	cram_compress_task *t = &cl->task[n];
+	if (cram_compress_block(cl->fd, t->s, t->b, t->m,
+				t->method, t->level))
+	    return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Compresses all the blocks queued on cl, sharing the work with any idle
+ * threads in the pool, and then frees cl.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_compress_blocks(cram_fd *fd, cram_compress_list *cl) {
+    int r = t_pool_run_all(fd->pool, cl->nblock, cram_compress_task_run, cl);
+
+    cram_compress_list_free(cl);
+
+    return r;
+}
+
 /*
  * Applies various compression methods to specific blocks, depending on
- * known observations of how data series compress.
+ * known observations of how data series compress.  The blocks are only
+ * queued on cl here, to be compressed later by cram_compress_blocks().
  *
  * Returns 0 on success
  *        -1 on failure
  */
-static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
+static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s,
+			       cram_compress_list *cl) {
     int level = fd->level, i;
     int method = 1<<GZIP | 1<<GZIP_RLE, methodF = method, qmethod, qmethodF;
 
     /* Compress the CORE Block too, with minimal zlib level */
     if (level > 5 && s->block[0]->uncomp_size > 500)
-	cram_compress_block(fd, s, s->block[0], NULL, 1<<GZIP, 1);
+	if (cram_queue_block(cl, s, s->block[0], NULL, 1<<GZIP, 1))
+	    return -1;
  
     if (fd->use_bz2)
 	method |= 1<<BZIP2;
@@ -870,54 +1004,54 @@ static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
 
 
     /* Specific compression methods for certain block types */
-    if (cram_compress_block(fd, s, s->block[DS_IN], fd->m[DS_IN], //IN (seq)
-			    method, level))
+    if (cram_queue_block(cl, s, s->block[DS_IN], fd->m[DS_IN], //IN (seq)
+			 method, level))
 	return -1;
 
     if (fd->level == 0) {
 	/* Do nothing */
     } else if (fd->level == 1) {
-	if (cram_compress_block(fd, s, s->block[DS_QS], fd->m[DS_QS],
-				qmethodF, 1))
+	if (cram_queue_block(cl, s, s->block[DS_QS], fd->m[DS_QS],
+			     qmethodF, 1))
 	    return -1;
 	for (i = DS_aux; i <= DS_aux_oz; i++) {
 	    if (s->block[i])
-		if (cram_compress_block(fd, s, s->block[i], fd->m[i],
-					method, 1))
+		if (cram_queue_block(cl, s, s->block[i], fd->m[i],
+				     method, 1))
 		    return -1;
 	}
     } else if (fd->level <= 3) {
-	if (cram_compress_block(fd, s, s->block[DS_QS], fd->m[DS_QS],
-				qmethod, 1))
+	if (cram_queue_block(cl, s, s->block[DS_QS], fd->m[DS_QS],
+			     qmethod, 1))
 	    return -1;
-	if (cram_compress_block(fd, s, s->block[DS_BA], fd->m[DS_BA],
-				method, 1))
+	if (cram_queue_block(cl, s, s->block[DS_BA], fd->m[DS_BA],
+			     method, 1))
 	    return -1;
 	if (s->block[DS_BB])
-	    if (cram_compress_block(fd, s, s->block[DS_BB], fd->m[DS_BB],
-				    method, 1))
+	    if (cram_queue_block(cl, s, s->block[DS_BB], fd->m[DS_BB],
+				 method, 1))
 	    return -1;
 	for (i = DS_aux; i <= DS_aux_oz; i++) {
 	    if (s->block[i])
-		if (cram_compress_block(fd, s, s->block[i], fd->m[i],
-					method, level))
+		if (cram_queue_block(cl, s, s->block[i], fd->m[i],
+				     method, level))
 		    return -1;
 	}
     } else {
-	if (cram_compress_block(fd, s, s->block[DS_QS], fd->m[DS_QS],
-				qmethod, level))
+	if (cram_queue_block(cl, s, s->block[DS_QS], fd->m[DS_QS],
+			     qmethod, level))
 	    return -1;
-	if (cram_compress_block(fd, s, s->block[DS_BA], fd->m[DS_BA],
-				method, level))
+	if (cram_queue_block(cl, s, s->block[DS_BA], fd->m[DS_BA],
+			     method, level))
 	    return -1;
 	if (s->block[DS_BB])
-	    if (cram_compress_block(fd, s, s->block[DS_BB], fd->m[DS_BB],
-				    method, level))
+	    if (cram_queue_block(cl, s, s->block[DS_BB], fd->m[DS_BB],
+				 method, level))
 	    return -1;
 	for (i = DS_aux; i <= DS_aux_oz; i++) {
 	    if (s->block[i])
-		if (cram_compress_block(fd, s, s->block[i], fd->m[i],
-					method, level))
+		if (cram_queue_block(cl, s, s->block[i], fd->m[i],
+				     method, level))
 		    return -1;
 	}
     }
@@ -927,14 +1061,14 @@ static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
     int method_rn = method & ~(method_rans | method_ranspr | 1<<GZIP_RLE);
     if (fd->version >= (3<<8)+1 && fd->use_tok)
 	method_rn |= fd->use_arith ? (1<<NAME_TOKA) : (1<<NAME_TOK3);
-    if (cram_compress_block(fd, s, s->block[DS_RN], fd->m[DS_RN],
-			    method_rn, level))
+    if (cram_queue_block(cl, s, s->block[DS_RN], fd->m[DS_RN],
+			 method_rn, level))
 	return -1;
 
     // NS shows strong local correlation as rearrangements are localised
     if (s->block[DS_NS] != s->block[0])
-	if (cram_compress_block(fd, s, s->block[DS_NS], fd->m[DS_NS],
-				method, level))
+	if (cram_queue_block(cl, s, s->block[DS_NS], fd->m[DS_NS],
+			     method, level))
 	    return -1;
 
     /*
@@ -946,11 +1080,8 @@ static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
 	    if (!s->aux_block[i] || s->aux_block[i] == s->block[0])
 		continue;
 
-	    if (s->aux_block[i]->method != RAW)
-		continue;
-
-	    if (cram_compress_block(fd, s, s->aux_block[i], s->aux_block[i]->m,
-				    method, level))
+	    if (cram_queue_block(cl, s, s->aux_block[i], s->aux_block[i]->m,
+				 method, level))
 		return -1;
 	}
     }
@@ -964,11 +1095,8 @@ static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
 	    if (!s->block[i] || s->block[i] == s->block[0])
 		continue;
 
-	    if (s->block[i]->method != RAW)
-		continue;
-
-	    if (cram_compress_block(fd, s, s->block[i], fd->m[i],
-				    methodF, level))
+	    if (cram_queue_block(cl, s, s->block[i], fd->m[i],
+				 methodF, level))
 		return -1;
 	}
     }
@@ -977,13 +1105,15 @@ static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
 }
 
 /*
- * Encodes a single slice from a container
+ * Encodes a single slice from a container, queuing its blocks on cl for
+ * compression.  cram_finish_slice() completes it once compressed.
  *
  * Returns 0 on success
  *        -1 on failure
  */
 static int cram_encode_slice(cram_fd *fd, cram_container *c,
-			     cram_block_compression_hdr *h, cram_slice *s) {
+			     cram_block_compression_hdr *h, cram_slice *s,
+			     cram_compress_list *cl) {
     int rec, r = 0;
     int64_t last_pos;
     int embed_ref;
@@ -1121,10 +1251,21 @@ static int cram_encode_slice(cram_fd *fd, cram_container *c,
 	    BLOCK_UPLEN(s->block[id]);
     }
 
-    // Compress it all
-    if (cram_compress_slice(fd, c, s) == -1)
+    // Queue it all for compression
+    if (cram_compress_slice(fd, c, s, cl) == -1)
 	return -1;
 
+    return r ? -1 : 0;
+}
+
+/*
+ * Completes a slice after cram_encode_slice() once its blocks have been
+ * compressed, removing empty blocks and creating the slice header block.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_finish_slice(cram_fd *fd, cram_slice *s) {
     // Collapse empty blocks and create hdr_block
     {
 	int i, j;
@@ -1159,7 +1300,7 @@ static int cram_encode_slice(cram_fd *fd, cram_container *c,
 	if (fd->ref_lock) pthread_mutex_unlock(fd->ref_lock);
     }
 
-    return r ? -1 : 0;
+    return 0;
 }
 
 
@@ -1506,6 +1647,7 @@ int cram_encode_container(cram_fd *fd, cram_container *c) {
     int multi_ref = 0;
     int r1, r2, sn, nref;
     spare_bams *spares;
+    cram_compress_list *cl;
 
     /* Cache references up-front if we have unsorted access patterns */
     if (fd->ref_lock) pthread_mutex_lock(fd->ref_lock);
@@ -1898,11 +2040,25 @@ int cram_encode_container(cram_fd *fd, cram_container *c) {
     }
 
     /* Encode slices */
+    if (!(cl = cram_compress_list_new(fd)))
+	return -1;
+
     for (i = 0; i < c->curr_slice; i++) {
 	if (fd->verbose)
 	    fprintf(stderr, "Encode slice %d\n", i);
 
-	if (cram_encode_slice(fd, c, h, c->slices[i]) != 0)
+	if (cram_encode_slice(fd, c, h, c->slices[i], cl) != 0) {
+	    cram_compress_list_free(cl);
+	    return -1;
+	}
+    }
+
+    /* Compress them, possibly in parallel, and complete the slices */
+    if (cram_compress_blocks(fd, cl) != 0)
+	return -1;
+
+    for (i = 0; i < c->curr_slice; i++) {
+	if (cram_finish_slice(fd, c->slices[i]) != 0)
 	    return -1;
     }
 
@@ -2983,58 +3139,9 @@ static int process_one_read(cram_fd *fd, cram_container *c,
     BLOCK_GROW(s->qual_blk, cr->len);
     seq = cp = (char *)BLOCK_END(s->seqs_blk);
 
-    // Convert seq 2 bases at a time for speed.
-    {
-#ifdef ALLOW_UAC
-	static const uint16_t code2base[256] = {
-	    15677, 16701, 17213, 19773, 18237, 21053, 21309, 22077,
-	    21565, 22333, 22845, 18493, 19261, 17469, 16957, 20029,
-	    15681, 16705, 17217, 19777, 18241, 21057, 21313, 22081,
-	    21569, 22337, 22849, 18497, 19265, 17473, 16961, 20033,
-	    15683, 16707, 17219, 19779, 18243, 21059, 21315, 22083,
-	    21571, 22339, 22851, 18499, 19267, 17475, 16963, 20035,
-	    15693, 16717, 17229, 19789, 18253, 21069, 21325, 22093,
-	    21581, 22349, 22861, 18509, 19277, 17485, 16973, 20045,
-	    15687, 16711, 17223, 19783, 18247, 21063, 21319, 22087,
-	    21575, 22343, 22855, 18503, 19271, 17479, 16967, 20039,
-	    15698, 16722, 17234, 19794, 18258, 21074, 21330, 22098,
-	    21586, 22354, 22866, 18514, 19282, 17490, 16978, 20050,
-	    15699, 16723, 17235, 19795, 18259, 21075, 21331, 22099,
-	    21587, 22355, 22867, 18515, 19283, 17491, 16979, 20051,
-	    15702, 16726, 17238, 19798, 18262, 21078, 21334, 22102,
-	    21590, 22358, 22870, 18518, 19286, 17494, 16982, 20054,
-	    15700, 16724, 17236, 19796, 18260, 21076, 21332, 22100,
-	    21588, 22356, 22868, 18516, 19284, 17492, 16980, 20052,
-	    15703, 16727, 17239, 19799, 18263, 21079, 21335, 22103,
-	    21591, 22359, 22871, 18519, 19287, 17495, 16983, 20055,
-	    15705, 16729, 17241, 19801, 18265, 21081, 21337, 22105,
-	    21593, 22361, 22873, 18521, 19289, 17497, 16985, 20057,
-	    15688, 16712, 17224, 19784, 18248, 21064, 21320, 22088,
-	    21576, 22344, 22856, 18504, 19272, 17480, 16968, 20040,
-	    15691, 16715, 17227, 19787, 18251, 21067, 21323, 22091,
-	    21579, 22347, 22859, 18507, 19275, 17483, 16971, 20043,
-	    15684, 16708, 17220, 19780, 18244, 21060, 21316, 22084,
-	    21572, 22340, 22852, 18500, 19268, 17476, 16964, 20036,
-	    15682, 16706, 17218, 19778, 18242, 21058, 21314, 22082,
-	    21570, 22338, 22850, 18498, 19266, 17474, 16962, 20034,
-	    15694, 16718, 17230, 19790, 18254, 21070, 21326, 22094,
-	    21582, 22350, 22862, 18510, 19278, 17486, 16974, 20046
-	};
-#endif
-	int l2 = cr->len & ~1;
-	unsigned char *from = (unsigned char *)bam_seq(b);
-	cp[0] = 0;
-	for (i = 0; i < l2; i += 2, from++) {
-#ifdef ALLOW_UAC
-	    *(int16_t *)&cp[i] = le_int2(code2base[*from]);
-#else
-	    cp[i+0] = bam_nt16_rev_table[*from >> 4];
-	    cp[i+1] = bam_nt16_rev_table[*from & 0xf];
-#endif
-	}
-	if (i < cr->len)
-	    cp[i] = bam_nt16_rev_table[*from >> 4];
-    }
+    cp[0] = 0;
+    seq_nt16_unpack((unsigned char *)cp, (unsigned char *)bam_seq(b),
+		    cr->len);
     BLOCK_SIZE(s->seqs_blk) += cr->len;
 
     qual = cp = (char *)bam_qual(b);
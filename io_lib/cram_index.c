@@ -55,6 +55,22 @@
  * earlier as it is sorted) range will be held within it. This ensures that
  * the outer list will never have containments and we can safely do a
  * binary search to find the first range which overlaps any given coordinate.
+ *
+ * Parsing the text index is slow for large files, so optionally a binary
+ * copy (foo.cram.crai.bin) may be produced by cram_index_build_bin().
+ * This is a flat array of cram_index_entry structs sorted by reference
+ * and start. It is mmapped on loading, so only the pages touched by the
+ * query are ever read from disk.  The layout, all in host byte order, is:
+ *
+ *   char     magic[4];         "CRBI"
+ *   uint32_t byte_order;       0x01020304
+ *   uint32_t version;          2
+ *   uint32_t nref;             number of references + 1 (for refid -1)
+ *   uint64_t nentry;
+ *   int64_t  crai_size;        size and modification time of the .crai
+ *   int64_t  crai_mtime;       file this was built from
+ *   uint64_t ref[nref+1];      entries for refid r are ref[r+1]..ref[r+2]-1
+ *   cram_index_entry e[nentry];
  */
 
 #ifdef HAVE_CONFIG_H
@@ -71,6 +87,12 @@
 #include <sys/stat.h>
 #include <math.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 
 #include "io_lib/cram.h"
 #include "io_lib/os.h"
@@ -108,6 +130,37 @@ static char * cram_io_input_buffer_fgets_func(char * s, int size, void * fp)
 }
 #endif
 
+/*
+ * Parses a single line of a text .crai file into e.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_index_parse_line(char *line, cram_index *e) {
+    /* 1.1 layout */
+    char *cp = line;
+    errno = 0;
+    e->refid  = strtol (cp, &cp, 10);
+    e->start  = strtol (cp, &cp, 10);
+    e->end    = strtol (cp, &cp, 10);
+    e->offset = strtoll(cp, &cp, 10);
+    e->slice  = strtol (cp, &cp, 10);
+    e->len    = strtol (cp, &cp, 10);
+
+    if (errno == EINVAL || errno == ERANGE)
+	return -1;
+
+    e->end += e->start-1;
+    //printf("%d/%d..%d\n", e->refid, e->start, e->end);
+
+    if (e->refid < -1) {
+	fprintf(stderr, "Malformed index file, refid %d\n", e->refid);
+	return -1;
+    }
+
+    return 0;
+}
+
 static int cram_index_load_private(cram_fd *fd, void * fp, fgets_functions fgets_func)
 {
     char line[1024];
@@ -128,27 +181,8 @@ static int cram_index_load_private(cram_fd *fd, void * fp, fgets_functions fgets
     idx_stack[idx_stack_ptr] = idx;
 
     while (fgets_func(line, 1024, fp)) {
-	/* 1.1 layout */
-	char *cp = line;
-        errno = 0;
-        e.refid  = strtol (cp, &cp, 10);
-        e.start  = strtol (cp, &cp, 10);
-        e.end    = strtol (cp, &cp, 10);
-        e.offset = strtoll(cp, &cp, 10);
-        e.slice  = strtol (cp, &cp, 10);
-        e.len    = strtol (cp, &cp, 10);
-
-        if (errno == EINVAL || errno == ERANGE) {
-            free(idx_stack);
-            return -1;
-        }
-
-	e.end += e.start-1;
-	//printf("%d/%d..%d\n", e.refid, e.start, e.end);
-
-	if (e.refid < -1) {
+	if (cram_index_parse_line(line, &e) != 0) {
 	    free(idx_stack);
-	    fprintf(stderr, "Malformed index file, refid %d\n", e.refid);
 	    return -1;
 	}
 	if (e.refid != idx->refid) {
@@ -196,6 +230,247 @@ static int cram_index_load_private(cram_fd *fd, void * fp, fgets_functions fgets
     return 0;
 }
 
+#define CRAM_INDEX_BIN_MAGIC "CRBI"
+#define CRAM_INDEX_BIN_BOM    0x01020304
+#define CRAM_INDEX_BIN_VER    2
+#define CRAM_INDEX_BIN_HDR    40
+
+/*
+ * Loads a binary .crai.bin index, mmapping it where possible.
+ *
+ * If crai is non-NULL it holds the stat of the text .crai index. The
+ * binary index is only used if it was built from a .crai file of this
+ * same size and modification time.
+ *
+ * Returns 0 for success
+ *        -1 for failure
+ */
+static int cram_index_load_bin(cram_fd *fd, const char *fn,
+			       const struct stat *crai) {
+    struct stat sb;
+    int ifd;
+    unsigned char *map;
+    uint32_t bom, ver, nref;
+    uint64_t nentry, *ref, i;
+    int64_t crai_size, crai_mtime;
+
+    if ((ifd = open(fn, O_RDONLY)) < 0)
+	return -1;
+
+    if (fstat(ifd, &sb) != 0 || sb.st_size < CRAM_INDEX_BIN_HDR) {
+	close(ifd);
+	return -1;
+    }
+
+#ifdef HAVE_MMAP
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, ifd, 0);
+    if (map == MAP_FAILED) {
+	close(ifd);
+	return -1;
+    }
+    fd->index_mmapped = 1;
+#else
+    if (!(map = malloc(sb.st_size))) {
+	close(ifd);
+	return -1;
+    }
+    if (read(ifd, map, sb.st_size) != sb.st_size) {
+	free(map);
+	close(ifd);
+	return -1;
+    }
+    fd->index_mmapped = 0;
+#endif
+    close(ifd);
+
+    fd->index_map = map;
+    fd->index_map_sz = sb.st_size;
+
+    /* Validate header */
+    memcpy(&bom,    map+4,  4);
+    memcpy(&ver,    map+8,  4);
+    memcpy(&nref,   map+12, 4);
+    memcpy(&nentry, map+16, 8);
+    memcpy(&crai_size,  map+24, 8);
+    memcpy(&crai_mtime, map+32, 8);
+
+    /* An old version or a stale index is not an error; use the .crai */
+    if (memcmp(map, CRAM_INDEX_BIN_MAGIC, 4) == 0 &&
+	bom == CRAM_INDEX_BIN_BOM &&
+	(ver != CRAM_INDEX_BIN_VER ||
+	 (crai && (crai_size  != (int64_t)crai->st_size ||
+		   crai_mtime != (int64_t)crai->st_mtime)))) {
+	cram_index_free(fd);
+	return -1;
+    }
+
+    if (memcmp(map, CRAM_INDEX_BIN_MAGIC, 4) != 0 ||
+	bom != CRAM_INDEX_BIN_BOM || ver != CRAM_INDEX_BIN_VER ||
+	nref < 1 || nref > INT_MAX-1 ||
+	nentry > (sb.st_size - CRAM_INDEX_BIN_HDR) / sizeof(cram_index_entry)||
+	(uint64_t)sb.st_size != CRAM_INDEX_BIN_HDR + (nref+1)*8 +
+	                        nentry * sizeof(cram_index_entry))
+	goto err;
+
+    ref = (uint64_t *)(map + CRAM_INDEX_BIN_HDR);
+    for (i = 0; i < nref; i++)
+	if (ref[i] > ref[i+1])
+	    goto err;
+    if (ref[0] != 0 || ref[nref] != nentry)
+	goto err;
+
+    /*
+     * Query results, filled out on demand.  Large allocations are
+     * typically zero pages mapped lazily, so this costs little more
+     * than the entries we actually touch.
+     */
+    if (!(fd->index_bin_e = calloc(nentry ? nentry : 1,
+				   sizeof(*fd->index_bin_e)))) {
+	cram_index_free(fd);
+	return -1;
+    }
+
+    fd->index_bin_ref  = ref;
+    fd->index_bin_nref = nref;
+    fd->index_bin = (cram_index_entry *)(map + CRAM_INDEX_BIN_HDR
+					 + (nref+1)*8);
+    return 0;
+
+ err:
+    fprintf(stderr, "Malformed binary index file '%s'\n", fn);
+    cram_index_free(fd);
+    return -1;
+}
+
+static int cram_index_entry_cmp(const void *vp1, const void *vp2) {
+    const cram_index_entry *e1 = vp1, *e2 = vp2;
+
+    /* Unsigned comparison of refid+1 so -1 (unmapped) comes first */
+    if (e1->refid != e2->refid)
+	return (uint32_t)(e1->refid+1) < (uint32_t)(e2->refid+1) ? -1 : 1;
+    if (e1->start != e2->start)
+	return e1->start < e2->start ? -1 : 1;
+    return e1->offset < e2->offset ? -1 : (e1->offset > e2->offset);
+}
+
+/*
+ * Converts a text .crai index to the binary .crai.bin format.
+ *
+ * fn is either the CRAM filename or the .crai filename. The binary
+ * index is written to the .crai filename with ".bin" appended.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int cram_index_build_bin(const char *fn) {
+    char fn_idx[PATH_MAX], fn_bin[PATH_MAX], line[1024];
+    zfp *zfp_in;
+    FILE *fp_out;
+    cram_index e;
+    cram_index_entry *ent = NULL;
+    uint64_t nent = 0, aent = 0, i, *ref = NULL;
+    uint32_t nref = 1, u32;
+    int64_t i64;
+    struct stat sb;
+    size_t len;
+    int r = -1;
+
+    if ((len = strlen(fn)) > PATH_MAX-10)
+	return -1;
+
+    if (len >= 5 && strcmp(&fn[len-5], ".crai") == 0)
+	strcpy(fn_idx, fn);
+    else
+	sprintf(fn_idx, "%s.crai", fn);
+    sprintf(fn_bin, "%s.bin", fn_idx);
+
+    if (stat(fn_idx, &sb) != 0 || !(zfp_in = zfopen(fn_idx, "r"))) {
+	perror(fn_idx);
+	return -1;
+    }
+
+    while (zfgets(line, 1024, zfp_in)) {
+	if (cram_index_parse_line(line, &e) != 0)
+	    goto err;
+
+	if (nent >= aent) {
+	    cram_index_entry *tmp;
+	    aent = aent ? aent*2 : 1024;
+	    if (!(tmp = realloc(ent, aent * sizeof(*ent))))
+		goto err;
+	    ent = tmp;
+	}
+
+	ent[nent].refid   = e.refid;
+	ent[nent].start   = e.start;
+	ent[nent].end     = e.end;
+	ent[nent].max_end = e.end;
+	ent[nent].slice   = e.slice;
+	ent[nent].len     = e.len;
+	ent[nent].offset  = e.offset;
+	nent++;
+
+	if (nref < e.refid+2)
+	    nref = e.refid+2;
+    }
+
+    /* Normally already sorted, except for the unmapped data */
+    qsort(ent, nent, sizeof(*ent), cram_index_entry_cmp);
+
+    if (!(ref = calloc(nref+1, sizeof(*ref))))
+	goto err;
+
+    for (i = 0; i < nent; i++) {
+	ref[ent[i].refid+1]++;
+	if (i && ent[i].refid == ent[i-1].refid &&
+	    ent[i].max_end < ent[i-1].max_end)
+	    ent[i].max_end = ent[i-1].max_end;
+    }
+
+    /* Convert counts to starting offsets */
+    {
+	uint64_t tot = 0;
+	for (i = 0; i <= nref; i++) {
+	    uint64_t c = ref[i];
+	    ref[i] = tot;
+	    tot += c;
+	}
+    }
+
+    if (!(fp_out = fopen(fn_bin, "wb"))) {
+	perror(fn_bin);
+	goto err;
+    }
+
+    fwrite(CRAM_INDEX_BIN_MAGIC, 1, 4, fp_out);
+    u32 = CRAM_INDEX_BIN_BOM; fwrite(&u32, 4, 1, fp_out);
+    u32 = CRAM_INDEX_BIN_VER; fwrite(&u32, 4, 1, fp_out);
+    fwrite(&nref, 4, 1, fp_out);
+    fwrite(&nent, 8, 1, fp_out);
+    i64 = sb.st_size;  fwrite(&i64, 8, 1, fp_out);
+    i64 = sb.st_mtime; fwrite(&i64, 8, 1, fp_out);
+    fwrite(ref, 8, nref+1, fp_out);
+    if (nent)
+	fwrite(ent, sizeof(*ent), nent, fp_out);
+
+    r = 0;
+    if (ferror(fp_out))
+	r = -1;
+    if (fclose(fp_out) != 0)
+	r = -1;
+    if (r != 0) {
+	perror(fn_bin);
+	unlink(fn_bin);
+    }
+
+ err:
+    zfclose(zfp_in);
+    free(ent);
+    free(ref);
+
+    return r;
+}
+
 #if defined(CRAM_IO_CUSTOM_BUFFERING)
 /*
  * Loads a CRAM .crai index into memory.
@@ -254,15 +529,25 @@ int cram_index_load_via_callbacks(
  */
 int cram_index_load(cram_fd *fd, char const *fn) {
     zfp *fp = NULL;
-    char fn2[PATH_MAX];
+    char fn2[PATH_MAX], fn3[PATH_MAX];
+    struct stat sb2, sb3;
     int r = -1;
     
     /* Check if already loaded */
-    if (fd->index)
+    if (fd->index || fd->index_bin)
 	return 0;
 
+    if (strlen(fn) > PATH_MAX-10)
+	return -1;
+
     /* copy filename */
     sprintf(fn2, "%s.crai", fn);
+    sprintf(fn3, "%s.crai.bin", fn);
+
+    /* Prefer the binary index, provided it was built from this .crai */
+    if (stat(fn3, &sb3) == 0 &&
+	cram_index_load_bin(fd, fn3, stat(fn2, &sb2) == 0 ? &sb2 : NULL) == 0)
+	return 0;
     
     /* open index file */
     if (!(fp = zfopen(fn2, "r"))) {
@@ -290,6 +575,22 @@ static void cram_index_free_recurse(cram_index *e) {
 void cram_index_free(cram_fd *fd) {
     int i;
 
+    if (fd->index_map) {
+#ifdef HAVE_MMAP
+	if (fd->index_mmapped)
+	    munmap(fd->index_map, fd->index_map_sz);
+	else
+#endif
+	    free(fd->index_map);
+	fd->index_map = NULL;
+	fd->index_map_sz = 0;
+	fd->index_bin = NULL;
+	fd->index_bin_ref = NULL;
+	fd->index_bin_nref = 0;
+    }
+    free(fd->index_bin_e);
+    fd->index_bin_e = NULL;
+
     if (!fd->index)
 	return;
     
@@ -301,6 +602,63 @@ void cram_index_free(cram_fd *fd) {
     fd->index = NULL;
 }
 
+/*
+ * The binary index equivalent of cram_index_query.  As max_end is
+ * non-decreasing we can binary search for the first entry that ends
+ * at or beyond pos.  The result is held in fd->index_bin_e, one per
+ * entry, so it remains valid until the index is freed.
+ */
+static cram_index *cram_index_query_bin(cram_fd *fd, int refid, int pos,
+					cram_index *from) {
+    uint64_t lo, hi, mid, end;
+    cram_index_entry *b;
+    cram_index *e;
+
+    if (refid+1 < 0 || refid+1 >= fd->index_bin_nref)
+	return NULL;
+
+    lo = fd->index_bin_ref[refid+1];
+    hi = end = fd->index_bin_ref[refid+2];
+
+    // Only search beyond the last slice returned
+    if (from) {
+	if (from < fd->index_bin_e + lo || from >= fd->index_bin_e + hi)
+	    return NULL;
+	lo = from - fd->index_bin_e + 1;
+    }
+
+    // Ref with nothing (more) aligned against it.
+    if (lo == hi)
+	return NULL;
+
+    if (refid != -1) {
+	while (lo < hi) {
+	    mid = lo + (hi-lo)/2;
+	    if (fd->index_bin[mid].max_end < pos)
+		lo = mid+1;
+	    else
+		hi = mid;
+	}
+	// Nothing overlapping, so return the last slice prior to pos.
+	if (lo == end)
+	    lo = end-1;
+    } // else unmapped data; no meaningful coordinates
+
+    b = &fd->index_bin[lo];
+    e = &fd->index_bin_e[lo];
+    e->nslice = e->nalloc = 0;
+    e->e      = NULL;
+    e->refid  = b->refid;
+    e->start  = b->start;
+    e->end    = b->end;
+    e->nseq   = 0;
+    e->slice  = b->slice;
+    e->len    = b->len;
+    e->offset = b->offset;
+
+    return e;
+}
+
 /*
  * Searches the index for the first slice overlapping a reference ID
  * and position, or one immediately preceding it if none is found in
@@ -312,6 +670,9 @@ void cram_index_free(cram_fd *fd) {
  * "from" as the last slice we checked to find the next one. Otherwise
  * set "from" to be NULL to find the first one.
  *
+ * With a binary index there is no nesting of slices, so "from" instead
+ * restricts the search to slices listed after it.
+ *
  * Returns the cram_index pointer on sucess
  *         NULL on failure
  */
@@ -320,6 +681,9 @@ cram_index *cram_index_query(cram_fd *fd, int refid, int pos,
     int i, j, k;
     cram_index *e;
 
+    if (fd->index_bin)
+	return cram_index_query_bin(fd, refid, pos, from);
+
     if (refid+1 < 0 || refid+1 >= fd->index_sz)
 	return NULL;
 
@@ -418,6 +782,9 @@ int cram_seek(cram_fd *fd, off_t offset, int whence) {
 int cram_seek_to_refpos(cram_fd *fd, cram_range *r) {
     cram_index *e;
 
+    // Anything still being decoded belongs to the old range
+    cram_drain_slices(fd);
+
     // Ideally use an index, so see if we have one.
     if ((e = cram_index_query(fd, r->refid, r->start, NULL))) {
 	if (0 != cram_seek(fd, e->offset, SEEK_SET))
@@ -428,17 +795,208 @@ int cram_seek_to_refpos(cram_fd *fd, cram_range *r) {
 	return -1;
     }
 
-    if (fd->ctr) {
+    if (fd->ctr_mt && fd->ctr_mt != fd->ctr)
+	cram_free_container(fd->ctr_mt);
+    if (fd->ctr)
 	cram_free_container(fd->ctr);
-	fd->ctr = NULL;
-	fd->ctr_mt = NULL;
-	fd->ooc = 0;
-	fd->eof = 0;
+    fd->ctr = NULL;
+    fd->ctr_mt = NULL;
+    fd->ooc = 0;
+    fd->eof = 0;
+    fd->bseqs_done = 0;
+
+    return 0;
+}
+
+/* ----------------------------------------------------------------------
+ * Multi-region queries.
+ */
+
+typedef struct {
+    cram_range r;
+    int idx;
+} cram_region_sort;
+
+/* Sort order for regions; by refid with unmapped (-1) last, then start */
+static int region_cmp(const void *vp1, const void *vp2) {
+    const cram_region_sort *r1 = vp1, *r2 = vp2;
+
+    if (r1->r.refid != r2->r.refid)
+	return (uint32_t)r1->r.refid < (uint32_t)r2->r.refid ? -1 : 1;
+    if (r1->r.start != r2->r.start)
+	return r1->r.start < r2->r.start ? -1 : 1;
+    return r1->idx - r2->idx;
+}
+
+void cram_regions_free(cram_fd *fd) {
+    if (!fd->regions)
+	return;
+
+    free(fd->regions->r);
+    free(fd->regions->idx);
+    free(fd->regions->hits);
+    free(fd->regions);
+    fd->regions = NULL;
+}
+
+/*
+ * Sets a list of ranges to fetch. These need not be sorted or distinct.
+ *
+ * Subsequent calls to cram_get_seq() will return each record overlapping
+ * one or more of these ranges exactly once, with cram_region_hits()
+ * reporting which ranges it overlaps.  Ranges whose slices overlap are
+ * merged into a single pass through the file.
+ *
+ * Requires an index. Setting nr to 0 removes any existing ranges.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int cram_set_regions(cram_fd *fd, cram_range *r, int nr) {
+    cram_regions *reg;
+    cram_region_sort *tmp;
+    int i;
+
+    cram_regions_free(fd);
+    if (nr <= 0) {
+	fd->range.refid = -2;
+	return 0;
+    }
+
+    if (!fd->index && !fd->index_bin) {
+	fprintf(stderr, "Region queries require an index\n");
+	return -1;
+    }
+
+    if (!(reg = calloc(1, sizeof(*reg))))
+	return -1;
+    reg->r    = malloc(nr * sizeof(*reg->r));
+    reg->idx  = malloc(nr * sizeof(*reg->idx));
+    reg->hits = malloc(nr * sizeof(*reg->hits));
+    tmp       = malloc(nr * sizeof(*tmp));
+    if (!reg->r || !reg->idx || !reg->hits || !tmp) {
+	free(tmp);
+	fd->regions = reg;
+	cram_regions_free(fd);
+	return -1;
+    }
+
+    /* Sort, remembering the original order */
+    for (i = 0; i < nr; i++) {
+	tmp[i].r = r[i];
+	tmp[i].idx = i;
+    }
+    qsort(tmp, nr, sizeof(*tmp), region_cmp);
+    for (i = 0; i < nr; i++) {
+	reg->r[i] = tmp[i].r;
+	reg->idx[i] = tmp[i].idx;
+    }
+    free(tmp);
+    reg->nr = nr;
+
+    fd->regions = reg;
+    fd->required_fields |= SAM_POS;
+
+    return cram_seek_to_next_region(fd) < 0 ? -1 : 0;
+}
+
+/*
+ * Moves on to the next span of merged ranges, seeking to its start.
+ * Any outstanding decoding from the previous span must already have been
+ * completed.
+ *
+ * Ranges are merged while the first slice overlapping the next range
+ * starts within the span so far, as those slices would otherwise be
+ * decoded twice.
+ *
+ * Returns 0 on success
+ *         1 if no ranges remain
+ *        -1 on failure
+ */
+int cram_seek_to_next_region(cram_fd *fd) {
+    cram_regions *reg = fd->regions;
+    cram_range span;
+    cram_index *e;
+    int i;
+
+    if (!reg)
+	return 1;
+
+    /* Skip over ranges on references absent from the index */
+    for (i = reg->grp_end; i < reg->nr; i++)
+	if (cram_index_query(fd, reg->r[i].refid, reg->r[i].start, NULL))
+	    break;
+    if (i >= reg->nr) {
+	reg->grp_beg = reg->grp_end = reg->first = reg->nr;
+	fd->eof = 1;
+	return 1;
     }
 
+    span = reg->r[i];
+    reg->grp_beg = reg->first = i;
+    for (i++; i < reg->nr && reg->r[i].refid == span.refid; i++) {
+	if (span.refid >= 0) {
+	    if (!(e = cram_index_query(fd, span.refid, reg->r[i].start, NULL))
+		|| e->start > span.end)
+		break;
+	    if (span.end < reg->r[i].end)
+		span.end = reg->r[i].end;
+	}
+    }
+    reg->grp_end = i;
+
+    if (cram_seek_to_refpos(fd, &span) != 0)
+	return -1;
+    fd->range = span;
+
     return 0;
 }
 
+/*
+ * Checks which ranges in the current span a record overlaps, filling
+ * out the hits list.
+ *
+ * Returns the number of ranges overlapped.
+ */
+int cram_region_match(cram_fd *fd, int refid, int start, int end) {
+    cram_regions *reg = fd->regions;
+    int i;
+
+    reg->nhits = 0;
+    if (refid != reg->r[reg->grp_beg].refid)
+	return 0;
+
+    if (refid == -1) {
+	for (i = reg->grp_beg; i < reg->grp_end; i++)
+	    reg->hits[reg->nhits++] = reg->idx[i];
+	return reg->nhits;
+    }
+
+    /* Records are sorted, so ranges ending before this can be dropped */
+    while (reg->first < reg->grp_end && reg->r[reg->first].end < start)
+	reg->first++;
+
+    for (i = reg->first; i < reg->grp_end && reg->r[i].start <= end; i++)
+	if (reg->r[i].end >= start)
+	    reg->hits[reg->nhits++] = reg->idx[i];
+
+    return reg->nhits;
+}
+
+/*
+ * Returns the list of ranges, as indices into the array given to
+ * cram_set_regions(), overlapped by the last record returned.
+ */
+int *cram_region_hits(cram_fd *fd, int *nhits) {
+    if (!fd->regions) {
+	*nhits = 0;
+	return NULL;
+    }
+
+    *nhits = fd->regions->nhits;
+    return fd->regions->hits;
+}
+
 /*
  * A specialised form of cram_index_build (below) that deals with slices
  * having multiple references in this (ref_id -2). In this scenario we
@@ -450,12 +1008,11 @@ int cram_seek_to_refpos(cram_fd *fd, cram_range *r) {
 static int cram_index_build_multiref(cram_fd *fd,
 				     cram_container *c,
 				     cram_slice *s,
-				     zfp *fp,
+				     dstring_t *ds,
 				     off_t cpos,
 				     int32_t landmark,
 				     int sz) {
     int i, ref = -2, ref_start = 0, ref_end;
-    char buf[1024];
 
     if (0 != cram_decode_slice(fd, c, s, fd->header))
 	return -1;
@@ -469,10 +1026,10 @@ static int cram_index_build_multiref(cram_fd *fd,
 	}
 
 	if (ref != -2) {
-	    sprintf(buf, "%d\t%d\t%d\t%"PRId64"\t%d\t%d\n",
-		    ref, ref_start, ref_end - ref_start + 1,
-		    (int64_t)cpos, landmark, sz);
-	    zfputs(buf, fp);
+	    if (0 > dstring_appendf(ds, "%d\t%d\t%d\t%"PRId64"\t%d\t%d\n",
+				    ref, ref_start, ref_end - ref_start + 1,
+				    (int64_t)cpos, landmark, sz))
+		return -1;
 	}
 
 	ref = s->crecs[i].ref_id;
@@ -481,15 +1038,97 @@ static int cram_index_build_multiref(cram_fd *fd,
     }
 
     if (ref != -2) {
-	sprintf(buf, "%d\t%d\t%d\t%"PRId64"\t%d\t%d\n",
-		ref, ref_start, ref_end - ref_start + 1,
-		(int64_t)cpos, landmark, sz);
-	zfputs(buf, fp);
+	if (0 > dstring_appendf(ds, "%d\t%d\t%d\t%"PRId64"\t%d\t%d\n",
+				ref, ref_start, ref_end - ref_start + 1,
+				(int64_t)cpos, landmark, sz))
+	    return -1;
     }
 
     return 0;
 }
 
+/*
+ * The index lines for a single slice. With a thread pool these are
+ * produced by the workers, with the results being written out in order
+ * by the main thread while it continues to read the file.
+ */
+typedef struct {
+    cram_fd *fd;
+    cram_container *c;
+    cram_slice *s;
+    off_t cpos;
+    int32_t landmark;
+    int sz;
+    int last;         // last slice in c, so free c once written
+    dstring_t *ds;
+    int exit_code;
+} cram_index_job;
+
+static void *cram_index_slice_thread(void *arg) {
+    cram_index_job *j = (cram_index_job *)arg;
+    cram_slice *s = j->s;
+
+    if (s->hdr->ref_seq_id == -2) {
+	j->exit_code = cram_index_build_multiref(j->fd, j->c, s, j->ds,
+						 j->cpos, j->landmark, j->sz);
+    } else {
+	j->exit_code =
+	    dstring_appendf(j->ds, "%d\t%"PRId64"\t%"PRId64"\t%"PRId64
+			    "\t%d\t%d\n",
+			    s->hdr->ref_seq_id, s->hdr->ref_seq_start,
+			    s->hdr->ref_seq_span, (int64_t)j->cpos,
+			    j->landmark, j->sz) < 0 ? -1 : 0;
+    }
+
+    cram_free_slice(s);
+    j->s = NULL;
+
+    return j;
+}
+
+/*
+ * Writes the output of an index job and frees it, along with the
+ * container if this was its last slice.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_index_write_job(zfp *fp, cram_index_job *j) {
+    int r = j->exit_code;
+
+    if (r == 0 && dstring_length(j->ds) &&
+	zfputs(dstring_str(j->ds), fp) < 0)
+	r = -1;
+
+    if (j->last)
+	cram_free_container(j->c);
+    dstring_destroy(j->ds);
+    free(j);
+
+    return r;
+}
+
+/*
+ * Collects completed jobs from the results queue and writes them.
+ * If wait is true we block until at least one result is available.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_index_drain(zfp *fp, t_results_queue *q, int wait) {
+    t_pool_result *res;
+    int r = 0;
+
+    while ((res = wait ? t_pool_next_result_wait(q) : t_pool_next_result(q))) {
+	if (cram_index_write_job(fp, (cram_index_job *)res->data) != 0)
+	    r = -1;
+	t_pool_delete_result(res, 0);
+	wait = 0;
+    }
+
+    return r;
+}
+
 /*
  * Builds an index file.
  *
@@ -497,16 +1136,20 @@ static int cram_index_build_multiref(cram_fd *fd,
  * fn_base is the filename of the associated CRAM file. Internally we
  * add ".crai" to this to get the index filename.
  *
+ * If fd has a thread pool then slices requiring decoding are processed
+ * in parallel while the main thread continues reading.
+ *
  * Returns 0 on success
  *        -1 on failure
  */
 int cram_index_build(cram_fd *fd, const char *fn_base) {
-    cram_container *c;
+    cram_container *c, *c_pending = NULL;
     off_t cpos, spos, hpos;
     zfp *fp;
     char fn_idx[PATH_MAX];
-    int seekable;
+    int seekable, r = -1;
     size_t len;
+    t_results_queue *q = NULL;
 
     if ((len=strlen(fn_base)) > PATH_MAX-6)
 	return -1;
@@ -520,6 +1163,9 @@ int cram_index_build(cram_fd *fd, const char *fn_base) {
         return -1;
     }
 
+    if (fd->pool && !(q = t_results_queue_init()))
+	goto err;
+
     cpos = CRAM_IO_TELLO(fd);
     if (cpos >= 0) {
 	seekable = 1;
@@ -528,11 +1174,13 @@ int cram_index_build(cram_fd *fd, const char *fn_base) {
 	cpos = fd->first_container;
     }
     while ((c = cram_read_container(fd))) {
-        int j;
+        int j, nl;
+	int32_t clen;
 
         if (fd->err) {
             perror("Cram container read");
-            return -1;
+	    cram_free_container(c);
+	    goto err;
         }
 
 	if (seekable) {
@@ -542,18 +1190,22 @@ int cram_index_build(cram_fd *fd, const char *fn_base) {
 	    hpos = cpos + c->offset;
 	}
 
+	c_pending = c;
+	clen = c->length;
+	nl = c->num_landmarks; // c is freed along with the last slice's job
+
         if (!(c->comp_hdr_block = cram_read_block(fd)))
-            return -1;
+	    goto err;
         assert(c->comp_hdr_block->content_type == COMPRESSION_HEADER);
 
         c->comp_hdr = cram_decode_compression_header(fd, c->comp_hdr_block);
         if (!c->comp_hdr)
-            return -1;
+	    goto err;
 
         // 2.0 format
-        for (j = 0; j < c->num_landmarks; j++) {
-            char buf[1024];
+        for (j = 0; j < nl; j++) {
             cram_slice *s;
+	    cram_index_job *job;
             int sz;
 
 	    if (seekable) {
@@ -563,10 +1215,8 @@ int cram_index_build(cram_fd *fd, const char *fn_base) {
 		spos = cpos + c->offset + c->landmark[j];
 	    }
 
-            if (!(s = cram_read_slice(fd))) {
-		zfclose(fp);
-		return -1;
-	    }
+            if (!(s = cram_read_slice(fd)))
+		goto err;
 
 	    if (seekable) {
 		sz = (int)(CRAM_IO_TELLO(fd) - spos);
@@ -576,34 +1226,72 @@ int cram_index_build(cram_fd *fd, const char *fn_base) {
 		    : c->length - c->landmark[c->num_landmarks-1];
 	    }
 
-	    if (s->hdr->ref_seq_id == -2) {
-		cram_index_build_multiref(fd, c, s, fp,
-					  cpos, c->landmark[j], sz);
-	    } else {
-		sprintf(buf, "%d\t%"PRId64"\t%"PRId64"\t%"PRId64"\t%d\t%d\n",
-			s->hdr->ref_seq_id, s->hdr->ref_seq_start,
-			s->hdr->ref_seq_span, (int64_t)cpos,
-			c->landmark[j], sz);
-		zfputs(buf, fp);
+	    if (!(job = malloc(sizeof(*job))) ||
+		!(job->ds = dstring_create(NULL))) {
+		free(job);
+		cram_free_slice(s);
+		goto err;
+	    }
+	    job->fd = fd;
+	    job->c = c;
+	    job->s = s;
+	    job->cpos = cpos;
+	    job->landmark = c->landmark[j];
+	    job->sz = sz;
+	    job->exit_code = 0;
+	    if ((job->last = (j+1 == c->num_landmarks)))
+		c_pending = NULL;
+
+	    if (!q) {
+		cram_index_slice_thread(job);
+		if (cram_index_write_job(fp, job) != 0)
+		    goto err;
+		continue;
 	    }
 
-            cram_free_slice(s);
+	    // Write out completed jobs while waiting for room in the queue
+	    while (t_pool_dispatch2(fd->pool, q, cram_index_slice_thread,
+				    job, 1) == -1) {
+		if (cram_index_drain(fp, q, 1) != 0)
+		    goto err;
+	    }
+	    if (cram_index_drain(fp, q, 0) != 0)
+		goto err;
         }
-	
+
+	// Containers with no slices, such as the EOF block.
+	if (c_pending) {
+	    cram_free_container(c_pending);
+	    c_pending = NULL;
+	}
+
 	if (seekable) {
 	    cpos = CRAM_IO_TELLO(fd);
-	    assert(cpos == hpos + c->length);
+	    assert(cpos == hpos + clen);
 	} else {
-	    cpos = hpos + c->length;
+	    cpos = hpos + clen;
 	}
-
-        cram_free_container(c);
     }
-    if (fd->err) {
-	zfclose(fp);
-	return -1;
+    if (fd->err)
+	goto err;
+
+    r = 0;
+
+ err:
+    if (q) {
+	while (!t_pool_results_queue_empty(q))
+	    if (cram_index_drain(fp, q, 1) != 0)
+		r = -1;
+	/* A worker may still be signalling q after publishing its result */
+	t_pool_flush(fd->pool);
+	t_results_queue_destroy(q);
     }
-	
 
-    return (zfclose(fp) >= 0) ? 0 : -1;
+    if (c_pending)
+	cram_free_container(c_pending);
+
+    if (zfclose(fp) < 0)
+	r = -1;
+
+    return r;
 }
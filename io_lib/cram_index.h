@@ -40,6 +40,11 @@ extern "C" {
 
 /*
  * Loads a CRAM .crai index into memory.
+ *
+ * If fn.crai.bin exists and was built from the current fn.crai, as
+ * judged by its size and modification time, then this binary form is
+ * mmapped instead of parsing the text index.
+ *
  * Returns 0 for success
  *        -1 for failure
  */
@@ -66,6 +71,9 @@ void cram_index_free(cram_fd *fd);
  * Searches the index for the first slice overlapping a reference ID
  * and position.
  *
+ * Specify "from" as the last slice returned to find the next one, or
+ * NULL to find the first.
+ *
  * Returns the cram_index pointer on sucess
  *         NULL on failure
  */
@@ -80,6 +88,43 @@ cram_index *cram_index_query(cram_fd *fd, int refid, int pos, cram_index *frm);
  */
 int cram_seek_to_refpos(cram_fd *fd, cram_range *r);
 
+/*
+ * Sets a list of ranges to fetch. These need not be sorted or distinct.
+ *
+ * Subsequent calls to cram_get_seq() will return each record overlapping
+ * one or more of these ranges exactly once, with cram_region_hits()
+ * reporting which ranges it overlaps.  Ranges whose slices overlap are
+ * merged into a single pass through the file.
+ *
+ * Requires an index. Setting nr to 0 removes any existing ranges.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int cram_set_regions(cram_fd *fd, cram_range *r, int nr);
+
+/*
+ * Returns the list of ranges, as indices into the array given to
+ * cram_set_regions(), overlapped by the last record returned.
+ * The number of ranges is stored in *nhits.
+ */
+int *cram_region_hits(cram_fd *fd, int *nhits);
+
+/* Frees any ranges set by cram_set_regions() */
+void cram_regions_free(cram_fd *fd);
+
+/*
+ * Internal functions used by cram_get_seq() for multi-region queries.
+ *
+ * cram_seek_to_next_region returns 0 on success, 1 if no more regions
+ * remain and -1 on failure.
+ *
+ * cram_region_match returns the number of regions in the current span
+ * overlapped by refid:start-end.
+ */
+int cram_seek_to_next_region(cram_fd *fd);
+int cram_region_match(cram_fd *fd, int refid, int start, int end);
+
 /*
  * Seek within a cram file.
  *
@@ -100,6 +145,17 @@ int cram_seek(cram_fd *fd, off_t offset, int whence);
  */
 int cram_index_build(cram_fd *fd, const char *fn_base);
 
+/*
+ * Converts a text .crai index to the binary .crai.bin form, which is
+ * faster to load.
+ *
+ * fn is the filename of either the CRAM file or its .crai index.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int cram_index_build_bin(const char *fn);
+
 #ifdef __cplusplus
 }
 #endif
@@ -73,6 +73,11 @@
 #include <sys/stat.h>
 #include <math.h>
 #include <ctype.h>
+#include <fcntl.h>
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 
 #ifdef _MSC_VER
 #include <direct.h>
@@ -92,6 +97,7 @@
 #include "io_lib/md5.h"
 #include "io_lib/crc32.h"
 #include "io_lib/open_trace_file.h"
+#include "io_lib/async_io.h"
 #include "rANS_static.h"
 #include "rANS_static4x16.h"
 #include "arith_dynamic.h"
@@ -2572,20 +2578,32 @@ int paranoid_fclose(FILE *fp) {
 static void ref_entry_free_seq(ref_entry *e) {
     if (e->mf)
 	mfclose(e->mf);
-    if (e->seq && !e->mf)
+#ifdef HAVE_MMAP
+    if (e->map)
+	munmap(e->map, e->map_sz);
+#endif
+    if (e->seq && !e->mf && !e->map)
 	free(e->seq);
 
     e->seq = NULL;
     e->mf = NULL;
+    e->map = NULL;
+    e->map_lo = e->map_hi = 0;
 }
 
 void refs_free(refs_t *r) {
+    int count;
+
     RP("refs_free()\n");
 
-    if (--r->count > 0)
+    if (!r)
 	return;
 
-    if (!r)
+    /* May be shared by file handles in use on other threads */
+    pthread_mutex_lock(&r->lock);
+    count = --r->count;
+    pthread_mutex_unlock(&r->lock);
+    if (count > 0)
 	return;
 
     if (r->pool)
@@ -2744,6 +2762,8 @@ refs_t *refs_load_fai(refs_t *r_orig, char *fn, int is_err) {
 	e->count = 0;
 	e->seq = NULL;
 	e->mf = NULL;
+	e->map = NULL;
+	e->map_lo = e->map_hi = 0;
 
 	hd.p = e;
 	if (!(hi = HashTableAdd(r->h_meta, e->name, strlen(e->name), hd, &n))){
@@ -3280,6 +3300,116 @@ char *load_ref_portion(bzi_FILE *fp, ref_entry *e, int start, int end) {
     return seq;
 }
 
+/*
+ * Maps the sequence for e directly from its file instead of reading a
+ * private copy, so that concurrent processes using the same reference
+ * share a single copy in the page cache.
+ *
+ * This is only possible when the sequence is held in the file as one
+ * contiguous run of bases, as is the case for REF_CACHE files and for
+ * uncompressed fasta with each sequence on a single line.  Nothing is
+ * read here; regions are checked by cram_ref_map_check() as they are
+ * asked for, so mapping a sequence costs nothing until it is used.
+ *
+ * Returns the sequence on success;
+ *         NULL if it cannot be mapped, in which case it should be loaded
+ *         with load_ref_portion() instead.
+ */
+static char *cram_ref_map(ref_entry *e) {
+#ifdef HAVE_MMAP
+    struct stat sb;
+    unsigned char magic[2];
+    off_t start;
+    size_t len;
+    char *map;
+    int fd;
+
+    if (e->length <= 0 || (e->line_length && e->length > e->bases_per_line))
+	return NULL;
+
+    if ((fd = open(e->fn, O_RDONLY)) < 0)
+	return NULL;
+
+    // Must be uncompressed, and long enough
+    if (fstat(fd, &sb) != 0 || sb.st_size < e->offset + e->length ||
+	pread(fd, magic, 2, 0) != 2 || (magic[0] == 0x1f && magic[1] == 0x8b)) {
+	close(fd);
+	return NULL;
+    }
+
+    // Private, so lower-case bases can be fixed in place.  Only pages
+    // that are actually modified stop being shared.
+    start = e->offset - e->offset % sysconf(_SC_PAGESIZE);
+    len = e->offset - start + e->length;
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, start);
+    close(fd);
+    if (map == MAP_FAILED)
+	return NULL;
+
+    e->map = map;
+    e->map_sz = len;
+    e->map_lo = e->map_hi = 0;
+    return map + (e->offset - start);
+#else
+    return NULL;
+#endif
+}
+
+/*
+ * Upper-cases bases start to end (1-based, inclusive) of a mapped
+ * sequence, as load_ref_portion() does when copying.  The last region
+ * checked is remembered and skipped, so sequential queries look at each
+ * base only once.  Must be called with refs->lock held.
+ *
+ * Returns 0 on success
+ *        -1 on malformed sequence
+ */
+static int cram_ref_map_check(ref_entry *e, int64_t start, int64_t end) {
+    int64_t i, ostart;
+
+    if (!e->map)
+	return 0;
+
+    if (start < 1)
+	start = 1;
+    if (end > e->length)
+	end = e->length;
+    ostart = start;
+
+    if (e->map_hi && start >= e->map_lo && start <= e->map_hi)
+	start = e->map_hi+1;
+
+    for (i = start; i <= end; i++) {
+	unsigned char c;
+
+	if (i == e->map_lo) {
+	    i = e->map_hi;
+	    continue;
+	}
+
+	c = e->seq[i-1];
+	if (c < '!' || c > '~') {
+	    fprintf(stderr, "Malformed reference file?\n");
+	    return -1;
+	}
+	if (c >= 'a' && c <= 'z')
+	    e->seq[i-1] = toupper(c);
+    }
+
+    // Grow the checked region if contiguous, otherwise start a new one
+    if (e->map_hi && ostart <= e->map_hi+1 && end >= e->map_lo-1) {
+	if (e->map_lo > ostart)
+	    e->map_lo = ostart;
+	if (e->map_hi < end)
+	    e->map_hi = end;
+    } else if (ostart <= end) {
+	e->map_lo = ostart;
+	e->map_hi = end;
+    }
+
+    return 0;
+}
+
 /*
  * Load the entire reference 'id'.
  * This also increments the reference count by 1.
@@ -3328,7 +3458,8 @@ ref_entry *cram_ref_load(refs_t *r, int id) {
 
     RP("%d Loading ref %d (%d..%d)\n", gettid(), id, start, end);
 
-    if (!(seq = load_ref_portion(r->fp, e, start, end))) {
+    if (!(r->use_mmap && (seq = cram_ref_map(e))) &&
+	!(seq = load_ref_portion(r->fp, e, start, end))) {
 	return NULL;
     }
 
@@ -3375,7 +3506,7 @@ ref_entry *cram_ref_load(refs_t *r, int id) {
 char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
     ref_entry *r;
     char *seq;
-    int ostart = start;
+    int ostart = start, oend;
 
     if (id == -1)
 	return NULL;
@@ -3399,21 +3530,21 @@ char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
 	fd->shared_ref = 1;
 
 
-    /* Sanity checking: does this ID exist? */
-    if (id >= fd->refs->nref) {
-	fprintf(stderr, "No reference found for id %d\n", id);
-	if (fd->ref_lock) pthread_mutex_unlock(fd->ref_lock);
-	return NULL;
-    }
-
-    if (!fd->refs || !fd->refs->ref_id[id]) {
-	fprintf(stderr, "No reference found for id %d\n", id);
-	if (fd->ref_lock) pthread_mutex_unlock(fd->ref_lock);
-	return NULL;
-    }
+    /*
+     * The refs may be shared with other file handles (with their own
+     * ref_lock) that can be populating ref_id[] at the same time, so
+     * refs->lock is needed even to check it.
+     *
+     * 19 Sep 2013: Moved the lock here as the cram_populate_ref code calls
+     * open_path_mfile and libcurl, which isn't multi-thread safe unless I
+     * rewrite my code to have one curl handle per thread.
+     */
+    pthread_mutex_lock(&fd->refs->lock);
 
-    if (!(r = fd->refs->ref_id[id])) {
+    /* Sanity checking: does this ID exist? */
+    if (id >= fd->refs->nref || !(r = fd->refs->ref_id[id])) {
 	fprintf(stderr, "No reference found for id %d\n", id);
+	pthread_mutex_unlock(&fd->refs->lock);
 	if (fd->ref_lock) pthread_mutex_unlock(fd->ref_lock);
 	return NULL;
     }
@@ -3425,12 +3556,7 @@ char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
      * A ref entry computed from @SQ lines (M5 or UR field) will have
      * r->length == 0 unless it's been loaded once and verified that we have
      * an on-disk filename for it.
-     *
-     * 19 Sep 2013: Moved the lock here as the cram_populate_ref code calls
-     * open_path_mfile and libcurl, which isn't multi-thread safe unless I
-     * rewrite my code to have one curl handle per thread.
      */
-    pthread_mutex_lock(&fd->refs->lock);
     if (r->length == 0) {
 	if (cram_populate_ref(fd, id, r) == -1) {
 	    fprintf(stderr, "Failed to populate reference for id %d\n", id);
@@ -3456,6 +3582,7 @@ char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
     if (start < 1)
 	return NULL;
 
+    oend = end;
     if (end - start >= 0.5*r->length || fd->shared_ref) {
 	start = 1;
 	end = r->length;
@@ -3490,6 +3617,14 @@ char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
 		    cram_ref_incr_locked(fd->refs, id);
 	    }	    
 
+	    /* Mapped sequences are only checked as they are used */
+	    if (cram_ref_map_check(fd->refs->ref_id[id], ostart, oend) < 0) {
+		cram_ref_decr_locked(fd->refs, id);
+		pthread_mutex_unlock(&fd->refs->lock);
+		if (fd->ref_lock) pthread_mutex_unlock(fd->ref_lock);
+		return NULL;
+	    }
+
 	    fd->ref = NULL; /* We never access it directly */
 	    fd->ref_start = 1;
 	    fd->ref_end   = r->length;
@@ -3588,6 +3723,9 @@ int cram_load_reference(cram_fd *fd, char *fn) {
 	    return -1;
     }
 
+    if (fd->ref_mmap)
+	fd->refs->use_mmap = 1;
+
     if (-1 == refs2id(fd->refs, fd->header))
 	return -1;
 
@@ -4918,13 +5056,32 @@ int cram_default_version(void) {
 cram_fd * cram_io_close(cram_fd * fd, int * fclose_result)
 {
     if ( fd ) {
+#if defined(CRAM_IO_CUSTOM_BUFFERING)
+        /* Stop reading ahead before the input is closed */
+        if ( fd->fp_in_ra ) {
+            read_ahead_close(fd->fp_in_ra);
+            fd->fp_in_ra = NULL;
+            *fd->fp_in_callbacks = fd->fp_in_ra_orig;
+        }
+#endif
+
         if ( fd->fp_in ) {
             fclose(fd->fp_in);
             fd->fp_in = NULL;
         }
+#if defined(CRAM_IO_CUSTOM_BUFFERING)
+        /* Drain any queued output before the file is closed */
+        if ( fd->fp_out_wb ) {
+            int const r = write_behind_close(fd->fp_out_wb);
+            if ( fclose_result && r )
+                *fclose_result = r;
+            fd->fp_out_wb = NULL;
+            *fd->fp_out_callbacks = fd->fp_out_wb_orig;
+        }
+#endif
         if ( fd->fp_out ) {
             int const r = paranoid_fclose(fd->fp_out);
-            if ( fclose_result )
+            if ( fclose_result && !*fclose_result )
                 *fclose_result = r;
             fd->fp_out = NULL;
         }
@@ -5703,9 +5860,19 @@ int cram_close(cram_fd *fd) {
     if (fd->tags_used)
 	HashTableDestroy(fd->tags_used, 1);
 
-    if (fd->index)
+    if (fd->index || fd->index_map)
 	cram_index_free(fd);
 
+    if (fd->regions)
+	cram_regions_free(fd);
+
+    if (fd->bseqs) {
+	for (i = 0; i < fd->nbseqs; i++)
+	    if (fd->bseqs[i])
+		free(fd->bseqs[i]);
+	free(fd->bseqs);
+    }
+
     if (fd->own_pool && fd->pool)
 	t_pool_destroy(fd->pool, 0);
 
@@ -5798,6 +5965,14 @@ int cram_set_voption(cram_fd *fd, enum cram_option opt, va_list args) {
 	fd->ignore_md5 = va_arg(args, int);
 	break;
 
+    case CRAM_OPT_PARALLEL_BLOCKS:
+	fd->parallel_blocks = va_arg(args, int);
+	break;
+
+    case CRAM_OPT_DECODE_MEM:
+	fd->decode_mem_max = (size_t)va_arg(args, int) << 20;
+	break;
+
     case CRAM_OPT_IGNORE_CHKSUM:
 	fd->ignore_chksum = va_arg(args, int);
 	break;
@@ -5841,7 +6016,9 @@ int cram_set_voption(cram_fd *fd, enum cram_option opt, va_list args) {
 	    if (fd->refs)
 		refs_free(fd->refs);
 	    fd->refs = refs;
+	    pthread_mutex_lock(&fd->refs->lock);
 	    fd->refs->count++;
+	    pthread_mutex_unlock(&fd->refs->lock);
 	}
 	break;
 
@@ -5857,6 +6034,12 @@ int cram_set_voption(cram_fd *fd, enum cram_option opt, va_list args) {
     case CRAM_OPT_REFERENCE:
 	return cram_load_reference(fd, va_arg(args, char *));
 
+    case CRAM_OPT_REF_MMAP:
+	fd->ref_mmap = va_arg(args, int);
+	if (fd->refs)
+	    fd->refs->use_mmap = fd->ref_mmap;
+	break;
+
     case CRAM_OPT_VERSION: {
 	int major, minor;
 	char *s = va_arg(args, char *);
@@ -5943,6 +6126,69 @@ int cram_set_voption(cram_fd *fd, enum cram_option opt, va_list args) {
 	fd->preserve_aux_size = va_arg(args, int);
 	break;
 
+    case CRAM_OPT_READ_AHEAD: {
+	size_t ahead = (size_t)va_arg(args, int) << 20;
+#if defined(CRAM_IO_CUSTOM_BUFFERING)
+	cram_io_input_t *in = fd->fp_in_callbacks;
+
+	if (fd->mode != 'r' || !in || fd->fp_in_ra || !ahead)
+	    break;
+
+	fd->fp_in_ra = read_ahead_open(in->fread_callback,
+				       in->fseek_callback,
+				       in->ftell_callback,
+				       in->user_data, ahead);
+	if (!fd->fp_in_ra)
+	    return -1;
+
+	fd->fp_in_ra_orig  = *in;
+	in->user_data      = fd->fp_in_ra;
+	in->fread_callback = read_ahead_read;
+	in->fseek_callback = read_ahead_seek;
+	in->ftell_callback = read_ahead_tell;
+#else
+	if (ahead) {
+	    fprintf(stderr, "Read-ahead requires CRAM_IO_CUSTOM_BUFFERING\n");
+	    return -1;
+	}
+#endif
+	break;
+    }
+
+    case CRAM_OPT_WRITE_BEHIND: {
+	size_t queue = (size_t)va_arg(args, int) << 20;
+	int flags = va_arg(args, int);
+#if defined(CRAM_IO_CUSTOM_BUFFERING)
+	cram_io_output_t *out = fd->fp_out_callbacks;
+	int fno = -1;
+
+	if (fd->mode != 'w' || !out || fd->fp_out_wb || !queue)
+	    break;
+
+#ifdef HAVE_FILENO
+	if (fd->fp_out && out->user_data == fd->fp_out)
+	    fno = fileno(fd->fp_out);
+#endif
+
+	fd->fp_out_wb = write_behind_open(out->fwrite_callback,
+					  out->ftell_callback,
+					  out->user_data, fno, queue, flags);
+	if (!fd->fp_out_wb)
+	    return -1;
+
+	fd->fp_out_wb_orig  = *out;
+	out->user_data       = fd->fp_out_wb;
+	out->fwrite_callback = write_behind_write;
+	out->ftell_callback  = write_behind_tell;
+#else
+	if (queue) {
+	    fprintf(stderr, "Write-behind requires CRAM_IO_CUSTOM_BUFFERING\n");
+	    return -1;
+	}
+#endif
+	break;
+    }
+
     default:
 	fprintf(stderr, "Unknown CRAM option code %d\n", opt);
 	return -1;
@@ -454,6 +454,25 @@ static inline cram_block *cram_get_block_by_id(cram_slice *slice, int id) {
     return NULL;
 }
 
+/*
+ * As cram_get_block_by_id(), but also uncompresses the block (checking
+ * its CRC) the first time it is fetched.  The decoders pull external
+ * blocks through this, so blocks holding data series that are never
+ * decoded are never uncompressed.
+ *
+ * Returns the block on success
+ *         NULL if absent or on failure
+ */
+static inline cram_block *cram_fetch_block_by_id(cram_slice *slice, int id) {
+    cram_block *b = cram_get_block_by_id(slice, id);
+
+    if (b && (b->method != RAW || !b->crc32_checked))
+	if (cram_uncompress_block(b) != 0)
+	    return NULL;
+
+    return b;
+}
+
 /* --- Accessor macros for manipulating blocks on a byte by byte basis --- */
 
 /* Block size and data pointer. */
@@ -630,6 +630,8 @@ typedef struct cram_slice {
 
     // Cache of converted BAM structs
     bam_seq_t **bl;
+
+    size_t mem_est;              // accounted in cram_fd decode_mem
 } cram_slice;
 
 /*-----------------------------------------------------------------------------
@@ -646,6 +648,9 @@ typedef struct ref_entry {
     int64_t count;	   // for shared references so we know to dealloc seq
     char *seq;
     mFILE *mf;
+    void *map;             // mmapped region holding seq, see CRAM_OPT_REF_MMAP
+    size_t map_sz;
+    int64_t map_lo, map_hi;// region of a mapped seq checked so far
 } ref_entry;
 
 // References structure.
@@ -664,6 +669,7 @@ typedef struct {
     pthread_mutex_t lock;  // Mutex for multi-threaded updating
     ref_entry *last;       // Last queried sequence
     int last_id;           // Used in cram_ref_decr_locked to delay free
+    int use_mmap;          // Map sequences rather than loading them
 } refs_t;
 
 /*-----------------------------------------------------------------------------
@@ -693,12 +699,50 @@ typedef struct cram_index {
     int64_t offset; // 1.0                 1.1
 } cram_index;
 
+/*
+ * The binary index (foo.cram.crai.bin) holds the same data as the .crai
+ * file, but as a flat array sorted by reference and start position which
+ * can be mmapped directly instead of parsed.
+ *
+ * max_end is the largest end coordinate of this and all earlier entries
+ * for the same reference. It is non-decreasing, permitting a binary
+ * search for the first slice overlapping any given position.
+ */
+typedef struct {
+    int32_t refid;
+    int32_t start;
+    int32_t end;
+    int32_t max_end;
+    int32_t slice;
+    int32_t len;
+    int64_t offset;
+} cram_index_entry;
+
 typedef struct {
     int refid;
     int64_t start;
     int64_t end;
 } cram_range;
 
+/*
+ * A batch of ranges to query, as set by cram_set_regions().
+ *
+ * Ranges sharing slices are merged into a single span and decoded in one
+ * pass, so no slice is decoded more than once.  Records returned by
+ * cram_get_seq() are those overlapping at least one range, with the
+ * ranges matched available via cram_region_hits().
+ */
+typedef struct {
+    cram_range *r;      // sorted by refid (unmapped last) and start
+    int *idx;           // r[i] is the caller's range number idx[i]
+    int nr;
+    int grp_beg;        // r[grp_beg] to r[grp_end-1] is the current span
+    int grp_end;
+    int first;          // first range in span that may still overlap
+    int *hits;          // caller's range numbers overlapping last record
+    int nhits;
+} cram_regions;
+
 /*-----------------------------------------------------------------------------
  */
 /* CRAM File handle */
@@ -769,18 +813,22 @@ typedef struct {
 } cram_fd_output_buffer;
 #endif
 
-typedef struct {
+typedef struct cram_fd {
     FILE                 *fp_in;
 #if defined(CRAM_IO_CUSTOM_BUFFERING)
     cram_fd_input_buffer            *fp_in_buffer;
     cram_io_input_t                 *fp_in_callbacks;
     cram_io_allocate_read_input_t    fp_in_callback_allocate_function;
     cram_io_deallocate_read_input_t  fp_in_callback_deallocate_function;
+    struct read_ahead               *fp_in_ra;        // CRAM_OPT_READ_AHEAD
+    cram_io_input_t                  fp_in_ra_orig;   // callbacks it wraps
 
     cram_fd_output_buffer            *fp_out_buffer;
     cram_io_output_t                 *fp_out_callbacks;
     cram_io_allocate_write_output_t   fp_out_callback_allocate_function;
     cram_io_deallocate_write_output_t fp_out_callback_deallocate_function;
+    struct write_behind              *fp_out_wb;      // CRAM_OPT_WRITE_BEHIND
+    cram_io_output_t                  fp_out_wb_orig; // callbacks it wraps
 #endif
     
     FILE          *fp_out;
@@ -840,6 +888,12 @@ typedef struct {
     enum quality_binning binning;
     unsigned int required_fields;
     cram_range range;
+    cram_regions *regions;              // multi-range query, or NULL
+
+    // Storage for records returned by cram_get_bam_seqs
+    bam_seq_t **bseqs;
+    int nbseqs;
+    int bseqs_done;                     // no more records after this batch
 
     // lookup tables, stored here so we can be trivially multi-threaded
     unsigned int bam_flag_swap[0x1000]; // cram -> bam flags
@@ -850,6 +904,15 @@ typedef struct {
 
     int         index_sz;
     cram_index *index;                  // array, sizeof index_sz
+
+    // Binary index, used in preference to index when available
+    cram_index_entry *index_bin;        // sorted array of slices
+    uint64_t   *index_bin_ref;          // entries for refid are
+    int         index_bin_nref;         //   [refid+1] to [refid+2]-1
+    void       *index_map;              // mmapped (or loaded) file
+    size_t      index_map_sz;
+    int         index_mmapped;
+    cram_index *index_bin_e;            // query results, per index_bin entry
     off_t first_container;
     int eof;
     int last_slice;                     // number of recs encoded in last slice
@@ -863,6 +926,12 @@ typedef struct {
     int own_pool;
     t_pool *pool;
     t_results_queue *rqueue;
+    int parallel_blocks;                // CRAM_OPT_PARALLEL_BLOCKS
+    size_t decode_mem_max;              // CRAM_OPT_DECODE_MEM, 0 for none
+    size_t decode_mem;                  // estimated bytes of slices in flight
+    int ref_mmap;                       // CRAM_OPT_REF_MMAP
+    int (*slice_func)(void *arg, struct cram_fd *fd, cram_slice *s);
+    void *slice_arg;                    // see cram_foreach_slice()
     pthread_mutex_t *metrics_lock;
     pthread_mutex_t *ref_lock;
     spare_bams *bl;
@@ -1004,6 +1073,11 @@ enum cram_option {
     CRAM_OPT_USE_FQZ,
     CRAM_OPT_EMBED_CONS,
     CRAM_OPT_USE_TOK,
+    CRAM_OPT_READ_AHEAD,        // int MB of input to read in advance
+    CRAM_OPT_WRITE_BEHIND,      // int MB output queue, int WRITE_BEHIND_* flags
+    CRAM_OPT_PARALLEL_BLOCKS,   // int bool; decode a slice's blocks in parallel
+    CRAM_OPT_DECODE_MEM,        // int MB; rough limit on decode memory use
+    CRAM_OPT_REF_MMAP,          // int bool; mmap reference sequences if possible
 };
 
 /* BF bitfields */
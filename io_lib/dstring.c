@@ -481,6 +481,7 @@ int dstring_nappend(dstring_t *ds, const char *str, size_t len) {
 
     memcpy(&ds->str[ds->length], str, len);
     ds->length += len;
+    ds->str[ds->length] = 0;
 
     return 0;
 }
@@ -181,6 +181,7 @@ scram_fd *scram_open(const char *filename, const char *mode) {
 	return NULL;
 
     fd->eof = 0;
+    fd->view_seq = NULL;
 
     /* I/O buffer */
     fd->fp = NULL;
@@ -265,6 +266,7 @@ scram_fd *scram_open_cram_via_callbacks(
 	return NULL;
 
     fd->eof = 0;
+    fd->view_seq = NULL;
 
     /* I/O buffer */
     fd->fp = NULL;
@@ -298,6 +300,9 @@ int scram_close(scram_fd *fd) {
     if (fd->pool)
 	t_pool_destroy(fd->pool, 0);
 
+    if (fd->view_seq)
+	free(fd->view_seq);
+
 
     free(fd);
     return r;
@@ -349,9 +354,7 @@ int scram_get_seq(scram_fd *fd, bam_seq_t **bsp) {
 	    return 0;
 
 	case 0:
-	    // FIXME: if we ever implement range queries for BAM this will
-	    // need amendments to not claim a sub-range is invalid EOF.
-	    fd->eof = fd->b->eof_block ? 1 : 2;
+	    fd->eof = fd->b->eof_block || fd->b->range_done ? 1 : 2;
 	    return -1;
 
 	default:
@@ -367,6 +370,49 @@ int scram_get_seq(scram_fd *fd, bam_seq_t **bsp) {
     return 0;
 }
 
+int scram_get_seqs(scram_fd *fd, bam_seq_t **array, int n) {
+    int r;
+
+    if (fd->is_bam) {
+	r = bam_get_seqs(fd->b, array, n);
+	if (r > 0)
+	    return r;
+
+	fd->eof = r < 0 ? -1 : fd->b->eof_block || fd->b->range_done ? 1 : 2;
+	return -1;
+    }
+
+    r = cram_get_bam_seqs(fd->c, array, n);
+    if (r > 0)
+	return r;
+
+    fd->eof = r < 0 ? -1 : cram_eof(fd->c);
+    return -1;
+}
+
+int scram_get_view(scram_fd *fd, bam_view_t *v) {
+    if (fd->is_bam) {
+	switch (bam_get_view(fd->b, v)) {
+	case 1:
+	    return 0;
+
+	case 0:
+	    fd->eof = fd->b->eof_block || fd->b->range_done ? 1 : 2;
+	    return -1;
+
+	default:
+	    fd->eof = -1; // err
+	    return -1;
+	}
+    }
+
+    if (scram_get_seq(fd, &fd->view_seq) == -1)
+	return -1;
+
+    bam_seq_view(v, fd->view_seq);
+    return 0;
+}
+
 int scram_next_seq(scram_fd *fd, bam_seq_t **bsp) {
     return scram_get_seq(fd, bsp);
 }
@@ -423,6 +469,16 @@ int scram_set_option(scram_fd *fd, enum cram_option opt, ...) {
         char *idx_fn = va_arg(args, char *);
         if (fd->is_bam)
 	    return bam_set_option (fd->b,  BAM_OPT_OUTPUT_BGZIP_IDX, idx_fn);
+    } else if (opt == CRAM_OPT_READ_AHEAD && fd->is_bam) {
+	return bam_set_option(fd->b, BAM_OPT_READ_AHEAD, va_arg(args, int));
+    } else if (opt == CRAM_OPT_WRITE_BEHIND && fd->is_bam) {
+	int queue = va_arg(args, int);
+	int flags = va_arg(args, int);
+	return bam_set_option(fd->b, BAM_OPT_WRITE_BEHIND, queue, flags);
+    } else if (opt == CRAM_OPT_RANGE && fd->is_bam) {
+	cram_range *r = va_arg(args, cram_range *);
+	return bam_set_option(fd->b, BAM_OPT_RANGE, r->refid,
+			      (int64_t)r->start, (int64_t)r->end);
     }
 
     if (!fd->is_bam) {
@@ -434,6 +490,21 @@ int scram_set_option(scram_fd *fd, enum cram_option opt, ...) {
     return r;
 }
 
+/*! Loads the index for a BAM or CRAM file.
+ *
+ * fn is the filename of the BAM or CRAM file; the .bai, .csi or .crai
+ * suffix is added as appropriate.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int scram_index_load(scram_fd *fd, const char *fn) {
+    return fd->is_bam
+	? bam_index_load(fd->b, fn)
+	: cram_index_load(fd->c, fn);
+}
+
 /*! Returns the line number when processing a SAM file
  *
  * @return
@@ -68,6 +68,9 @@ typedef struct {
     FILE *fp;   // copy of file handle.
 
     t_pool *pool;
+
+    /* Decoded record for scram_get_view() when views are not possible */
+    bam_seq_t *view_seq;
 } scram_fd;
 
 /*
@@ -227,6 +230,35 @@ int scram_input_buffer(scram_fd *fd, unsigned char *buf, size_t size);
  */
 int scram_get_seq(scram_fd *fd, bam_seq_t **bsp);
 
+/*! Fetches a batch of up to n sequences.
+ *
+ * This is equivalent to calling scram_get_seq() up to n times, but with
+ * lower per-record overhead. The sequences are held in storage owned by
+ * fd and are only valid until the next call reading from fd. They must
+ * not be freed or modified.
+ *
+ * Fewer than n sequences may be returned even when more remain, for
+ * example at the end of a CRAM slice.
+ *
+ * @return
+ * Returns the number of sequences filled out in array on success;
+ *        -1 on failure or EOF; check with scram_eof(fd).
+ */
+int scram_get_seqs(scram_fd *fd, bam_seq_t **array, int n);
+
+/*! Fetches the next sequence as a read-only view.
+ *
+ * For BAM this avoids copying the record; see bam_get_view(). Other
+ * formats are decoded into a bam_seq_t held by fd, which the view then
+ * refers to. Either way the view is only valid until the next call
+ * reading from fd.
+ *
+ * @return
+ * Returns 0 on success and fills out v;
+ *        -1 on failure or EOF; check with scram_eof(fd).
+ */
+int scram_get_view(scram_fd *fd, bam_view_t *v);
+
 /*! Deprecated: please use scram_get_seq() instead */
 int scram_next_seq(scram_fd *fd, bam_seq_t **bsp);
 
@@ -250,6 +282,17 @@ int scram_put_seq(scram_fd *fd, bam_seq_t *s);
  */
 int scram_set_option(scram_fd *fd, enum cram_option opt, ...);
 
+/*! Loads the index for a BAM or CRAM file.
+ *
+ * fn is the filename of the BAM or CRAM file; the .bai, .csi or .crai
+ * suffix is added as appropriate.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int scram_index_load(scram_fd *fd, const char *fn);
+
 /*! Returns the line number when processing a SAM file
  *
  * @return
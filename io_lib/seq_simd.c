@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2026 Genome Research Ltd.
+ * Author(s): James Bonfield
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ * 
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "io_lib_config.h"
+#endif
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "io_lib/seq_simd.h"
+
+/*
+ * cp = "=ACMGRSVTWYHKDBN";
+ * memset(L, 15, 256);
+ * for (i = 0; i < 16; i++) {
+ *     L[cp[i]] = L[tolower(cp[i])] = i;
+ * }
+ */
+static const unsigned char nt16_table[256] = {
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 00 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 10 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 20 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15, 0,15,15, /* 30 */
+    15, 1,14, 2,13,15,15, 4, 11,15,15,12,15, 3,15,15, /* 40 */
+    15,15, 5, 6, 8,15, 7, 9, 15,10,15,15,15,15,15,15, /* 50 */
+    15, 1,14, 2,13,15,15, 4, 11,15,15,12,15, 3,15,15, /* 60 */
+    15,15, 5, 6, 8,15, 7, 9, 15,10,15,15,15,15,15,15, /* 70 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 80 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 90 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* a0 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* b0 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* c0 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* d0 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* e0 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15};/* f0 */
+
+static const char nt16_rev[] = "=ACMGRSVTWYHKDBN";
+
+/* ----------------------------------------------------------------------
+ * Scalar versions.  These also handle the tails left by the SIMD code.
+ */
+static void pack_scalar(unsigned char *dst, const unsigned char *src,
+			size_t len) {
+    size_t i;
+
+    for (i = 0; i+1 < len; i += 2)
+	*dst++ = (nt16_table[src[i]]<<4) | nt16_table[src[i+1]];
+    if (i < len)
+	*dst = nt16_table[src[i]]<<4;
+}
+
+static void unpack_scalar(unsigned char *dst, const unsigned char *src,
+			  size_t len) {
+    size_t i;
+
+    for (i = 0; i+1 < len; i += 2, src++) {
+	dst[i+0] = nt16_rev[*src >> 4];
+	dst[i+1] = nt16_rev[*src & 15];
+    }
+    if (i < len)
+	dst[i] = nt16_rev[*src >> 4];
+}
+
+static void qual_add_scalar(unsigned char *dst, const unsigned char *src,
+			    size_t len, int delta) {
+    size_t i;
+
+    for (i = 0; i < len; i++)
+	dst[i] = src[i] + delta;
+}
+
+static void (*pack_fn)(unsigned char *, const unsigned char *, size_t)
+    = pack_scalar;
+static void (*unpack_fn)(unsigned char *, const unsigned char *, size_t)
+    = unpack_scalar;
+static void (*qual_add_fn)(unsigned char *, const unsigned char *, size_t,
+			   int) = qual_add_scalar;
+
+/* ----------------------------------------------------------------------
+ * x86 versions, compiled with per-function target attributes so the rest
+ * of the library does not need building with -mavx2.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ >= 5 || defined(__clang__))
+#define HAVE_SEQ_SIMD_X86
+
+#include <immintrin.h>
+
+/*
+ * Bases are looked up by low nibble in one of two tables, selected by
+ * the high nibble with the lowercase bit removed.  '=' is the only
+ * other valid character and everything else maps to 15.
+ */
+#define PACK_TABLE_4 15, 1,14, 2,13,15,15, 4, 11,15,15,12,15, 3,15,15
+#define PACK_TABLE_5 15,15, 5, 6, 8,15, 7, 9, 15,10,15,15,15,15,15,15
+#define UNPACK_TABLE '=','A','C','M','G','R','S','V', \
+                     'T','W','Y','H','K','D','B','N'
+
+__attribute__((target("ssse3")))
+static inline __m128i pack_codes_ssse3(__m128i x) {
+    const __m128i t4 = _mm_setr_epi8(PACK_TABLE_4);
+    const __m128i t5 = _mm_setr_epi8(PACK_TABLE_5);
+    __m128i lo = _mm_and_si128(x, _mm_set1_epi8(0x0f));
+    __m128i hi = _mm_and_si128(x, _mm_set1_epi8((char)0xd0));
+    __m128i m4 = _mm_cmpeq_epi8(hi, _mm_set1_epi8(0x40));
+    __m128i m5 = _mm_cmpeq_epi8(hi, _mm_set1_epi8(0x50));
+    __m128i eq = _mm_cmpeq_epi8(x,  _mm_set1_epi8('='));
+    __m128i r  = _mm_or_si128(_mm_and_si128(m4, _mm_shuffle_epi8(t4, lo)),
+			      _mm_and_si128(m5, _mm_shuffle_epi8(t5, lo)));
+    __m128i n  = _mm_andnot_si128(_mm_or_si128(_mm_or_si128(m4, m5), eq),
+				  _mm_set1_epi8(15));
+    return _mm_or_si128(r, n);
+}
+
+__attribute__((target("ssse3")))
+static void pack_ssse3(unsigned char *dst, const unsigned char *src,
+		       size_t len) {
+    const __m128i w = _mm_set1_epi16(0x0110); /* hi*16 + lo*1 */
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32, dst += 16) {
+	__m128i a = pack_codes_ssse3(_mm_loadu_si128((__m128i *)(src+i)));
+	__m128i b = pack_codes_ssse3(_mm_loadu_si128((__m128i *)(src+i+16)));
+	a = _mm_maddubs_epi16(a, w);
+	b = _mm_maddubs_epi16(b, w);
+	_mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(a, b));
+    }
+    pack_scalar(dst, src+i, len-i);
+}
+
+__attribute__((target("ssse3")))
+static void unpack_ssse3(unsigned char *dst, const unsigned char *src,
+			 size_t len) {
+    const __m128i t = _mm_setr_epi8(UNPACK_TABLE);
+    const __m128i m = _mm_set1_epi8(0x0f);
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32, src += 16) {
+	__m128i x  = _mm_loadu_si128((__m128i *)src);
+	__m128i hi = _mm_shuffle_epi8(t, _mm_and_si128(_mm_srli_epi16(x,4),m));
+	__m128i lo = _mm_shuffle_epi8(t, _mm_and_si128(x, m));
+	_mm_storeu_si128((__m128i *)(dst+i),    _mm_unpacklo_epi8(hi, lo));
+	_mm_storeu_si128((__m128i *)(dst+i+16), _mm_unpackhi_epi8(hi, lo));
+    }
+    unpack_scalar(dst+i, src, len-i);
+}
+
+__attribute__((target("ssse3")))
+static void qual_add_ssse3(unsigned char *dst, const unsigned char *src,
+			   size_t len, int delta) {
+    const __m128i d = _mm_set1_epi8((char)delta);
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+	__m128i x = _mm_loadu_si128((__m128i *)(src+i));
+	_mm_storeu_si128((__m128i *)(dst+i), _mm_add_epi8(x, d));
+    }
+    qual_add_scalar(dst+i, src+i, len-i, delta);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i pack_codes_avx2(__m256i x) {
+    const __m256i t4 = _mm256_setr_epi8(PACK_TABLE_4, PACK_TABLE_4);
+    const __m256i t5 = _mm256_setr_epi8(PACK_TABLE_5, PACK_TABLE_5);
+    __m256i lo = _mm256_and_si256(x, _mm256_set1_epi8(0x0f));
+    __m256i hi = _mm256_and_si256(x, _mm256_set1_epi8((char)0xd0));
+    __m256i m4 = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(0x40));
+    __m256i m5 = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(0x50));
+    __m256i eq = _mm256_cmpeq_epi8(x,  _mm256_set1_epi8('='));
+    __m256i r  = _mm256_or_si256(
+		     _mm256_and_si256(m4, _mm256_shuffle_epi8(t4, lo)),
+		     _mm256_and_si256(m5, _mm256_shuffle_epi8(t5, lo)));
+    __m256i n  = _mm256_andnot_si256(
+		     _mm256_or_si256(_mm256_or_si256(m4, m5), eq),
+		     _mm256_set1_epi8(15));
+    return _mm256_or_si256(r, n);
+}
+
+__attribute__((target("avx2")))
+static void pack_avx2(unsigned char *dst, const unsigned char *src,
+		      size_t len) {
+    const __m256i w = _mm256_set1_epi16(0x0110);
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64, dst += 32) {
+	__m256i a = pack_codes_avx2(_mm256_loadu_si256((__m256i *)(src+i)));
+	__m256i b = pack_codes_avx2(_mm256_loadu_si256((__m256i *)(src+i+32)));
+	a = _mm256_maddubs_epi16(a, w);
+	b = _mm256_maddubs_epi16(b, w);
+	/* packus works per 128-bit lane, so restore the order afterwards */
+	_mm256_storeu_si256((__m256i *)dst,
+			    _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b),
+						     0xd8));
+    }
+    pack_ssse3(dst, src+i, len-i);
+}
+
+__attribute__((target("avx2")))
+static void unpack_avx2(unsigned char *dst, const unsigned char *src,
+			size_t len) {
+    const __m256i t = _mm256_setr_epi8(UNPACK_TABLE, UNPACK_TABLE);
+    const __m256i m = _mm256_set1_epi8(0x0f);
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64, src += 32) {
+	__m256i x  = _mm256_loadu_si256((__m256i *)src);
+	__m256i hi = _mm256_shuffle_epi8(t, _mm256_and_si256(
+					     _mm256_srli_epi16(x, 4), m));
+	__m256i lo = _mm256_shuffle_epi8(t, _mm256_and_si256(x, m));
+	__m256i a  = _mm256_unpacklo_epi8(hi, lo);
+	__m256i b  = _mm256_unpackhi_epi8(hi, lo);
+	_mm256_storeu_si256((__m256i *)(dst+i),
+			    _mm256_permute2x128_si256(a, b, 0x20));
+	_mm256_storeu_si256((__m256i *)(dst+i+32),
+			    _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    unpack_ssse3(dst+i, src, len-i);
+}
+
+__attribute__((target("avx2")))
+static void qual_add_avx2(unsigned char *dst, const unsigned char *src,
+			  size_t len, int delta) {
+    const __m256i d = _mm256_set1_epi8((char)delta);
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+	__m256i x = _mm256_loadu_si256((__m256i *)(src+i));
+	_mm256_storeu_si256((__m256i *)(dst+i), _mm256_add_epi8(x, d));
+    }
+    qual_add_ssse3(dst+i, src+i, len-i, delta);
+}
+#endif /* x86 */
+
+static pthread_once_t seq_simd_once = PTHREAD_ONCE_INIT;
+
+static void seq_simd_init(void) {
+#ifdef HAVE_SEQ_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+	pack_fn     = pack_avx2;
+	unpack_fn   = unpack_avx2;
+	qual_add_fn = qual_add_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+	pack_fn     = pack_ssse3;
+	unpack_fn   = unpack_ssse3;
+	qual_add_fn = qual_add_ssse3;
+    }
+#endif
+}
+
+/*
+ * Packs len ASCII bases from src into 4-bit "=ACMGRSVTWYHKDBN" codes in
+ * dst, two per byte with the first base in the high nibble.  Lowercase
+ * is accepted and unrecognised characters become N (15).  If len is odd
+ * the low nibble of the last byte is zero.
+ *
+ * dst must have room for (len+1)/2 bytes.
+ */
+void seq_nt16_pack(unsigned char *dst, const unsigned char *src, size_t len) {
+    if (len < 32) {
+	pack_scalar(dst, src, len);
+	return;
+    }
+    pthread_once(&seq_simd_once, seq_simd_init);
+    pack_fn(dst, src, len);
+}
+
+/*
+ * The inverse of seq_nt16_pack.  Unpacks len bases from the 4-bit codes
+ * in src into ASCII in dst.  No nul terminator is added.
+ */
+void seq_nt16_unpack(unsigned char *dst, const unsigned char *src,
+		     size_t len) {
+    if (len < 32) {
+	unpack_scalar(dst, src, len);
+	return;
+    }
+    pthread_once(&seq_simd_once, seq_simd_init);
+    unpack_fn(dst, src, len);
+}
+
+/*
+ * Adds delta to each of the len bytes of src, modulo 256, writing to dst.
+ * Used with +33 / -33 to convert between phred and SAM printable quality
+ * values.  dst and src may be the same.
+ */
+void seq_qual_add(unsigned char *dst, const unsigned char *src, size_t len,
+		  int delta) {
+    if (len < 16) {
+	qual_add_scalar(dst, src, len, delta);
+	return;
+    }
+    pthread_once(&seq_simd_once, seq_simd_init);
+    qual_add_fn(dst, src, len, delta);
+}
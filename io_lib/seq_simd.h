@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2026 Genome Research Ltd.
+ * Author(s): James Bonfield
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ * 
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Vectorised conversions between the textual and BAM binary forms of
+ * sequence and quality strings.
+ *
+ * These are used by the SAM/BAM reader and writer plus the CRAM encoder
+ * and decoder.  On x86 the SSSE3 or AVX2 implementation is picked at run
+ * time based on the CPU, with a portable scalar version used elsewhere.
+ */
+
+#ifndef _SEQ_SIMD_H_
+#define _SEQ_SIMD_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Packs len ASCII bases from src into 4-bit "=ACMGRSVTWYHKDBN" codes in
+ * dst, two per byte with the first base in the high nibble.  Lowercase
+ * is accepted and unrecognised characters become N (15).  If len is odd
+ * the low nibble of the last byte is zero.
+ *
+ * dst must have room for (len+1)/2 bytes.
+ */
+void seq_nt16_pack(unsigned char *dst, const unsigned char *src, size_t len);
+
+/*
+ * The inverse of seq_nt16_pack.  Unpacks len bases from the 4-bit codes
+ * in src into ASCII in dst.  No nul terminator is added.
+ */
+void seq_nt16_unpack(unsigned char *dst, const unsigned char *src,
+		     size_t len);
+
+/*
+ * Adds delta to each of the len bytes of src, modulo 256, writing to dst.
+ * Used with +33 / -33 to convert between phred and SAM printable quality
+ * values.  dst and src may be the same.
+ */
+void seq_qual_add(unsigned char *dst, const unsigned char *src, size_t len,
+		  int delta);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SEQ_SIMD_H_ */
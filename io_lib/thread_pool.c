@@ -85,6 +85,38 @@ int gettimeofday(struct timeval * tp, struct timezone * tzp)
 }
 #endif
 
+/*
+ * The job counters and results queue ring buffers are updated by all
+ * threads, so to avoid taking a lock per job we use atomic operations
+ * where available.  These are full memory barriers, which the sleep/wake
+ * logic below relies on.
+ */
+#if defined(__GNUC__)
+#define t_pool_atomic_add(v, x) __sync_add_and_fetch((v), (x))
+#define t_pool_atomic_cas(v, o, n) __sync_bool_compare_and_swap((v), (o), (n))
+#else
+static pthread_mutex_t t_pool_atomic_m = PTHREAD_MUTEX_INITIALIZER;
+
+static int t_pool_atomic_add(int *v, int x) {
+    int r;
+    pthread_mutex_lock(&t_pool_atomic_m);
+    r = (*v += x);
+    pthread_mutex_unlock(&t_pool_atomic_m);
+    return r;
+}
+
+static int t_pool_atomic_cas_(void **v, void *o, void *n) {
+    int r;
+    pthread_mutex_lock(&t_pool_atomic_m);
+    if ((r = (*v == o)))
+	*v = n;
+    pthread_mutex_unlock(&t_pool_atomic_m);
+    return r;
+}
+#define t_pool_atomic_cas(v, o, n) t_pool_atomic_cas_((void **)(v), (o), (n))
+#endif
+#define t_pool_atomic_get(v) t_pool_atomic_add((v), 0)
+
 /* ----------------------------------------------------------------------------
  * A queue to hold results from the thread pool.
  *
@@ -96,7 +128,14 @@ int gettimeofday(struct timeval * tp, struct timezone * tzp)
  */
 
 /*
- * Adds a result to the end of the result queue.
+ * Results are stored in a ring buffer indexed by serial number, so they
+ * are published and collected in order with a single atomic operation
+ * rather than a lock and list search.  A result too far ahead of the
+ * consumer to fit in the ring goes on the locked overflow list instead.
+ */
+
+/*
+ * Adds a result to the result queue.
  *
  * Returns 0 on success;
  *        -1 on failure
@@ -114,22 +153,39 @@ static int t_pool_add_result(t_pool_job *j, void *data) {
     if (!q)
 	return 0;
 
-    if (!(r = malloc(sizeof(*r))))
+    if (!(r = malloc(sizeof(*r)))) {
+	/* The result is lost, but the job is no longer pending */
+	if (t_pool_atomic_add(&q->pending, -1) == 0)
+	    t_pool_atomic_add(&j->p->active_weight, -q->weight);
 	return -1;
+    }
 
     r->next = NULL;
     r->data = data;
     r->serial = j->serial;
 
-    pthread_mutex_lock(&q->result_m);
-    if (q->result_tail) {
-	q->result_tail->next = r;
-	q->result_tail = r;
+    t_pool_atomic_add(&q->queue_len, 1);
+    if (t_pool_atomic_add(&q->pending, -1) == 0)
+	t_pool_atomic_add(&j->p->active_weight, -q->weight);
+
+    if ((unsigned)(r->serial - t_pool_atomic_get(&q->next_serial))
+	  < T_RESULTS_RING &&
+	t_pool_atomic_cas(&q->ring[r->serial & (T_RESULTS_RING-1)], NULL, r)) {
+	/* Published; only wake the consumer if it is asleep */
+	if (!t_pool_atomic_get(&q->waiting))
+	    return 0;
+
+	pthread_mutex_lock(&q->result_m);
     } else {
-	q->result_head = q->result_tail = r;
+	pthread_mutex_lock(&q->result_m);
+	if (q->result_tail) {
+	    q->result_tail->next = r;
+	    q->result_tail = r;
+	} else {
+	    q->result_head = q->result_tail = r;
+	}
+	t_pool_atomic_add(&q->n_overflow, 1);
     }
-    q->queue_len++;
-    q->pending--;
 
 #ifdef DEBUG
     fprintf(stderr, "%d: Broadcasting result_avail (id %d)\n",
@@ -145,12 +201,12 @@ static int t_pool_add_result(t_pool_job *j, void *data) {
     return 0;
 }
 
-/* Core of t_pool_next_result() */
-static t_pool_result *t_pool_next_result_locked(t_results_queue *q) {
+/* Searches the overflow list for the next result. Needs result_m held. */
+static t_pool_result *t_pool_next_overflow(t_results_queue *q, int serial) {
     t_pool_result *r, *last;
 
     for (last = NULL, r = q->result_head; r; last = r, r = r->next) {
-	if (r->serial == q->next_serial)
+	if (r->serial == serial)
 	    break;
     }
 
@@ -166,13 +222,44 @@ static t_pool_result *t_pool_next_result_locked(t_results_queue *q) {
 	if (!q->result_head)
 	    q->result_tail = NULL;
 
-	q->next_serial++;
-	q->queue_len--;
+	t_pool_atomic_add(&q->n_overflow, -1);
     }
 
     return r;
 }
 
+/*
+ * Core of t_pool_next_result().  If have_lock is false the result_m
+ * lock is taken if we need to check the overflow list.
+ */
+static t_pool_result *t_pool_next_result_(t_results_queue *q, int have_lock) {
+    t_pool_result *r, **slot;
+    int serial = t_pool_atomic_get(&q->next_serial);
+
+    slot = &q->ring[serial & (T_RESULTS_RING-1)];
+    if ((r = *slot) && r->serial == serial &&
+	t_pool_atomic_cas(slot, r, NULL))
+	goto found;
+
+    if (!t_pool_atomic_get(&q->n_overflow))
+	return NULL;
+
+    if (!have_lock)
+	pthread_mutex_lock(&q->result_m);
+    r = t_pool_next_overflow(q, serial);
+    if (!have_lock)
+	pthread_mutex_unlock(&q->result_m);
+
+    if (!r)
+	return NULL;
+
+ found:
+    t_pool_atomic_add(&q->queue_len, -1);
+    t_pool_atomic_add(&q->next_serial, 1);
+
+    return r;
+}
+
 /*
  * Pulls a result off the head of the result queue. Caller should
  * free it (and any internals as appropriate) after use. This doesn't
@@ -190,9 +277,7 @@ t_pool_result *t_pool_next_result(t_results_queue *q) {
     fprintf(stderr, "Requesting next result on queue %p\n", q);
 #endif
 
-    pthread_mutex_lock(&q->result_m);
-    r = t_pool_next_result_locked(q);
-    pthread_mutex_unlock(&q->result_m);
+    r = t_pool_next_result_(q, 0);
 
 #ifdef DEBUG
     fprintf(stderr, "(q=%p) Found %p\n", q, r);
@@ -208,9 +293,20 @@ t_pool_result *t_pool_next_result_wait(t_results_queue *q) {
     fprintf(stderr, "Waiting for result %d...\n", q->next_serial);
 #endif
 
+    if ((r = t_pool_next_result_(q, 0)))
+	return r;
+
+    /*
+     * Flag that we are waiting before checking again under the lock, so
+     * any result published after that check will signal us.  This also
+     * marks the queue as urgent so the job we need is run ahead of others.
+     */
     pthread_mutex_lock(&q->result_m);
-    while (!(r = t_pool_next_result_locked(q))) {
-	/* Possible race here now avoided via _locked() call, but incase... */
+    t_pool_atomic_add(&q->waiting, 1);
+    if (q->p)
+	t_pool_atomic_add(&q->p->nurgent, 1);
+
+    while (!(r = t_pool_next_result_(q, 1))) {
 	struct timeval now;
 	struct timespec timeout;
 
@@ -220,6 +316,10 @@ t_pool_result *t_pool_next_result_wait(t_results_queue *q) {
 
 	pthread_cond_timedwait(&q->result_avail_c, &q->result_m, &timeout);
     }
+
+    if (q->p)
+	t_pool_atomic_add(&q->p->nurgent, -1);
+    t_pool_atomic_add(&q->waiting, -1);
     pthread_mutex_unlock(&q->result_m);
 
     return r;
@@ -228,15 +328,14 @@ t_pool_result *t_pool_next_result_wait(t_results_queue *q) {
 /*
  * Returns true if there are no items on the finished results queue and
  * also none still pending.
+ *
+ * t_pool_add_result() increments queue_len before decrementing pending,
+ * so pending must be read first.  Otherwise a result finishing between
+ * the two reads would be counted in neither.
  */
 int t_pool_results_queue_empty(t_results_queue *q) {
-    int empty;
-
-    pthread_mutex_lock(&q->result_m);
-    empty = q->queue_len == 0 && q->pending == 0;
-    pthread_mutex_unlock(&q->result_m);
-
-    return empty;
+    return t_pool_atomic_get(&q->pending) == 0 &&
+	t_pool_atomic_get(&q->queue_len) == 0;
 }
 
 
@@ -244,23 +343,25 @@ int t_pool_results_queue_empty(t_results_queue *q) {
  * Returns the number of completed jobs on the results queue.
  */
 int t_pool_results_queue_len(t_results_queue *q) {
-    int len;
-
-    pthread_mutex_lock(&q->result_m);
-    len = q->queue_len;
-    pthread_mutex_unlock(&q->result_m);
-
-    return len;
+    return t_pool_atomic_get(&q->queue_len);
 }
 
+/*
+ * Returns the number of completed plus pending jobs.  As above pending is
+ * read first, so a result in transit may be counted twice but never missed.
+ */
 int t_pool_results_queue_sz(t_results_queue *q) {
-    int len;
-
-    pthread_mutex_lock(&q->result_m);
-    len = q->queue_len + q->pending;
-    pthread_mutex_unlock(&q->result_m);
+    int pending = t_pool_atomic_get(&q->pending);
+    return pending + t_pool_atomic_get(&q->queue_len);
+}
 
-    return len;
+/*
+ * Returns the number of idle worker threads with no queued job waiting
+ * for them.  This is only a hint, as it may change at any moment.
+ */
+int t_pool_idle(t_pool *p) {
+    int n = t_pool_atomic_get(&p->nwaiting) - t_pool_atomic_get(&p->njobs);
+    return n > 0 ? n : 0;
 }
 
 /*
@@ -286,19 +387,41 @@ void t_pool_delete_result(t_pool_result *r, int free_data) {
 t_results_queue *t_results_queue_init(void) {
     t_results_queue *q = malloc(sizeof(*q));
 
+    if (!q)
+	return NULL;
+
     pthread_mutex_init(&q->result_m, NULL);
     pthread_cond_init(&q->result_avail_c, NULL);
 
     q->result_head = NULL;
     q->result_tail = NULL;
+    q->n_overflow  = 0;
     q->next_serial = 0;
     q->curr_serial = 0;
     q->queue_len   = 0;
     q->pending     = 0;
+    q->p           = NULL;
+    q->weight      = 1;
+    q->waiting     = 0;
+
+    if (!(q->ring = calloc(T_RESULTS_RING, sizeof(*q->ring)))) {
+	pthread_mutex_destroy(&q->result_m);
+	pthread_cond_destroy(&q->result_avail_c);
+	free(q);
+	return NULL;
+    }
 
     return q;
 }
 
+/*
+ * Sets the relative weighting of a results queue when several share a
+ * pool.  This should be called before any jobs are dispatched to it.
+ */
+void t_results_queue_set_weight(t_results_queue *q, int weight) {
+    q->weight = weight < 1 ? 1 : weight;
+}
+
 /* Deallocates memory for a results queue */
 void t_results_queue_destroy(t_results_queue *q) {
 #ifdef DEBUG
@@ -310,6 +433,7 @@ void t_results_queue_destroy(t_results_queue *q) {
 
     pthread_mutex_destroy(&q->result_m);
     pthread_cond_destroy(&q->result_avail_c);
+    free(q->ring);
 
     memset(q, 0xbb, sizeof(*q));
     free(q);
@@ -325,12 +449,107 @@ void t_results_queue_destroy(t_results_queue *q) {
 
 #define TDIFF(t2,t1) ((t2.tv_sec-t1.tv_sec)*1000000 + t2.tv_usec-t1.tv_usec)
 
+/*
+ * Removes the oldest job from a worker queue. If steal is true we give
+ * up rather than wait when the queue is locked by someone else.
+ *
+ * Both the owner and thieves take from the head, as results are usually
+ * consumed in order so running the oldest job first minimises the time
+ * results spend waiting in the results queue.
+ *
+ * Returns job on success
+ *         NULL if none available
+ */
+static t_pool_job *t_pool_pop(t_pool_worker_t *w, int steal) {
+    t_pool_job *j;
+
+    if (steal) {
+	if (pthread_mutex_trylock(&w->q_m) != 0)
+	    return NULL;
+    } else {
+	pthread_mutex_lock(&w->q_m);
+    }
+
+    if ((j = w->head)) {
+	if (!(w->head = j->next))
+	    w->tail = NULL;
+    }
+
+    pthread_mutex_unlock(&w->q_m);
+
+    return j;
+}
+
+/*
+ * Looks for a job that a consumer is blocked waiting on; that is the
+ * next serial number expected by a results queue flagged as waiting.
+ *
+ * Queues locked by another thread are skipped rather than waited on, so
+ * that workers do not serialise on each other's locks while a consumer
+ * is waiting.  A job missed here is still found by the normal path.
+ *
+ * Returns job on success
+ *         NULL if none found
+ */
+static t_pool_job *t_pool_pop_urgent(t_pool *p, t_pool_worker_t *w) {
+    t_pool_job *j, *last;
+    int i;
+
+    for (i = 0; i < p->tsize; i++) {
+	t_pool_worker_t *v = &p->t[(w->idx + i) % p->tsize];
+
+	if (pthread_mutex_trylock(&v->q_m) != 0)
+	    continue;
+	for (last = NULL, j = v->head; j; last = j, j = j->next) {
+	    if (j->q && t_pool_atomic_get(&j->q->waiting) &&
+		j->serial == t_pool_atomic_get(&j->q->next_serial))
+		break;
+	}
+	if (j) {
+	    if (last)
+		last->next = j->next;
+	    else
+		v->head = j->next;
+	    if (v->tail == j)
+		v->tail = last;
+	}
+	pthread_mutex_unlock(&v->q_m);
+
+	if (j)
+	    return j;
+    }
+
+    return NULL;
+}
+
+/*
+ * Finds a job for worker w; first from its own queue and then by stealing
+ * from the others, starting from its neighbour.  Jobs blocking a waiting
+ * consumer take priority over both.
+ */
+static t_pool_job *t_pool_next_job(t_pool *p, t_pool_worker_t *w) {
+    t_pool_job *j;
+    int i;
+
+    if (t_pool_atomic_get(&p->nurgent) && (j = t_pool_pop_urgent(p, w)))
+	return j;
+
+    if ((j = t_pool_pop(w, 0)))
+	return j;
+
+    for (i = 1; i < p->tsize; i++)
+	if ((j = t_pool_pop(&p->t[(w->idx + i) % p->tsize], 1)))
+	    return j;
+
+    return NULL;
+}
+
 /*
  * A worker thread.
  *
- * Each thread waits for the pool to be non-empty.
- * As soon as this applies, one of them succeeds in getting the lock
- * and then executes the job.
+ * Each thread repeatedly takes jobs from its own queue, or steals them
+ * from other workers when empty.  Only when no jobs exist anywhere does
+ * it take the pool lock and wait to be woken by t_pool_dispatch.
  */
 static void *t_pool_worker(void *arg) {
     t_pool_worker_t *w = (t_pool_worker_t *)arg;
@@ -341,72 +560,34 @@ static void *t_pool_worker(void *arg) {
 #endif
 
     for (;;) {
-	// Pop an item off the pool queue
 #ifdef DEBUG_TIME
 	gettimeofday(&t1, NULL);
 #endif
-
-	pthread_mutex_lock(&p->pool_m);
-
-#ifdef DEBUG_TIME
-	gettimeofday(&t2, NULL);
-	p->wait_time += TDIFF(t2,t1);
-	w->wait_time += TDIFF(t2,t1);
-#endif
-
-	// If there is something on the job list and a higher priority
-	// thread waiting, let it handle this instead.
-//	while (p->head && p->t_stack_top != -1 && p->t_stack_top < w->idx) {
-//	    pthread_mutex_unlock(&p->pool_m);
-//	    pthread_cond_signal(&p->t[p->t_stack_top].pending_c);
-//	    pthread_mutex_lock(&p->pool_m);
-//	}
-
-	while (!p->head && !p->shutdown) {
-	    p->nwaiting++;
-
-	    if (p->njobs == 0)
-		pthread_cond_signal(&p->empty_c);
-#ifdef DEBUG_TIME
-	    gettimeofday(&t2, NULL);
-#endif
-
-#ifdef IN_ORDER
-	    // Push this thread to the top of the waiting stack
-	    if (p->t_stack_top == -1 || p->t_stack_top > w->idx)
-		p->t_stack_top = w->idx;
-
-	    p->t_stack[w->idx] = 1;
-	    pthread_cond_wait(&w->pending_c, &p->pool_m);
-	    p->t_stack[w->idx] = 0;
-
-	    /* Find new t_stack_top */
-	    {
-		int i;
-		p->t_stack_top = -1;
-		for (i = 0; i < p->tsize; i++) {
-		    if (p->t_stack[i]) {
-			p->t_stack_top = i;
-			break;
-		    }
-		}
+	if ((j = t_pool_next_job(p, w))) {
+	    // Room in the queue again, so unblock a dispatcher.
+	    if (t_pool_atomic_add(&p->njobs, -1) == p->qsize-1) {
+		pthread_mutex_lock(&p->pool_m);
+		pthread_cond_signal(&p->full_c);
+		pthread_mutex_unlock(&p->pool_m);
 	    }
-#else
-	    pthread_cond_wait(&p->pending_c, &p->pool_m);
-#endif
 
+	    // We have job 'j' - now execute it.
+	    t_pool_add_result(j, j->func(j->arg));	
 #ifdef DEBUG_TIME
+	    pthread_mutex_lock(&p->pool_m);
 	    gettimeofday(&t3, NULL);
-	    p->wait_time += TDIFF(t3,t2);
-	    w->wait_time += TDIFF(t3,t2);
+	    p->total_time += TDIFF(t3,t1);
+	    pthread_mutex_unlock(&p->pool_m);
 #endif
-	    p->nwaiting--;
+	    memset(j, 0xbb, sizeof(*j));
+	    free(j);
+	    continue;
 	}
 
+	// Nothing to do, so wait for more jobs.
+	pthread_mutex_lock(&p->pool_m);
+
 	if (p->shutdown) {
-#ifdef DEBUG_TIME
-	    p->total_time += TDIFF(t3,t1);
-#endif
 #ifdef DEBUG
 	    fprintf(stderr, "%d: Shutting down\n", worker_id(p));
 #endif
@@ -414,28 +595,52 @@ static void *t_pool_worker(void *arg) {
 	    pthread_exit(NULL);
 	}
 
-	j = p->head;
-	if (!(p->head = j->next))
-	    p->tail = NULL;
+	// Announce we're waiting before the final check for jobs.
+	// A dispatcher adds to njobs before checking nwaiting, so
+	// between us one will notice the other.
+	t_pool_atomic_add(&p->nwaiting, 1);
+	if (t_pool_atomic_get(&p->njobs) > 0) {
+	    t_pool_atomic_add(&p->nwaiting, -1);
+	    pthread_mutex_unlock(&p->pool_m);
+	    continue;
+	}
 
-	if (p->njobs-- >= p->qsize)
-	    pthread_cond_signal(&p->full_c);
+	pthread_cond_signal(&p->empty_c);
+#ifdef DEBUG_TIME
+	gettimeofday(&t2, NULL);
+#endif
 
-	if (p->njobs == 0)
-	    pthread_cond_signal(&p->empty_c);
+#ifdef IN_ORDER
+	// Push this thread to the top of the waiting stack
+	if (p->t_stack_top == -1 || p->t_stack_top > w->idx)
+	    p->t_stack_top = w->idx;
+
+	p->t_stack[w->idx] = 1;
+	pthread_cond_wait(&w->pending_c, &p->pool_m);
+	p->t_stack[w->idx] = 0;
+
+	/* Find new t_stack_top */
+	{
+	    int i;
+	    p->t_stack_top = -1;
+	    for (i = 0; i < p->tsize; i++) {
+		if (p->t_stack[i]) {
+		    p->t_stack_top = i;
+		    break;
+		}
+	    }
+	}
+#else
+	pthread_cond_wait(&p->pending_c, &p->pool_m);
+#endif
 
-	pthread_mutex_unlock(&p->pool_m);
-	    
-	// We have job 'j' - now execute it.
-	t_pool_add_result(j, j->func(j->arg));	
 #ifdef DEBUG_TIME
-	pthread_mutex_lock(&p->pool_m);
 	gettimeofday(&t3, NULL);
-	p->total_time += TDIFF(t3,t1);
-	pthread_mutex_unlock(&p->pool_m);
+	p->wait_time += TDIFF(t3,t2);
+	w->wait_time += TDIFF(t3,t2);
 #endif
-	memset(j, 0xbb, sizeof(*j));
-	free(j);
+	t_pool_atomic_add(&p->nwaiting, -1);
+	pthread_mutex_unlock(&p->pool_m);
     }
 
     return NULL;
@@ -455,7 +660,9 @@ t_pool *t_pool_init(int qsize, int tsize) {
     p->njobs = 0;
     p->nwaiting = 0;
     p->shutdown = 0;
-    p->head = p->tail = NULL;
+    p->next_q = 0;
+    p->active_weight = 0;
+    p->nurgent = 0;
     p->t_stack = NULL;
 #ifdef DEBUG_TIME
     p->total_time = p->wait_time = 0;
@@ -467,6 +674,12 @@ t_pool *t_pool_init(int qsize, int tsize) {
     pthread_cond_init(&p->empty_c, NULL);
     pthread_cond_init(&p->full_c, NULL);
 
+    for (i = 0; i < tsize; i++) {
+	t_pool_worker_t *w = &p->t[i];
+	pthread_mutex_init(&w->q_m, NULL);
+	w->head = w->tail = NULL;
+    }
+
     pthread_mutex_lock(&p->pool_m);
 
 #ifdef IN_ORDER
@@ -523,57 +736,7 @@ t_pool *t_pool_init(int qsize, int tsize) {
  */
 int t_pool_dispatch(t_pool *p, t_results_queue *q,
 		    void *(*func)(void *arg), void *arg) {
-    t_pool_job *j = malloc(sizeof(*j));
-
-    if (!j)
-	return -1;
-    j->func = func;
-    j->arg = arg;
-    j->next = NULL;
-    j->p = p;
-    j->q = q;
-    if (q) {
-	pthread_mutex_lock(&q->result_m);
-	j->serial = q->curr_serial++;
-	q->pending++;
-	pthread_mutex_unlock(&q->result_m);
-    } else {
-	j->serial = 0;
-    }
-
-#ifdef DEBUG
-    fprintf(stderr, "Dispatching job %p for queue %p, serial %d\n", j, q, j->serial);
-#endif
-
-    pthread_mutex_lock(&p->pool_m);
-
-    // Check if queue is full
-    while (p->njobs >= p->qsize)
-	pthread_cond_wait(&p->full_c, &p->pool_m);
-
-    p->njobs++;
-
-    if (p->tail) {
-	p->tail->next = j;
-	p->tail = j;
-    } else {
-	p->head = p->tail = j;
-    }
-
-    // Let a worker know we have data.
-#ifdef IN_ORDER
-    if (p->t_stack_top >= 0 && p->njobs > p->tsize - p->nwaiting)
-	pthread_cond_signal(&p->t[p->t_stack_top].pending_c);
-#else
-    pthread_cond_signal(&p->pending_c);
-#endif
-    pthread_mutex_unlock(&p->pool_m);
-
-#ifdef DEBUG
-    fprintf(stderr, "Dispatched (serial %d)\n", j->serial);
-#endif
-
-    return 0;
+    return t_pool_dispatch2(p, q, func, arg, 0);
 }
 
 /*
@@ -586,19 +749,38 @@ int t_pool_dispatch(t_pool *p, t_results_queue *q,
 int t_pool_dispatch2(t_pool *p, t_results_queue *q,
 		     void *(*func)(void *arg), void *arg, int nonblock) {
     t_pool_job *j;
+    t_pool_worker_t *w;
+    int njobs;
 
 #ifdef DEBUG
     fprintf(stderr, "Dispatching job for queue %p, serial %d\n", q, q->curr_serial);
 #endif
 
-    pthread_mutex_lock(&p->pool_m);
-
-    if (p->njobs >= p->qsize && nonblock == 1) {
-	pthread_mutex_unlock(&p->pool_m);
+    if (nonblock == 1 && t_pool_atomic_get(&p->njobs) >= p->qsize) {
 	errno = EAGAIN;
 	return -1;
     }
 
+    // When other results queues are also active, restrict this one to
+    // its share of the pool so it cannot starve them.
+    if (nonblock == 1 && q && q->p == p) {
+	int pending = t_pool_atomic_get(&q->pending);
+	int aw = t_pool_atomic_get(&p->active_weight);
+	if (pending && aw > q->weight &&
+	    pending >= (int64_t)p->qsize * q->weight / aw) {
+	    errno = EAGAIN;
+	    return -1;
+	}
+    }
+
+    // Check if queue is full
+    if (nonblock == 0 && t_pool_atomic_get(&p->njobs) >= p->qsize) {
+	pthread_mutex_lock(&p->pool_m);
+	while (t_pool_atomic_get(&p->njobs) >= p->qsize)
+	    pthread_cond_wait(&p->full_c, &p->pool_m);
+	pthread_mutex_unlock(&p->pool_m);
+    }
+
     if (!(j = malloc(sizeof(*j))))
 	return -1;
     j->func = func;
@@ -607,54 +789,51 @@ int t_pool_dispatch2(t_pool *p, t_results_queue *q,
     j->p = p;
     j->q = q;
     if (q) {
-	pthread_mutex_lock(&q->result_m);
-	j->serial = q->curr_serial;
-	pthread_mutex_unlock(&q->result_m);
+	j->serial = t_pool_atomic_add(&q->curr_serial, 1) - 1;
+	if (t_pool_atomic_add(&q->pending, 1) == 1)
+	    t_pool_atomic_add(&p->active_weight, q->weight);
+	q->p = p;
     } else {
 	j->serial = 0;
     }
 
-    if (q) {
-	pthread_mutex_lock(&q->result_m);
-	q->curr_serial++;
-	q->pending++;
-	pthread_mutex_unlock(&q->result_m);
-    }
-
-    // Check if queue is full
-    if (nonblock == 0)
-	while (p->njobs >= p->qsize)
-	    pthread_cond_wait(&p->full_c, &p->pool_m);
-
-    p->njobs++;
-    
-//    if (q->curr_serial % 100 == 0)
-//	fprintf(stderr, "p->njobs = %d    p->qsize = %d\n", p->njobs, p->qsize);
+    // Counted before queuing, so a worker seeing njobs == 0 knows there
+    // is nothing to find.
+    njobs = t_pool_atomic_add(&p->njobs, 1);
 
-    if (p->tail) {
-	p->tail->next = j;
-	p->tail = j;
+    // Distribute jobs between the worker queues in turn.
+    w = &p->t[(unsigned)t_pool_atomic_add(&p->next_q, 1) % p->tsize];
+    pthread_mutex_lock(&w->q_m);
+    if (w->tail) {
+	w->tail->next = j;
+	w->tail = j;
     } else {
-	p->head = p->tail = j;
+	w->head = w->tail = j;
     }
+    pthread_mutex_unlock(&w->q_m);
 
 #ifdef DEBUG
     fprintf(stderr, "Dispatched (serial %d)\n", j->serial);
 #endif
 
-    // Let a worker know we have data.
+    // Let a worker know we have data.  Running workers will steal this
+    // job if needed, so we only need the pool lock if some are asleep.
+    if (t_pool_atomic_get(&p->nwaiting) == 0)
+	return 0;
+
+    pthread_mutex_lock(&p->pool_m);
 #ifdef IN_ORDER
     // Keep incoming queue at 1 per running thread, so there is always
     // something waiting when they end their current task.  If we go above
     // this signal to start more threads (if available). This has the effect
     // of concentrating jobs to fewer cores when we are I/O bound, which in
     // turn benefits systems with auto CPU frequency scaling.
-    if (p->t_stack_top >= 0 && p->njobs > p->tsize - p->nwaiting)
+    if (p->t_stack_top >= 0 &&
+	njobs > p->tsize - t_pool_atomic_get(&p->nwaiting))
 	pthread_cond_signal(&p->t[p->t_stack_top].pending_c);
 #else
     pthread_cond_signal(&p->pending_c);
 #endif
-
     pthread_mutex_unlock(&p->pool_m);
 
     return 0;
@@ -682,7 +861,8 @@ int t_pool_flush(t_pool *p) {
 	if (p->t_stack[i])
 	    pthread_cond_signal(&p->t[i].pending_c);
 
-    while (p->njobs || p->nwaiting != p->tsize)
+    while (t_pool_atomic_get(&p->njobs) ||
+	   t_pool_atomic_get(&p->nwaiting) != p->tsize)
 	pthread_cond_wait(&p->empty_c, &p->pool_m);
 
     pthread_mutex_unlock(&p->pool_m);
@@ -695,6 +875,144 @@ int t_pool_flush(t_pool *p) {
     return 0;
 }
 
+/*
+ * State shared between t_pool_run_all() and the helper jobs it dispatches.
+ */
+typedef struct {
+    int (*func)(void *arg, int i);
+    void *arg;
+    int n;
+
+    pthread_mutex_t lock;
+    pthread_cond_t done_c;
+    int next;     // next index to start
+    int nrunning; // calls started but not yet finished
+    int err;
+    int nref;     // the caller plus each dispatched helper
+} t_pool_run;
+
+/* Drops a reference to r, freeing it when the last one has gone */
+static void t_pool_run_release(t_pool_run *r) {
+    int nref;
+
+    pthread_mutex_lock(&r->lock);
+    nref = --r->nref;
+    pthread_mutex_unlock(&r->lock);
+
+    if (nref)
+	return;
+
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->done_c);
+    free(r);
+}
+
+/*
+ * Calls func for indices not yet started until none are left.  This
+ * may be running in several threads at once.
+ */
+static void t_pool_run_loop(t_pool_run *r) {
+    for (;;) {
+	int i, ret;
+
+	pthread_mutex_lock(&r->lock);
+	if (r->next >= r->n || r->err) {
+	    pthread_mutex_unlock(&r->lock);
+	    return;
+	}
+	i = r->next++;
+	r->nrunning++;
+	pthread_mutex_unlock(&r->lock);
+
+	ret = r->func(r->arg, i);
+
+	pthread_mutex_lock(&r->lock);
+	if (ret)
+	    r->err = 1;
+	if (--r->nrunning == 0)
+	    pthread_cond_signal(&r->done_c);
+	pthread_mutex_unlock(&r->lock);
+    }
+}
+
+/* A helper job dispatched by t_pool_run_all() */
+static void *t_pool_run_thread(void *arg) {
+    t_pool_run *r = (t_pool_run *)arg;
+
+    t_pool_run_loop(r);
+    t_pool_run_release(r);
+
+    return NULL;
+}
+
+/*
+ * Calls func(arg, i) for every i from 0 to n-1, in no particular order,
+ * and waits for them all to complete.
+ *
+ * The calling thread does this work itself, but if the pool 'p' has
+ * idle workers it also dispatches helper jobs to share the load.  We
+ * never wait on a helper that has not yet started, so this is safe to
+ * call from within a job running on the same pool; a late helper
+ * simply finds nothing left to do and returns.  p may be NULL, in
+ * which case the calls are simply made in order.
+ *
+ * Once any call has failed no further calls are started.
+ *
+ * Returns 0 if all calls returned 0;
+ *        -1 on failure
+ */
+int t_pool_run_all(t_pool *p, int n, int (*func)(void *arg, int i),
+		   void *arg) {
+    t_pool_run *r;
+    int i, nhelp = 0, err;
+
+    if (p && n > 1) {
+	nhelp = t_pool_idle(p);
+	if (nhelp > n-1)
+	    nhelp = n-1;
+    }
+
+    if (nhelp == 0) {
+	for (i = 0; i < n; i++)
+	    if (func(arg, i))
+		return -1;
+	return 0;
+    }
+
+    if (!(r = calloc(1, sizeof(*r))))
+	return -1;
+
+    r->func = func;
+    r->arg  = arg;
+    r->n    = n;
+    r->nref = 1;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->done_c, NULL);
+
+    for (i = 0; i < nhelp; i++) {
+	pthread_mutex_lock(&r->lock);
+	r->nref++;
+	pthread_mutex_unlock(&r->lock);
+
+	if (t_pool_dispatch2(p, NULL, t_pool_run_thread, r, 1)) {
+	    t_pool_run_release(r);
+	    break;
+	}
+    }
+
+    t_pool_run_loop(r);
+
+    pthread_mutex_lock(&r->lock);
+    while (r->nrunning)
+	pthread_cond_wait(&r->done_c, &r->lock);
+    err = r->err;
+    pthread_mutex_unlock(&r->lock);
+
+    t_pool_run_release(r);
+
+    return err ? -1 : 0;
+}
+
 /*
  * Destroys a thread pool. If 'kill' is true the threads are terminated now,
  * otherwise they are joined into the main thread so they will finish their
@@ -738,6 +1056,8 @@ void t_pool_destroy(t_pool *p, int kill) {
     }
 
     pthread_mutex_destroy(&p->pool_m);
+    for (i = 0; i < p->tsize; i++)
+	pthread_mutex_destroy(&p->t[i].q_m);
     pthread_cond_destroy(&p->empty_c);
     pthread_cond_destroy(&p->full_c);
 #ifdef IN_ORDER
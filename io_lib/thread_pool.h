@@ -44,6 +44,18 @@
  * Upon completion, the return value from the function pointer is added to
  * a results queue. We may have multiple queues in use for the one pool.
  *
+ * Each worker has its own queue of jobs to avoid all threads contending
+ * on a single lock. Jobs are distributed between these in turn and idle
+ * workers steal jobs from the other queues.
+ *
+ * Results are stored in a ring buffer indexed by their serial number.
+ * They are published and collected in order using atomic operations, so
+ * the consumer needs no lock unless it has to sleep.
+ *
+ * When multiple results queues share a pool, the number of jobs each may
+ * have queued is limited to a weighted share of the pool, and jobs for a
+ * queue whose consumer is blocked waiting on a result are run first.
+ *
  * An example: reading from BAM and writing to CRAM with 10 threads. We'll
  * have a pool of 10 threads and two results queues holding decoded BAM blocks
  * and encoded CRAM blocks respectively.
@@ -81,23 +93,31 @@ typedef struct {
     pthread_t tid;
     pthread_cond_t  pending_c;
     long long wait_time;
+
+    // queue of jobs for this worker, also stolen from by others
+    pthread_mutex_t q_m;
+    t_pool_job *head, *tail;
 } t_pool_worker_t;
 
 typedef struct t_pool {
     int qsize;    // size of queue
-    int njobs;    // pending job count
-    int nwaiting; // how many workers waiting for new jobs
+    int njobs;    // pending job count (atomic)
+    int nwaiting; // how many workers waiting for new jobs (atomic)
     int shutdown; // true if pool is being destroyed
 
-    // queue of pending jobs
-    t_pool_job *head, *tail;
+    // worker queue to add the next job to (atomic)
+    int next_q;
+
+    // Fair scheduling between results queues sharing this pool
+    int active_weight; // sum of weights for queues with pending jobs
+    int nurgent;       // number of results queues with a waiting consumer
 
     // threads
     int tsize;    // maximum number of jobs
     t_pool_worker_t *t;
 
     // Mutexes
-    pthread_mutex_t pool_m; // used when updating head/tail
+    pthread_mutex_t pool_m; // used when sleeping and waking workers
 
     pthread_cond_t  empty_c;
     pthread_cond_t  pending_c; // not empty
@@ -110,15 +130,27 @@ typedef struct t_pool {
     long long total_time, wait_time;
 } t_pool;
 
+/*
+ * Size of the ring buffer of results held by a results queue.
+ * Must be a power of 2.
+ */
+#define T_RESULTS_RING 1024
+
 typedef struct t_results_queue {
-    t_pool_result *result_head;
+    t_pool_result **ring; // results indexed by serial, atomically published
+    t_pool_result *result_head; // overflow list for results beyond the ring
     t_pool_result *result_tail;
+    int n_overflow; // number of items on the overflow list (atomic)
     int next_serial;
     int curr_serial;
-    int queue_len;  // number of items in queue
+    int queue_len;  // number of items in queue (atomic)
     int pending;    // number of pending items (in progress or in pool list)
-    pthread_mutex_t result_m;
+    pthread_mutex_t result_m; // used for overflow and sleeping consumers
     pthread_cond_t result_avail_c;
+
+    struct t_pool *p; // pool last dispatched to
+    int weight;     // relative share of the pool, default 1
+    int waiting;    // consumer blocked in t_pool_next_result_wait
 } t_results_queue;
 
 
@@ -196,6 +228,16 @@ t_results_queue *t_results_queue_init(void);
 /* Deallocates memory for a results queue */
 void t_results_queue_destroy(t_results_queue *q);
 
+/*
+ * Sets the relative weighting of a results queue when several share a
+ * pool.  Each queue with work outstanding may occupy a share of the
+ * pool input queue proportional to its weight when dispatching with
+ * nonblock set, so one busy queue cannot starve the others.
+ *
+ * This should be called before any jobs are dispatched to the queue.
+ */
+void t_results_queue_set_weight(t_results_queue *q, int weight);
+
 /*
  * Returns true if there are no items on the finished results queue and
  * also none still pending.
@@ -212,4 +254,21 @@ int t_pool_results_queue_len(t_results_queue *q);
  */
 int t_pool_results_queue_sz(t_results_queue *q);
 
+/*
+ * Returns the number of idle worker threads with no queued job waiting
+ * for them.  This is only a hint, as it may change at any moment.
+ */
+int t_pool_idle(t_pool *p);
+
+/*
+ * Calls func(arg, i) for i = 0 to n-1 and waits for all to complete,
+ * recruiting any idle workers in p to help.  Safe to call from within
+ * a job running on p.  p may be NULL.
+ *
+ * Returns 0 if all calls returned 0;
+ *        -1 on failure
+ */
+int t_pool_run_all(t_pool *p, int n, int (*func)(void *arg, int i),
+		   void *arg);
+
 #endif /* _THREAD_POOL_H_ */
@@ -86,6 +86,34 @@ int zfputs(char *line, zfp *zf) {
 	return gzputs(zf->gz, line) ? 0 : EOF;
 }
 
+/*
+ * A wrapper for either fread or gzread depending on what has been
+ * opened. Returns the number of items read, as per fread.
+ */
+size_t zfread(void *ptr, size_t size, size_t nmemb, zfp *zf) {
+    int n;
+
+    if (zf->fp)
+	return fread(ptr, size, nmemb, zf->fp);
+
+    n = gzread(zf->gz, ptr, size*nmemb);
+    return n > 0 ? n / size : 0;
+}
+
+/*
+ * A wrapper for either fwrite or gzwrite depending on what has been
+ * opened. Returns the number of items written, as per fwrite.
+ */
+size_t zfwrite(const void *ptr, size_t size, size_t nmemb, zfp *zf) {
+    int n;
+
+    if (zf->fp)
+	return fwrite(ptr, size, nmemb, zf->fp);
+
+    n = gzwrite(zf->gz, ptr, size*nmemb);
+    return n > 0 ? n / size : 0;
+}
+
 /*
  * Peeks at and returns the next character without consuming it from the
  * input. (Ie a combination of getc and ungetc).
@@ -125,6 +153,11 @@ zfp *zfopen(const char *path, const char *mode) {
     if (mode[0] != 'z' && mode[1] != 'z' &&
 	NULL != (zf->fp = fopen(path, mode))) {
 	unsigned char magic[2];
+
+	/* Nothing to detect when writing uncompressed data */
+	if (strchr(mode, 'w'))
+	    return zf;
+
 	if (2 != fread(magic, 1, 2, zf->fp)) {
 	    free(zf);
 	    return NULL;
@@ -49,6 +49,8 @@ off_t zftello(zfp *zf);
 int zfseeko(zfp *zf, off_t offset, int whence);
 char *zfgets(char *line, int size, zfp *zf);
 int zfputs(char *line, zfp *zf);
+size_t zfread(void *ptr, size_t size, size_t nmemb, zfp *zf);
+size_t zfwrite(const void *ptr, size_t size, size_t nmemb, zfp *zf);
 zfp *zfopen(const char *path, const char *mode);
 int zfclose(zfp *zf);
 int zfpeek(zfp *zf);
@@ -39,22 +39,114 @@
 #include "io_lib_config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <ctype.h>
 #include <string.h>
 #include <limits.h>
+#include <unistd.h>
+
+#if defined(__MINGW32__) || defined(__FreeBSD__) || defined(__APPLE__)
+#   include <getopt.h>
+#endif
 
 #include <io_lib/cram.h>
+#include <io_lib/bam.h>
 #include <io_lib/zfio.h>
 
+/*
+ * Indexes a BAM file, producing filename.bam.bai (or .csi if the
+ * index filename ends in .csi).
+ */
+static int index_bam(char *fn, char *fn_idx, int nthreads) {
+    bam_file_t *fd;
+    t_pool *p = NULL;
+    int r;
+
+    if (NULL == (fd = bam_open(fn, "rb"))) {
+	fprintf(stderr, "Error opening BAM file '%s'.\n", fn);
+	return 1;
+    }
+
+    if (nthreads > 1) {
+	if (!(p = t_pool_init(nthreads*2, nthreads)) ||
+	    bam_set_option(fd, BAM_OPT_THREAD_POOL, p) != 0) {
+	    fprintf(stderr, "Failed to create thread pool\n");
+	    bam_close(fd);
+	    if (p)
+		t_pool_destroy(p, 0);
+	    return 1;
+	}
+    }
+
+    r = bam_index_build(fd, fn_idx, 0);
+    bam_close(fd);
+
+    if (p)
+	t_pool_destroy(p, 0);
+
+    return r == 0 ? 0 : 1;
+}
+
+static void usage(FILE *fp) {
+    fprintf(fp, "Usage: cram_index [-b] [-t N] filename.cram [filename.cram.crai]\n");
+    fprintf(fp, "       cram_index -c filename.cram\n");
+    fprintf(fp, "       cram_index [-t N] filename.bam [filename.bam.bai]\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "    -t N  Use N threads for decoding\n");
+    fprintf(fp, "    -b    Also write a binary filename.cram.crai.bin index\n");
+    fprintf(fp, "    -c    Convert an existing .crai to .crai.bin only\n");
+}
+
 int main(int argc, char **argv) {
     cram_fd *fd;
+    FILE *fp;
+    char magic[4];
+    int c, binary = 0, convert = 0, nthreads = 1;
+
+    while ((c = getopt(argc, argv, "bcht:")) != -1) {
+	switch (c) {
+	case 'b':
+	    binary = 1;
+	    break;
+
+	case 'c':
+	    convert = 1;
+	    break;
+
+	case 't':
+	    nthreads = atoi(optarg);
+	    break;
+
+	case 'h':
+	    usage(stdout);
+	    return 0;
+
+	default:
+	    usage(stderr);
+	    return 1;
+	}
+    }
+
+    argc -= optind-1;
+    argv += optind-1;
 
     if (argc != 2 && argc != 3) {
-	fprintf(stderr, "Usage: cram_index filename.cram [filename.cram.crai]\n");
+	usage(stderr);
 	return 1;
     }
 
+    if (convert)
+	return cram_index_build_bin(argv[argc-1]) == 0 ? 0 : 1;
+
+    /* Anything not starting with the CRAM magic number is assumed BAM */
+    if ((fp = fopen(argv[1], "rb"))) {
+	int n = fread(magic, 1, 4, fp);
+	fclose(fp);
+	if (n == 4 && memcmp(magic, "CRAM", 4) != 0)
+	    return index_bam(argv[1], argv[argc-1], nthreads);
+    }
+
     if (NULL == (fd = cram_open(argv[1], "rb"))) {
 	fprintf(stderr, "Error opening CRAM file '%s'.\n", argv[1]);
 	return 1;
@@ -63,6 +155,13 @@ int main(int argc, char **argv) {
     cram_set_option(fd, CRAM_OPT_REQUIRED_FIELDS,
 		    SAM_RNAME | SAM_POS | SAM_CIGAR);
 
+    if (nthreads > 1 &&
+	cram_set_option(fd, CRAM_OPT_NTHREADS, nthreads) != 0) {
+	fprintf(stderr, "Failed to create thread pool\n");
+	cram_close(fd);
+	return 1;
+    }
+
     if (cram_index_build(fd, argv[argc-1]) == -1) {
 	cram_close(fd);
 	return 1;
@@ -70,5 +169,8 @@ int main(int argc, char **argv) {
 
     cram_close(fd);
 
+    if (binary && cram_index_build_bin(argv[argc-1]) != 0)
+	return 1;
+
     return 0;
 }
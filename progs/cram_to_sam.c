@@ -40,6 +40,7 @@
 #include "io_lib_config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
@@ -49,7 +50,7 @@
 
 void usage(FILE *fp) {
     fprintf(fp, "Usage: cram_to_sam [-r ref.fa] [-m] [-b] [-0..9] [-u] "
-	    "filename.cram [output_filename]\n\n");
+	    "[-t N] filename.cram [output_filename]\n\n");
     fprintf(fp, "Options:\n");
     fprintf(fp, "    -r ref.fa      Specifies the reference file.\n");
     fprintf(fp, "    -m             Generate MD and NM tags:\n");
@@ -59,6 +60,7 @@ void usage(FILE *fp) {
     fprintf(fp, "    -p str         Set the prefix for auto-generated seq. names\n");
     fprintf(fp, "    -R region	    Extract region 'ref:start-end', eg -R chr1:1000-2000\n");
     fprintf(fp, "    -X             Extract using the embedded reference (if present).\n");
+    fprintf(fp, "    -t N           Use N threads for decoding and encoding.\n");
 }
 
 int main(int argc, char **argv) {
@@ -72,8 +74,10 @@ int main(int argc, char **argv) {
     int start, end;
     char ref_name[1024] = {0}, *arg_list, *ref_fn = NULL;
     int embed_ref = 0;
+    int nthreads = 1;
+    t_pool *p = NULL;
 
-    while ((C = getopt(argc, argv, "bu0123456789mp:hr:R:X")) != -1) {
+    while ((C = getopt(argc, argv, "bu0123456789mp:hr:R:Xt:")) != -1) {
 	switch (C) {
 	case 'b':
 	    mode[1] = 'b';
@@ -108,6 +112,10 @@ int main(int argc, char **argv) {
 	    embed_ref = 1;
 	    break;
 
+	case 't':
+	    nthreads = atoi(optarg);
+	    break;
+
 	case 'R': {
 	    char *cp = strchr(optarg, ':');
 	    if (cp) {
@@ -172,6 +180,15 @@ int main(int argc, char **argv) {
     if (embed_ref)
 	cram_set_option(fd, CRAM_OPT_EMBED_REF, embed_ref);
 
+    if (nthreads > 1) {
+	if (NULL == (p = t_pool_init(nthreads*2, nthreads)) ||
+	    cram_set_option(fd, CRAM_OPT_THREAD_POOL, p) ||
+	    bam_set_option(bfd, BAM_OPT_THREAD_POOL, p)) {
+	    fprintf(stderr, "Failed to create thread pool\n");
+	    return 1;
+	}
+    }
+
     /* Find and load reference */
     cram_load_reference(fd, ref_fn);
     if (!fd->refs && !embed_ref) {
@@ -220,6 +237,9 @@ int main(int argc, char **argv) {
     bfd->header = NULL;
     bam_close(bfd);
 
+    if (p)
+	t_pool_destroy(p, 0);
+
     free(bam);
 
     return 0;
@@ -44,6 +44,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
 
 #if defined(__MINGW32__) || defined(__FreeBSD__) || defined(__APPLE__)
 #   include <getopt.h>
@@ -102,9 +103,85 @@ typedef struct {
     int64_t n_diffchr[2], n_diffhigh[2];
 } bam_flagstat_t;
 
+static void flagstat_count(bam_flagstat_t *st, int flag, int ref,
+			   int mate_ref, int map_qual) {
+    int w = flag & BAM_FQCFAIL ? 1 : 0;
+    ++st->n_reads[w];
+
+    if (flag & BAM_FPAIRED) {
+	++st->n_pair_all[w];
+	if (flag & BAM_FPROPER_PAIR)
+	    ++st->n_pair_good[w];
+
+	if (flag & BAM_FREAD1)
+	    ++st->n_read1[w];
+
+	if (flag & BAM_FREAD2)
+	    ++st->n_read2[w];
+
+	if ((flag & BAM_FMUNMAP) && !(flag & BAM_FUNMAP))
+	    ++st->n_sgltn[w]; 
+
+	if (!(flag & BAM_FUNMAP) && !(flag & BAM_FMUNMAP)) {
+	    ++st->n_pair_map[w];
+
+	    if (mate_ref != ref) {
+		++st->n_diffchr[w];
+		if (map_qual >= 5)
+		    ++st->n_diffhigh[w];
+	    }
+	}
+    }
+
+    if (!(flag & BAM_FUNMAP))
+	++st->n_mapped[w];
+
+    if (flag & BAM_FDUP)
+	++st->n_dup[w];
+}
+
+/*
+ * Totals for the CRAM fast path.  Slices are counted independently,
+ * possibly in parallel, and summed into st under lock.
+ */
+typedef struct {
+    bam_flagstat_t st;
+    pthread_mutex_t lock;
+} flagstat_total_t;
+
+/*
+ * cram_foreach_slice() callback.  Counts the cram records directly, with
+ * no conversion to BAM, and adds them to the running totals.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int flagstat_slice(void *arg, cram_fd *fd, cram_slice *s) {
+    flagstat_total_t *tot = (flagstat_total_t *)arg;
+    bam_flagstat_t st;
+    int64_t *from = (int64_t *)&st, *to = (int64_t *)&tot->st;
+    int i;
+
+    memset(&st, 0, sizeof(st));
+    for (i = 0; i < s->hdr->num_records; i++) {
+	cram_record *cr = &s->crecs[i];
+	flagstat_count(&st, cr->flags, cr->ref_id, cr->mate_ref_id,
+		       cr->mqual);
+    }
+
+    // bam_flagstat_t is purely int64_t counters
+    pthread_mutex_lock(&tot->lock);
+    for (i = 0; i < sizeof(st)/sizeof(int64_t); i++)
+	to[i] += from[i];
+    pthread_mutex_unlock(&tot->lock);
+
+    return 0;
+}
+
 int main(int argc, char **argv) {
     scram_fd *in;
     bam_seq_t *s;
+    bam_view_t v;
     char imode[10], *in_f = "";
     int level = '\0'; // nul terminate string => auto level
     int c;
@@ -254,49 +331,28 @@ int main(int argc, char **argv) {
 	return ret;
     }
 
-    s = NULL;
-    while (scram_get_seq(in, &s) >= 0) {
-	int w = s->flag & BAM_FQCFAIL ? 1 : 0;
-	++st.n_reads[w];
-
-	if (s->flag & BAM_FPAIRED) {
-	    ++st.n_pair_all[w];
-	    if (s->flag & BAM_FPROPER_PAIR)
-		++st.n_pair_good[w];
-
-	    if (s->flag & BAM_FREAD1)
-		++st.n_read1[w];
-
-	    if (s->flag & BAM_FREAD2)
-		++st.n_read2[w];
-
-	    if ((s->flag & BAM_FMUNMAP) && !(s->flag & BAM_FUNMAP))
-		++st.n_sgltn[w]; 
+    if (!in->is_bam && *ref_name == 0) {
+	/*
+	 * CRAM: count the decoded cram records a slice at a time within
+	 * the decoding threads, skipping conversion to BAM entirely.
+	 */
+	flagstat_total_t tot;
 
-	    if (!(s->flag & BAM_FUNMAP) && !(s->flag & BAM_FMUNMAP)) {
-		++st.n_pair_map[w];
-
-		if (s->mate_ref != s->ref) {
-		    ++st.n_diffchr[w];
-		    if (s->map_qual >= 5)
-			++st.n_diffhigh[w];
-		}
-	    }
-	}
-
-	if (!(s->flag & BAM_FUNMAP))
-	    ++st.n_mapped[w];
+	memset(&tot.st, 0, sizeof(tot.st));
+	pthread_mutex_init(&tot.lock, NULL);
+	if (cram_foreach_slice(in->c, flagstat_slice, &tot) != 0)
+	    return 1;
+	pthread_mutex_destroy(&tot.lock);
+	st = tot.st;
+    } else {
+	/* Only a few fields are needed, so avoid copying each record */
+	while (scram_get_view(in, &v) >= 0)
+	    flagstat_count(&st, v.flag, v.ref, v.mate_ref, v.map_qual);
 
-	if (s->flag & BAM_FDUP)
-	    ++st.n_dup[w];
+	if (!scram_eof(in))
+	    return 1;
     }
 
-    if (s)
-	free(s);
-
-    if (!scram_eof(in))
-	return 1;
-
     if (scram_close(in))
 	return 1;
 
@@ -51,6 +51,7 @@
 
 #include <io_lib/scram.h>
 #include <io_lib/os.h>
+#include <io_lib/dstring.h>
 
 /*
  * Return 1 for compatible
@@ -101,6 +102,159 @@ static char *detect_format(char *fn) {
     return "";
 }
 
+/*
+ * Merges the @RG lines of 'in' into 'out'.
+ *
+ * Read groups not already present in 'out' are copied over verbatim, as are
+ * ones with an identical line. An ID clashing with a different read group
+ * is renamed to ID-N (N being the input file number, plus further suffixes
+ * if needed). In this case *map is set to an array, indexed by the read
+ * group number in 'in', holding the new names (or NULL where unchanged).
+ * Otherwise *map is left as NULL.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int hdr_merge_rg(SAM_hdr *out, SAM_hdr *in, int num, char ***map) {
+    int i, nrg = in->nrg;
+    dstring_t *ds = NULL;
+
+    *map = NULL;
+    for (i = 0; i < nrg; i++) {
+	char *name = in->rg[i].name, *l1, *l2, *new_name = NULL;
+	SAM_hdr_tag *tag;
+	int same, n;
+
+	if (sam_hdr_find_rg(out, name)) {
+	    l1 = sam_hdr_find_line(in,  "RG", "ID", name);
+	    l2 = sam_hdr_find_line(out, "RG", "ID", name);
+	    same = l1 && l2 && strcmp(l1, l2) == 0;
+	    free(l1);
+	    free(l2);
+	    if (same)
+		continue;
+
+	    /* Clash; pick a new unique name */
+	    if (!(new_name = malloc(strlen(name) + 30)))
+		goto err;
+	    sprintf(new_name, "%s-%d", name, num);
+	    for (n = 1; sam_hdr_find_rg(out, new_name); n++)
+		sprintf(new_name, "%s-%d.%d", name, num, n);
+
+	    if (!*map && !(*map = calloc(nrg, sizeof(**map)))) {
+		free(new_name);
+		goto err;
+	    }
+	    (*map)[i] = new_name;
+	}
+
+	/* Copy the line, substituting the ID if renamed */
+	if (!(ds = dstring_create("@RG")))
+	    goto err;
+	for (tag = in->rg[i].ty->tag; tag; tag = tag->next) {
+	    if (new_name && tag->len >= 3 && strncmp(tag->str, "ID:", 3) == 0) {
+		if (dstring_appendf(ds, "\tID:%s", new_name) < 0)
+		    goto err;
+	    } else {
+		if (dstring_append(ds, "\t") < 0 ||
+		    dstring_nappend(ds, tag->str, tag->len) < 0)
+		    goto err;
+	    }
+	}
+	if (dstring_append(ds, "\n") < 0)
+	    goto err;
+	if (sam_hdr_add_lines(out, DSTRING_STR(ds), DSTRING_LEN(ds)) < 0)
+	    goto err;
+	dstring_destroy(ds);
+	ds = NULL;
+    }
+
+    return 0;
+
+ err:
+    if (ds)
+	dstring_destroy(ds);
+    return -1;
+}
+
+/*
+ * Replaces the RG:Z value of a sequence, given a pointer 'aux' to the
+ * type code returned by bam_aux_find().
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int seq_replace_rg(bam_seq_t **bp, char *aux, const char *rg) {
+    bam_seq_t *b = *bp;
+    size_t old_len = strlen(aux+1), new_len = strlen(rg);
+    size_t off  = aux+1 - (char *)b;
+    size_t used = (char *)&b->ref + b->blk_size - (char *)b;
+    char *str;
+
+    /* +1 for the nul that bam_aux_iter expects after the last tag */
+    if (b->alloc < used + new_len - old_len + 1) {
+	size_t required = used + new_len - old_len + 1;
+	if (!(b = realloc(b, required)))
+	    return -1;
+	b->alloc = required;
+	*bp = b;
+    }
+
+    /* Move any tags following the RG value, then overwrite it */
+    str = (char *)b + off;
+    memmove(str + new_len + 1, str + old_len + 1, used - off - old_len - 1);
+    memcpy(str, rg, new_len + 1);
+    b->blk_size += new_len - old_len;
+    ((char *)b)[used + new_len - old_len] = 0;
+
+    return 0;
+}
+
+/*
+ * The merge order: by reference (unmapped last), position, strand and
+ * then READ1 before READ2. Ties go to the earlier input file, so the
+ * output is stable.
+ *
+ * Returns <0, 0 or >0 for a before b, equal, or a after b.
+ */
+static inline int seq_cmp(bam_seq_t *a, int ia, bam_seq_t *b, int ib) {
+    uint32_t ra = bam_ref(a), rb = bam_ref(b);
+    int fa, fb;
+
+    if (ra != rb)
+	return ra < rb ? -1 : 1;
+    if (bam_pos(a) != bam_pos(b))
+	return bam_pos(a) < bam_pos(b) ? -1 : 1;
+
+    fa = (bam_strand(a)<<1) | !(bam_flag(a) & BAM_FREAD1);
+    fb = (bam_strand(b)<<1) | !(bam_flag(b) & BAM_FREAD1);
+    if (fa != fb)
+	return fa - fb;
+
+    return ia - ib;
+}
+
+/*
+ * Restores the min-heap property of heap[0..n-1] for the entry at 'i'.
+ * The heap holds input file numbers, ordered by their current sequence.
+ */
+static void heap_down(int *heap, int n, int i, bam_seq_t **s) {
+    int x = heap[i];
+
+    for (;;) {
+	int c = 2*i+1;
+	if (c >= n)
+	    break;
+	if (c+1 < n && seq_cmp(s[heap[c+1]], heap[c+1], s[heap[c]], heap[c]) < 0)
+	    c++;
+	if (seq_cmp(s[heap[c]], heap[c], s[x], x) >= 0)
+	    break;
+	heap[i] = heap[c];
+	i = c;
+    }
+    heap[i] = x;
+}
+
 static void usage(FILE *fp) {
     fprintf(fp, "  -=- scram_merge -=-     version %s\n", PACKAGE_VERSION);
     fprintf(fp, "Author: James Bonfield, Wellcome Trust Sanger Institute. 2013\n\n");
@@ -121,6 +275,8 @@ static void usage(FILE *fp) {
 	    SLICE_PER_CNT);
     fprintf(fp, "    -V version     [Cram] Specify the file format version to write (eg 1.1, 2.0)\n");
     fprintf(fp, "    -X             [Cram] Embed reference sequence.\n");
+    fprintf(fp, "    -t N           Use N threads, shared by all input and output files.\n");
+    fprintf(fp, "    -A MB          Read up to MB megabytes of each input in the background\n");
 }
 
 int main(int argc, char **argv) {
@@ -136,9 +292,16 @@ int main(int argc, char **argv) {
     char ref_name[1024] = {0};
     refs_t *refs = NULL;
     int max_reads = -1;
+    int nthreads = 1;
+    t_pool *p = NULL;
+    int read_ahead = 0;
+    int *heap, nheap = 0;
+    char ***rg_map;
+    int *rg_nmap;
+    SAM_hdr *hdr;
 
     /* Parse command line arguments */
-    while ((c = getopt(argc, argv, "u0123456789hvs:S:V:r:XI:O:R:N:")) != -1) {
+    while ((c = getopt(argc, argv, "u0123456789hvs:S:V:r:XI:O:R:N:t:A:")) != -1) {
 	switch (c) {
 	case '0': case '1': case '2': case '3': case '4':
 	case '5': case '6': case '7': case '8': case '9':
@@ -207,6 +370,18 @@ int main(int argc, char **argv) {
 	    break;
 	}
 
+	case 't':
+	    nthreads = atoi(optarg);
+	    if (nthreads < 1 || nthreads > 512) {
+		fprintf(stderr, "Number of threads needs to be >= 1 and <= 512\n");
+		return 1;
+	    }
+	    break;
+
+	case 'A':
+	    read_ahead = atoi(optarg);
+	    break;
+
 	case 'N': // For debugging
 	    max_reads = atoi(optarg);
 	    break;
@@ -225,6 +400,19 @@ int main(int argc, char **argv) {
 	return 1;
     }
 
+    /*
+     * A single pool is shared by all files. Each input has its own
+     * results queue, which the pool schedules fairly so the merge is not
+     * held up waiting on the slowest file.
+     */
+    if (nthreads > 1) {
+	if (NULL == (p = t_pool_init(nthreads*2, nthreads)))
+	    return 1;
+
+	if (scram_set_option(out, CRAM_OPT_THREAD_POOL, p))
+	    return 1;
+    }
+
     /* Open multiple input files */
     sprintf(imode, "r%s%c", in_f, level);
     n_input = argc - optind;
@@ -236,6 +424,12 @@ int main(int argc, char **argv) {
 	return 1;
     if (!(s = malloc(n_input * sizeof(*s))))
 	return 1;
+    if (!(heap = malloc(n_input * sizeof(*heap))))
+	return 1;
+    if (!(rg_map = calloc(n_input, sizeof(*rg_map))))
+	return 1;
+    if (!(rg_nmap = calloc(n_input, sizeof(*rg_nmap))))
+	return 1;
     for (i = 0; i < n_input; i++, optind++) {
 	s[i] = NULL;
 	if (*in_f == 0)
@@ -252,6 +446,13 @@ int main(int argc, char **argv) {
 	    return 1;
 	}
 
+	if (p && scram_set_option(in[i], CRAM_OPT_THREAD_POOL, p))
+	    return 1;
+
+	if (read_ahead > 0 &&
+	    scram_set_option(in[i], CRAM_OPT_READ_AHEAD, read_ahead))
+	    return 1;
+
 	if (!refs && scram_get_refs(in[i]))
 	    refs = scram_get_refs(in[i]);
 
@@ -307,7 +508,16 @@ int main(int argc, char **argv) {
     /* Copy header and refs from in to out, for writing purposes */
     // FIXME: do proper merging of @PG lines
     // FIXME: track mapping of old PG aux name to new PG aux name per seq
-    scram_set_header(out, sam_hdr_dup(scram_get_header(in[0])));
+    if (!(hdr = sam_hdr_dup(scram_get_header(in[0]))))
+	return 1;
+    for (i = 1; i < n_input; i++) {
+	if (hdr_merge_rg(hdr, scram_get_header(in[i]), i, &rg_map[i])) {
+	    fprintf(stderr, "Failed to merge @RG header lines\n");
+	    return 1;
+	}
+	rg_nmap[i] = scram_get_header(in[i])->nrg;
+    }
+    scram_set_header(out, hdr);
 
     // Needs doing after loading the header.
     if (ref_fn)
@@ -328,44 +538,47 @@ int main(int argc, char **argv) {
 		return 1;
 	    in[i] = NULL;
 	    free(s[i]);
+	    s[i] = NULL;
 	    continue;
 	}
+	heap[nheap++] = i;
     }
 
+    /*
+     * The next sequence to output is always at the top of a heap of
+     * inputs, so each record costs O(log n_input) comparisons.
+     */
+    for (i = nheap/2-1; i >= 0; i--)
+	heap_down(heap, nheap, i, s);
+
     fprintf(stderr, "Merging...\n");
-    for (;;) {
-	int64_t best_val = INT64_MAX;
-	int best_j = 0, j;
+    while (nheap) {
+	int j = heap[0];
 
-	for (j = 0; j < n_input; j++) {
-	    bam_seq_t *b = s[j];
-	    uint64_t x;
-	    if (!in[j])
-		continue;
+	if (rg_map[j]) {
+	    char *aux = bam_aux_find(s[j], "RG");
+	    SAM_hdr *h = scram_get_header(in[j]);
+	    SAM_RG *rg;
 
-	    x = (((uint64_t)bam_ref(b))<<33)
-		| (bam_pos(b)<<2)
-		| (bam_strand(b)<<1)
-		| !(bam_flag(b) & BAM_FREAD1);
-	    if (best_val > x) {
-		best_val = x;
-		best_j = j;
+	    if (aux && *aux == 'Z' && (rg = sam_hdr_find_rg(h, aux+1)) &&
+		rg_map[j][rg - h->rg]) {
+		if (seq_replace_rg(&s[j], aux, rg_map[j][rg - h->rg]))
+		    return 1;
 	    }
 	}
-	
-	if (best_val == INT64_MAX) { // all closed
-	    break;
-	}
 
-	if (-1 == scram_put_seq(out, s[best_j]))
+	if (-1 == scram_put_seq(out, s[j]))
 	    return 1;
-	
-	if (scram_get_seq(in[best_j], &s[best_j]) < 0) {
-	    if (scram_close(in[best_j]))
+
+	if (scram_get_seq(in[j], &s[j]) < 0) {
+	    if (scram_close(in[j]))
 		return 1;
-	    in[best_j] = NULL;
-	    free(s[best_j]);
+	    in[j] = NULL;
+	    free(s[j]);
+	    s[j] = NULL;
+	    heap[0] = heap[--nheap];
 	}
+	heap_down(heap, nheap, 0, s);
 
 	if (max_reads >= 0)
 	    if (--max_reads == 0)
@@ -373,6 +586,12 @@ int main(int argc, char **argv) {
     }
 
     for (i = 0; i < n_input; i++) {
+	if (rg_map[i]) {
+	    int k;
+	    for (k = 0; k < rg_nmap[i]; k++)
+		free(rg_map[i][k]);
+	    free(rg_map[i]);
+	}
 	if (!in[i])
 	    continue;
 	scram_close(in[i]);
@@ -383,8 +602,13 @@ int main(int argc, char **argv) {
     /* Finally tidy up and close files */
     if (scram_close(out))
 	return 1;
+    if (p)
+	t_pool_destroy(p, 0);
     free(in);
     free(s);
+    free(heap);
+    free(rg_map);
+    free(rg_nmap);
 
     return 0;
 }
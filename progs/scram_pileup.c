@@ -53,6 +53,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
 #include "scram_pileup.h"
 
 /*
@@ -113,14 +115,16 @@ static void init_tab(void) {
  * with pos/nth lower than the previous query, although higher is better.
  * (This allows it to be initialised at base 0.)
  *
- * Stores the result in base and also updates is_insert to indicate that
- * this sequence still has more bases in this position beyond the current
- * nth parameter.
+ * Stores the result in *base and *qual and also updates is_insert to
+ * indicate that this sequence still has more bases in this position beyond
+ * the current nth parameter. The previous *qual for this sequence is used
+ * when averaging qualities across deletions and pads.
  *
  * Returns 1 if a base was fetched
  *         0 if not (eg ran off the end of sequence)
  */
-static int get_next_base(pileup_t *p, int pos, int nth, int *is_insert) {
+static int get_next_base(pileup_t *p, int pos, int nth, int *is_insert,
+			 char *base, unsigned char *qual) {
     bam_seq_t *b = p->b;
     enum cigar_op op = p->cigar_op;
 
@@ -223,36 +227,36 @@ static int get_next_base(pileup_t *p, int pos, int nth, int *is_insert) {
     /* Fill out base & qual fields */
     p->ref_skip = 0;
     if (p->nth < nth && op != BAM_CINS) {
-	//p->base = '-';
-	p->base = '*';
+	//*base = '-';
+	*base = '*';
 	p->padding = 1;
 	if (p->seq_offset < b->len)
-	    p->qual = (p->qual + p->b_qual[p->seq_offset+1])/2;
+	    *qual = (*qual + p->b_qual[p->seq_offset+1])/2;
 	else
-	    p->qual = 0;
+	    *qual = 0;
     } else {
 	p->padding = 0;
 	switch(op) {
 	case BAM_CDEL:
-	    p->base = '*';
+	    *base = '*';
 	    if (p->seq_offset+1 < b->len)
-		p->qual = (p->qual + p->b_qual[p->seq_offset+1])/2;
+		*qual = (*qual + p->b_qual[p->seq_offset+1])/2;
 	    else
-		p->qual = (p->qual + p->b_qual[p->seq_offset])/2;
+		*qual = (*qual + p->b_qual[p->seq_offset])/2;
 	    break;
 
 	case BAM_CPAD:
-	    //p->base = '+';
-	    p->base = '*';
+	    //*base = '+';
+	    *base = '*';
 	    if (p->seq_offset+1 < b->len)
-		p->qual = (p->qual + p->b_qual[p->seq_offset+1])/2;
+		*qual = (*qual + p->b_qual[p->seq_offset+1])/2;
 	    else
-		p->qual = (p->qual + p->b_qual[p->seq_offset])/2;
+		*qual = (*qual + p->b_qual[p->seq_offset])/2;
 	    break;
 
 	case BAM_CREF_SKIP:
-	    p->base = '.';
-	    p->qual = 0;
+	    *base = '.';
+	    *qual = 0;
 	    /* end of fragment, but not sequence */
 	    p->eof = p->eof ? 2 : 3;
 	    p->ref_skip = 1;
@@ -260,7 +264,7 @@ static int get_next_base(pileup_t *p, int pos, int nth, int *is_insert) {
 
 	default:
 	    if (p->seq_offset < b->len) {
-		p->qual = p->b_qual[p->seq_offset];
+		*qual = p->b_qual[p->seq_offset];
 	    /*
 	     * If you need to label inserted bases as different from
 	     * (mis)matching bases then this is where we'd make that change.
@@ -269,13 +273,13 @@ static int get_next_base(pileup_t *p, int pos, int nth, int *is_insert) {
 	     *
 	     * Eg:
 	     * if (nth)
-	     *     p->base = tolower(tab[p->b_seq[p->seq_offset/2]][p->seq_offset&1]);
+	     *     *base = tolower(tab[p->b_seq[p->seq_offset/2]][p->seq_offset&1]);
 	     * else
 	     */
-		p->base = tab[p->b_seq[p->seq_offset/2]][p->seq_offset&1];
+		*base = tab[p->b_seq[p->seq_offset/2]][p->seq_offset&1];
 	    } else {
-		p->base = 'N';
-		p->qual = 0xff;
+		*base = 'N';
+		*qual = 0xff;
 	    }
 		
 	    break;
@@ -283,7 +287,7 @@ static int get_next_base(pileup_t *p, int pos, int nth, int *is_insert) {
     }
 
     /* Handle moving out of N (skip) into sequence again */
-    if (p->eof && p->base != '.') {
+    if (p->eof && *base != '.') {
 	p->start = 1;
 	p->ref_skip = 1;
 	p->eof = 0;
@@ -332,62 +336,144 @@ static int get_next_base(pileup_t *p, int pos, int nth, int *is_insert) {
 }
 
 /*
- * Loops through a set of supplied ranges producing columns of data.
- * When found, it calls func with clientdata as a callback. Func should
- * return 0 for success and non-zero for failure. seq_init() is called
- * on each new entry before we start processing it. It should return 0 or 1
- * to indicate reject or accept status (eg to filter unmapped data).
- * If seq_init() returns -1 we abort the pileup_loop with an error.
- * seq_init may be NULL.
+ * The state of the active sequences is held as a set of arrays indexed by
+ * position in the active list, in the order they were added. The column
+ * arrays (base, qual, strand and flags) are written to directly by
+ * get_next_base() and are exactly what is passed to col_add(). The rest of
+ * the per sequence state is in pileup_t, which are allocated from blocks
+ * and recycled via a free list so a pileup_t never moves while its
+ * sequence is active. Finished bam records are kept on a free stack too,
+ * so once the deepest column has been seen there is no further
+ * allocation.
+ */
+#define PILEUP_BLOCK 256
+
+typedef struct {
+    pileup_t **act;       // active sequences, act[0..nact-1]
+    int nact, aact;
+    pileup_t *pfree;      // unused pileup_t, linked via ->next
+    pileup_t **blocks;    // allocated blocks of PILEUP_BLOCK pileup_t
+    int nblocks;
+    bam_seq_t **bfree;    // stack of unused bam records
+    int nbfree, abfree;
+    pileup_col_t col;     // base, qual, strand and flags, sized to aact
+} pileup_state_t;
+
+/*
+ * Returns an unused pileup_t with room for it in the active arrays,
+ *         or NULL on failure
+ */
+static pileup_t *pileup_alloc(pileup_state_t *st) {
+    pileup_t *p;
+
+    if (st->nact == st->aact) {
+	int n = st->aact ? st->aact*2 : PILEUP_BLOCK;
+	pileup_t **act;
+
+	if (!(act = realloc(st->act, n * sizeof(*act))))
+	    return NULL;
+	st->act = act;
+
+	if (!(st->col.base   = realloc(st->col.base,   n)) ||
+	    !(st->col.qual   = realloc(st->col.qual,   n)) ||
+	    !(st->col.strand = realloc(st->col.strand, n)) ||
+	    !(st->col.flags  = realloc(st->col.flags,  n)))
+	    return NULL;
+
+	st->aact = n;
+    }
+
+    if (!st->pfree) {
+	pileup_t **blocks;
+	int i;
+
+	if (!(blocks = realloc(st->blocks, (st->nblocks+1)*sizeof(*blocks))))
+	    return NULL;
+	st->blocks = blocks;
+	if (!(p = malloc(PILEUP_BLOCK * sizeof(*p))))
+	    return NULL;
+	st->blocks[st->nblocks++] = p;
+
+	for (i = 0; i < PILEUP_BLOCK; i++)
+	    p[i].next = i+1 < PILEUP_BLOCK ? &p[i+1] : NULL;
+	st->pfree = p;
+    }
+
+    p = st->pfree;
+    st->pfree = p->next;
+    return p;
+}
+
+static void pileup_state_free(pileup_state_t *st) {
+    int i;
+
+    for (i = 0; i < st->nact; i++)
+	free(st->act[i]->b);
+    for (i = 0; i < st->nbfree; i++)
+	free(st->bfree[i]);
+    for (i = 0; i < st->nblocks; i++)
+	free(st->blocks[i]);
+
+    free(st->act);
+    free(st->blocks);
+    free(st->bfree);
+    free(st->col.base);
+    free(st->col.qual);
+    free(st->col.strand);
+    free(st->col.flags);
+}
+
+/*
+ * As pileup_loop() below, but only makes callbacks for columns between
+ * start and end inclusive. Sequences outside of this are still processed,
+ * so a column has the same contents regardless of the range used.
+ *
+ * Exactly one of seq_add() and col_add() should be non-NULL.
  *
  * Returns 0 on success
  *        -1 on failure
  */
-int pileup_loop(scram_fd *fp,
-		int (*seq_init)(void *client_data,
-				scram_fd *fp,
-				pileup_t *p),
-		int (*seq_add)(void *client_data,
-			       scram_fd *fp,
-			       pileup_t *p,
-			       int depth,
-			       int pos,
-			       int nth,
-			       int is_insert),
-		void *client_data) {
+static int pileup_loop_range(scram_fd *fp, int start, int end,
+			     int (*seq_init)(void *client_data,
+					     scram_fd *fp,
+					     pileup_t *p),
+			     int (*seq_add)(void *client_data,
+					    scram_fd *fp,
+					    pileup_t *p,
+					    int depth,
+					    int pos,
+					    int nth,
+					    int is_insert),
+			     int (*col_add)(void *client_data,
+					    scram_fd *fp,
+					    pileup_col_t *c),
+			     void *client_data) {
     int ret = -1;
-    pileup_t *phead = NULL, *p, *pfree = NULL, *last, *next, *ptail = NULL;
-    pileup_t *pnew = NULL;
+    pileup_state_t st;
+    pileup_t *p;
+    bam_seq_t *bnew = NULL;
     int is_insert, nth = 0;
     int col = 0, r;
     int last_ref = -1;
 
-    /* FIXME: allow for start/stop boundaries rather than consuming all data */
-
     init_tab();
-    if (NULL == (pnew = calloc(1, sizeof(*p))))
-	return -1;
+    memset(&st, 0, sizeof(st));
     
     do {
 	bam_seq_t *b;
 	int pos, last_in_contig;
 
-	r = scram_next_seq(fp, &pnew->b);
+	r = scram_next_seq(fp, &bnew);
 	if (r == -1) {
 	    //fprintf(stderr, "bam_next_seq() failure on line %d\n", fp->line);
 	    if (!scram_eof(fp)) {
 		fprintf(stderr, "bam_next_seq() failure.\n");
-		return -1;
+		goto error;
 	    }
 	}
 
-	b = pnew->b;
-
-	/* Force realloc */
-	//fp->bs = NULL;
-	//fp->bs_size = 0;
+	b = bnew;
 
-	//r = samread(fp, pnew->b);
 	if (r >= 0) {
 	    if (bam_flag(b) & BAM_FUNMAP)
 		continue;
@@ -413,55 +499,89 @@ int pileup_loop(scram_fd *fp,
 	if (col > pos) {
 	    fprintf(stderr, "BAM/SAM file is not sorted by position. "
 		    "Aborting\n");
-	    return -1;
+	    goto error;
 	}
 
 	/* Process data between the last column and our latest addition */
-	while (col < pos && phead) {
-	    int v, ins, depth = 0;
+	while (col < pos && st.nact) {
+	    int i, j, v, ins, depth = st.nact;
+	    pileup_t **act = st.act;
+	    char *base = st.col.base;
+	    unsigned char *qual = st.col.qual;
 
 	    //printf("Col=%d pos=%d nth=%d\n", col, pos, nth);
 
 	    /* Pileup */
 	    is_insert = 0;
-	    for (p = phead; p; p = p->next) {
-		if (!get_next_base(p, col, nth, &ins))
+	    for (i = 0; i < depth; i++) {
+		p = act[i];
+		if (!get_next_base(p, col, nth, &ins, &base[i], &qual[i]))
 		    p->eof = 1;
 
 		if (is_insert < ins)
 		    is_insert = ins;
-		
-		depth++;
+
+		if (col_add) {
+		    st.col.flags[i]  = (p->start    ? PILEUP_START    : 0)
+			             | (p->eof      ? PILEUP_EOF      : 0)
+			             | (p->ref_skip ? PILEUP_REF_SKIP : 0)
+			             | (p->padding  ? PILEUP_PADDING  : 0);
+		} else {
+		    /* The pileup_t view used by seq_add() */
+		    p->base = base[i];
+		    p->qual = qual[i];
+		    p->next = i+1 < depth ? act[i+1] : NULL;
+		}
 	    }
 
-	    /* Call our function on phead linked list */
+	    /* Call our function on the active sequences */
 #ifdef START_WITH_DEL
-	    v = seq_add(client_data, fp, phead, depth, col-1, nth, is_insert);
+	    st.col.pos = col-1;
 #else
-	    v = seq_add(client_data, fp, phead, depth, col, nth, is_insert);
+	    st.col.pos = col;
 #endif
+	    if (st.col.pos < start || st.col.pos > end) {
+		v = 0;
+	    } else if (col_add) {
+		st.col.ref       = last_ref;
+		st.col.nth       = nth;
+		st.col.is_insert = is_insert;
+		st.col.depth     = depth;
+		st.col.p         = act;
+		v = col_add(client_data, fp, &st.col);
+	    } else {
+		v = seq_add(client_data, fp, act[0], depth, st.col.pos, nth,
+			    is_insert);
+	    }
 
-	    /* Remove dead seqs */
-	    for (p = phead, last = NULL; p; p = next) {
-		next = p->next;
-		
+	    /* Remove dead seqs, keeping the remainder in order */
+	    for (i = j = 0; i < depth; i++) {
+		p = act[i];
 		p->start = 0;
 		if (p->eof == 1) {
-		    if (last)
-			last->next = p->next;
-		    else
-			phead = p->next;
-
-		    p->next = pfree;
-		    pfree = p;
-		    
+		    if (st.nbfree == st.abfree) {
+			int n = st.abfree ? st.abfree*2 : 256;
+			bam_seq_t **bf = realloc(st.bfree, n * sizeof(*bf));
+			if (!bf)
+			    goto error;
+			st.bfree = bf;
+			st.abfree = n;
+		    }
+		    st.bfree[st.nbfree++] = p->b;
 		    //printf("Del seq %s at pos %d\n", bam_name(p->b), col);
+		    p->next = st.pfree;
+		    st.pfree = p;
 		} else {
-		    last = p;
+		    if (i != j) {
+			act[j] = p;
+			base[j] = base[i];
+			qual[j] = qual[i];
+			st.col.strand[j] = st.col.strand[i];
+		    }
+		    j++;
 		}
 	    }
-	    if ((ptail = last) == NULL)
-		ptail = phead;
+	    st.nact = j;
 
 	    if (v == 1)
 		break; /* early abort */
@@ -478,7 +598,7 @@ int pileup_loop(scram_fd *fp,
 	    }
 
 	    /* Special case for the last sequence in a contig */
-	    if (last_in_contig && phead)
+	    if (last_in_contig && st.nact)
 		pos++;
 	}
 
@@ -486,7 +606,7 @@ int pileup_loop(scram_fd *fp,
 	col = pos;
 
 	/* New contig */
-	if (b && b->ref != last_ref) {
+	if (r >= 0 && b->ref != last_ref) {
 	    last_ref = b->ref;
 	    pos = b->pos+1;
 	    nth = 0;
@@ -508,8 +628,11 @@ int pileup_loop(scram_fd *fp,
 	 * Ie it's a level 10 hack!
 	 */
 	if (r >= 0) {
-	    p = pnew;
-	    p->next       = NULL;
+	    if (!(p = pileup_alloc(&st)))
+		goto error;
+
+	    memset(p, 0, sizeof(*p));
+	    p->b          = bnew;
 	    p->cd         = NULL;
 	    p->start      = 1;
 	    p->eof        = 0;
@@ -559,55 +682,390 @@ int pileup_loop(scram_fd *fp,
 		int v;
 		v = seq_init(client_data, fp, p);
 		if (v == -1)
-		    return -1;
+		    goto error;
 		
-		if (v == 1) {
-		    /* Keep this seq */
-		    if (phead) {
-			ptail->next = p;
-		    } else {
-			phead = p;
-		    }
-		    ptail = p;
-		} else {
-		    /* Push back on free list */
-		    p->next = pfree;
-		    pfree = p;
+		if (v != 1) {
+		    /* Reject; reuse the slot and bam record for the next seq */
+		    p->next = st.pfree;
+		    st.pfree = p;
+		    continue;
 		}
-	    } else {
-		if (phead)
-		    ptail->next = p;
-		else
-		    phead = p;
-		ptail = p;
-	    }
-
-	    /* Allocate the next pileup rec */
-	    if (pfree) {
-		pnew = pfree;
-		pfree = pfree->next;
-	    } else {
-		if (NULL == (pnew = calloc(1, sizeof(*pnew))))
-		    goto error;
 	    }
+	    st.act[st.nact] = p;
+	    st.col.base[st.nact] = 0;
+	    st.col.qual[st.nact] = 0;
+	    st.col.strand[st.nact] = p->b_strand;
+	    st.nact++;
+
+	    /* Pick the next bam record */
+	    bnew = st.nbfree ? st.bfree[--st.nbfree] : NULL;
 	}
     } while (r >= 0);
 
     ret = 0;
  error:
 
-    if (pnew) {
-	free(pnew->b);
-	free(pnew);
+    free(bnew);
+    pileup_state_free(&st);
+
+    return ret;
+}
+
+/*
+ * Loops through a set of supplied ranges producing columns of data.
+ * When found, it calls func with clientdata as a callback. Func should
+ * return 0 for success and non-zero for failure. seq_init() is called
+ * on each new entry before we start processing it. It should return 0 or 1
+ * to indicate reject or accept status (eg to filter unmapped data).
+ * If seq_init() returns -1 we abort the pileup_loop with an error.
+ * seq_init may be NULL.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int pileup_loop(scram_fd *fp,
+		int (*seq_init)(void *client_data,
+				scram_fd *fp,
+				pileup_t *p),
+		int (*seq_add)(void *client_data,
+			       scram_fd *fp,
+			       pileup_t *p,
+			       int depth,
+			       int pos,
+			       int nth,
+			       int is_insert),
+		void *client_data) {
+    return pileup_loop_range(fp, INT_MIN, INT_MAX,
+			     seq_init, seq_add, NULL, client_data);
+}
+
+/*
+ * As pileup_loop(), but calls col_add() once per column with the bases,
+ * qualities, strands and PILEUP_* flags of the active sequences held in
+ * separate arrays of c->depth entries, rather than as a linked list.
+ * c->p[i] points to the pileup_t for entry i.
+ *
+ * The arrays are only valid for the duration of the callback, but each
+ * pileup_t is valid until the column in which its sequence ends (see
+ * scram_pileup.h). col_add() returns 0 for success, 1 to stop processing the
+ * current sequence's columns early (as per pileup_loop), or any other
+ * value for failure.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int pileup_loop_cols(scram_fd *fp,
+		     int (*seq_init)(void *client_data,
+				     scram_fd *fp,
+				     pileup_t *p),
+		     int (*col_add)(void *client_data,
+				    scram_fd *fp,
+				    pileup_col_t *c),
+		     void *client_data) {
+    return pileup_loop_range(fp, INT_MIN, INT_MAX,
+			     seq_init, NULL, col_add, client_data);
+}
+
+/* --------------------------------------------------------------------------
+ * Region partitioned pileup.
+ *
+ * Each reference is split into regions of region_len bases, and each
+ * region is processed by pileup_loop_range() on a single threaded scram_fd
+ * using the index. Sequences spanning region boundaries are returned by the
+ * range query of every region they overlap, but each column is only
+ * reported by the region containing it. Hence the regions are entirely
+ * independent and can be run in parallel.
+ *
+ * Opening the file and loading its index is too costly to repeat per
+ * region, so idle file handles are kept in a pileup_fds_t and reused with
+ * a new range. At most one handle per concurrently running job is opened.
+ */
+
+typedef struct {
+    const char *fn;
+    refs_t *refs;
+    pthread_mutex_t lock;
+    scram_fd **fp;              // idle handles
+    int nfp, afp;
+} pileup_fds_t;
+
+typedef struct {
+    pileup_fds_t *fds;
+    int refid, start, end;
+    int (*seq_init)(void *, scram_fd *, pileup_t *);
+    int (*seq_add)(void *, scram_fd *, pileup_t *, int, int, int, int);
+    void *client_data;
+    int exit_code;
+} pileup_job_t;
+
+/*
+ * Returns an idle file handle with its index loaded, opening a new one
+ * if needed.
+ *
+ * Returns scram_fd pointer on success
+ *         NULL on failure
+ */
+static scram_fd *pileup_fd_get(pileup_fds_t *fds) {
+    scram_fd *fp = NULL;
+
+    pthread_mutex_lock(&fds->lock);
+    if (fds->nfp)
+	fp = fds->fp[--fds->nfp];
+    pthread_mutex_unlock(&fds->lock);
+
+    if (fp)
+	return fp;
+
+    if (!(fp = scram_open(fds->fn, "r")))
+	return NULL;
+
+    if (fds->refs && scram_set_option(fp, CRAM_OPT_SHARED_REF, fds->refs))
+	goto err;
+
+    if (scram_index_load(fp, fds->fn) != 0) {
+	fprintf(stderr, "Failed to load index for %s\n", fds->fn);
+	goto err;
     }
 
-    /* Tidy up */
-    for (p = pfree; p; p = next) {
-	next = p->next;
-	free(p->b);
-	free(p);
+    return fp;
+
+ err:
+    scram_close(fp);
+    return NULL;
+}
+
+/*
+ * Returns a file handle to the idle list for use by a later region.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int pileup_fd_put(pileup_fds_t *fds, scram_fd *fp) {
+    pthread_mutex_lock(&fds->lock);
+    if (fds->nfp == fds->afp) {
+	int afp = fds->afp ? fds->afp*2 : 8;
+	scram_fd **new_fp = realloc(fds->fp, afp * sizeof(*new_fp));
+	if (!new_fp) {
+	    pthread_mutex_unlock(&fds->lock);
+	    return scram_close(fp) == 0 ? 0 : -1;
+	}
+	fds->fp = new_fp;
+	fds->afp = afp;
+    }
+    fds->fp[fds->nfp++] = fp;
+    pthread_mutex_unlock(&fds->lock);
+
+    return 0;
+}
+
+static void *pileup_job_thread(void *arg) {
+    pileup_job_t *j = (pileup_job_t *)arg;
+    scram_fd *fp;
+    cram_range r;
+
+    j->exit_code = -1;
+    if (!(fp = pileup_fd_get(j->fds)))
+	return j;
+
+    r.refid = j->refid;
+    r.start = j->start;
+    r.end   = j->end;
+
+    /*
+     * References with nothing aligned to them are absent from a CRAM
+     * index, which would make the range query fail, so treat them as
+     * empty regions.
+     */
+    if (!fp->is_bam && !cram_index_query(fp->c, r.refid, r.start, NULL)) {
+	j->exit_code = 0;
+	goto out;
+    }
+
+    if (scram_set_option(fp, CRAM_OPT_RANGE, &r))
+	goto err;
+
+    j->exit_code = pileup_loop_range(fp, j->start, j->end,
+				     j->seq_init, j->seq_add, NULL,
+				     j->client_data);
+    if (j->exit_code != 0)
+	goto err;
+
+ out:
+    if (pileup_fd_put(j->fds, fp) != 0)
+	j->exit_code = -1;
+    return j;
+
+ err:
+    /* The handle may be part way through a region, so don't reuse it */
+    scram_close(fp);
+    return j;
+}
+
+/*
+ * Passes completed jobs, in order, to region_done() and frees them,
+ * incrementing *ndone for each. If wait is true we block until at least
+ * one result is available.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int pileup_drain(t_results_queue *q, int wait,
+			int (*region_done)(void *arg, void *client_data,
+					   int status),
+			void *arg, int *ndone) {
+    t_pool_result *res;
+    int r = 0;
+
+    while ((res = wait ? t_pool_next_result_wait(q) : t_pool_next_result(q))) {
+	pileup_job_t *j = (pileup_job_t *)res->data;
+	if (j->exit_code != 0)
+	    r = -1;
+	if (region_done(arg, j->client_data, j->exit_code) != 0)
+	    r = -1;
+	free(j);
+	t_pool_delete_result(res, 0);
+	(*ndone)++;
+	wait = 0;
+    }
+
+    return r;
+}
+
+/*
+ * A region partitioned version of pileup_loop(), for indexed BAM and
+ * CRAM files.
+ *
+ * The file fn is split into regions of region_len bases. For each region
+ * region_init() is called to create the client_data passed to seq_init()
+ * and seq_add() while processing that region. If pool is non-NULL the
+ * regions are processed in parallel, so these callbacks must not share
+ * state between regions. Once a region has finished, region_done() is
+ * called with its client_data and a status of 0 on success or -1 on
+ * failure. This happens on the calling thread and strictly in reference
+ * and position order, so it is where any per region output should be
+ * written.
+ *
+ * The pool should not be shared with the file handles being processed, as
+ * each region uses a single threaded file handle.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int pileup_loop_mt(const char *fn, t_pool *pool, int region_len,
+		   int (*seq_init)(void *client_data,
+				   scram_fd *fp,
+				   pileup_t *p),
+		   int (*seq_add)(void *client_data,
+				  scram_fd *fp,
+				  pileup_t *p,
+				  int depth,
+				  int pos,
+				  int nth,
+				  int is_insert),
+		   void *(*region_init)(void *arg, int refid,
+					int start, int end),
+		   int (*region_done)(void *arg, void *client_data,
+				      int status),
+		   void *arg) {
+    scram_fd *fp;
+    SAM_hdr *hdr;
+    t_results_queue *q = NULL;
+    pileup_fds_t fds;
+    int i, refid, ret = -1;
+    int nsent = 0, ndone = 0;
+
+    if (region_len <= 0)
+	region_len = PILEUP_REGION_LEN;
+
+    /* Before starting any threads */
+    init_tab();
+
+    /* The header, index check and a reference shared by all regions */
+    if (!(fp = scram_open(fn, "r")))
+	return -1;
+    if (scram_index_load(fp, fn) != 0) {
+	fprintf(stderr, "Failed to load index for %s\n", fn);
+	scram_close(fp);
+	return -1;
+    }
+    hdr = scram_get_header(fp);
+
+    fds.fn = fn;
+    fds.refs = scram_get_refs(fp);
+    fds.fp = NULL;
+    fds.nfp = fds.afp = 0;
+    pthread_mutex_init(&fds.lock, NULL);
+
+    if (pool && !(q = t_results_queue_init()))
+	goto err;
+
+    for (refid = 0; refid < hdr->nref; refid++) {
+	int64_t start, len = hdr->ref[refid].len;
+
+	for (start = 1; start == 1 || start <= len; start += region_len) {
+	    pileup_job_t *j;
+
+	    if (!(j = malloc(sizeof(*j))))
+		goto err;
+	    j->fds = &fds;
+	    j->refid = refid;
+	    j->start = start;
+	    /* Last region also covers sequences overhanging the end */
+	    j->end = start + region_len > len ? INT_MAX : start+region_len-1;
+	    j->seq_init = seq_init;
+	    j->seq_add = seq_add;
+	    j->client_data = region_init
+		? region_init(arg, refid, j->start, j->end)
+		: arg;
+	    j->exit_code = 0;
+
+	    if (!q) {
+		int r;
+		pileup_job_thread(j);
+		r = region_done(arg, j->client_data, j->exit_code);
+		if (j->exit_code != 0)
+		    r = -1;
+		free(j);
+		if (r != 0)
+		    goto err;
+		continue;
+	    }
+
+	    while (t_pool_dispatch2(pool, q, pileup_job_thread, j, 1) == -1) {
+		if (pileup_drain(q, 1, region_done, arg, &ndone) != 0) {
+		    region_done(arg, j->client_data, -1);
+		    free(j);
+		    goto err;
+		}
+	    }
+	    nsent++;
+	    if (pileup_drain(q, 0, region_done, arg, &ndone) != 0)
+		goto err;
+	}
     }
 
+    ret = 0;
+
+ err:
+    if (q) {
+	/* Wait for every dispatched job before destroying their queue */
+	while (ndone < nsent)
+	    if (pileup_drain(q, 1, region_done, arg, &ndone) != 0)
+		ret = -1;
+	/* A worker may still be signalling q after publishing its result */
+	t_pool_flush(pool);
+	t_results_queue_destroy(q);
+    }
+
+    for (i = 0; i < fds.nfp; i++)
+	if (scram_close(fds.fp[i]) != 0)
+	    ret = -1;
+    free(fds.fp);
+    pthread_mutex_destroy(&fds.lock);
+
+    if (scram_close(fp) != 0)
+	ret = -1;
+
     return ret;
 }
 
@@ -617,6 +1075,7 @@ int pileup_loop(scram_fd *fp,
 
 #include <ctype.h>
 #include <io_lib/bam.h>
+#include <io_lib/dstring.h>
 
 char strand_char[2][256];
 void strand_init(void) {
@@ -848,28 +1307,109 @@ static int depth_pileup(void *cd, scram_fd *fp, pileup_t *p,
     cp = append_int(cp, pos);
     *cp++=  '\t';
     cp = append_int(cp, depth);
-    *cp++ = '\0';
-    puts((char *) buf);
+    *cp++ = '\n';
+
+    /* Buffered per region when run via pileup_loop_mt() */
+    if (cd)
+	return dstring_nappend((dstring_t *)cd, (char *)buf, cp-buf);
+
+    fwrite(buf, 1, cp-buf, stdout);
     
     return 0;
 }
 
+/*
+ * Base counts per column, using the pileup_loop_cols() interface.
+ * Columns are: ref, pos, depth, A, C, G, T, N (or other), deletions and
+ * reference skips (cigar N), with the last six summing to depth.
+ */
+static int count_pileup(void *cd, scram_fd *fp, pileup_col_t *c) {
+    static unsigned char idx[256];
+    static int idx_done = 0;
+    unsigned char buf[1024], *cp = buf, *rp;
+    const unsigned char *base = (const unsigned char *)c->base;
+    int i, n[8] = {0};
+
+    if (!idx_done) {
+	memset(idx, 4, 256);
+	idx['A'] = 0; idx['C'] = 1; idx['G'] = 2; idx['T'] = 3;
+	idx['*'] = 5; idx['.'] = 6;
+	idx_done = 1;
+    }
+
+    if (c->nth)
+	return 0;
+
+    for (i = 0; i < c->depth; i++)
+	n[idx[base[i]]]++;
+
+    rp = (unsigned char *) scram_get_header(fp)->ref[c->ref].name;
+    while ((*cp++ = *rp++))
+	;
+    cp[-1] = '\t';
+    cp = append_int(cp, c->pos);   *cp++ = '\t';
+    cp = append_int(cp, c->depth);
+    for (i = 0; i < 7; i++) {
+	*cp++ = '\t';
+	cp = append_int(cp, n[i]);
+    }
+    *cp++ = '\n';
+    fwrite(buf, 1, cp-buf, stdout);
+
+    return 0;
+}
+
+static void *depth_region_init(void *arg, int refid, int start, int end) {
+    return dstring_create(NULL);
+}
+
+static int depth_region_done(void *arg, void *cd, int status) {
+    dstring_t *ds = (dstring_t *)cd;
+    int r = 0;
+
+    if (!ds)
+	return -1;
+
+    if (status == 0 && dstring_length(ds) &&
+	fwrite(dstring_str(ds), 1, dstring_length(ds), stdout)
+	!= dstring_length(ds))
+	r = -1;
+
+    dstring_destroy(ds);
+    return r;
+}
+
 int main(int argc, char **argv) {
     scram_fd *fp;
     sam_pileup_t *p;
-    int mode = 0;
+    int mode = 0, nthreads = 1, use_regions = 0;
 
     if (argc < 2) {
 	fprintf(stderr, "Usage: scram_pileup [options] filename.{sam,bam,cram}\n");
 	fprintf(stderr, "Options:\n");
 	fprintf(stderr, " -5          Gap5 pileup format.\n");
 	fprintf(stderr, " -d          Depth format.\n");
+	fprintf(stderr, " -c          Base counts: depth, A, C, G, T, N, deletions\n");
+	fprintf(stderr, "             and reference skips.\n");
 	fprintf(stderr, " (otherwise) Samtools pileup format.\n");
+	fprintf(stderr, " -t N        Use N threads, splitting an indexed file by region.\n");
+	fprintf(stderr, "             Currently only for depth format.\n");
 	fprintf(stderr, "\n\nNOTE: This program is still under development "
 		"and should be considered a proof\nof concept only.\n");
 	return 1;
     }
 
+    if (argc >= 3 && strcmp(argv[1], "-t") == 0) {
+	nthreads = atoi(argv[2]);
+	use_regions = 1;
+	if (nthreads < 1 || nthreads > 512) {
+	    fprintf(stderr, "Number of threads needs to be >= 1 and <= 512\n");
+	    return 1;
+	}
+	argc -= 2;
+	argv += 2;
+    }
+
     if (argc >= 2 && strcmp(argv[1], "-5") == 0) {
 	mode = '5';
 	argc--;
@@ -882,13 +1422,39 @@ int main(int argc, char **argv) {
 	argv++;
     }
 
+    if (argc >= 2 && strcmp(argv[1], "-c") == 0) {
+	mode = 'c';
+	argc--;
+	argv++;
+    }
+
     if (argc != 2) {
 	fprintf(stderr, "sam_pileup filename\n");
 	return 1;
     }
 
+    if (use_regions && mode != 'd') {
+	fprintf(stderr, "-t is only supported with -d\n");
+	return 1;
+    }
+
     strand_init();
 
+    if (nthreads > 1) {
+	t_pool *pool;
+	int r;
+
+	if (!(pool = t_pool_init(nthreads*2, nthreads)))
+	    return 1;
+
+	r = pileup_loop_mt(argv[1], pool, PILEUP_REGION_LEN,
+			   NULL, depth_pileup,
+			   depth_region_init, depth_region_done, NULL);
+	t_pool_destroy(pool, 0);
+
+	return r == 0 ? 0 : 1;
+    }
+
     fp = scram_open(argv[1], "r");
     if (!fp) {
 	perror(argv[1]);
@@ -907,6 +1473,10 @@ int main(int argc, char **argv) {
 	pileup_loop(fp, NULL, depth_pileup, NULL);
 	break;
 
+    case 'c':
+	pileup_loop_cols(fp, NULL, count_pileup, NULL);
+	break;
+
     default:
 	pileup_loop(fp, NULL, sam_pileup, p);
 	break;
@@ -920,4 +1490,3 @@ int main(int argc, char **argv) {
 
     return 0;
 }
-
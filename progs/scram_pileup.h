@@ -64,6 +64,34 @@ typedef struct pileup {
     char padding;         // True if the base was added due to another seq
 } pileup_t;
 
+/* pileup_col_t flags */
+#define PILEUP_START    1 // first base of this sequence (or fragment)
+#define PILEUP_EOF      2 // last base of this sequence (or fragment)
+#define PILEUP_REF_SKIP 4 // start or eof is due to a cigar N op
+#define PILEUP_PADDING  8 // base added due to an insertion in another seq
+
+/*
+ * A single column of pileup_loop_cols() output. The arrays hold one
+ * entry per active sequence, in the same order as p[].
+ *
+ * The base and qual fields of pileup_t are not maintained by
+ * pileup_loop_cols(); use the arrays here instead. A pileup_t stays at the
+ * same address from seq_init() until its sequence ends, but its index in
+ * these arrays decreases as earlier sequences end.
+ */
+typedef struct {
+    int ref;               // reference id
+    int pos;               // unpadded position
+    int nth;               // nth column at pos (>0 for insertions)
+    int is_insert;         // as per pileup_loop
+    int depth;             // number of entries in the arrays below
+    char          *base;   // base call, or '*' for deletion/pad
+    unsigned char *qual;   // quality
+    unsigned char *strand; // 0 => fwd, 1 => rev
+    unsigned char *flags;  // bit-wise OR of PILEUP_* values
+    pileup_t     **p;      // p[i] is the sequence for entry i
+} pileup_col_t;
+
 int pileup_loop(scram_fd *fp,
 		int (*seq_init)(void *client_data,
 				scram_fd *fp,
@@ -77,4 +105,33 @@ int pileup_loop(scram_fd *fp,
 			       int is_insert),
 		void *client_data);
 
+int pileup_loop_cols(scram_fd *fp,
+		     int (*seq_init)(void *client_data,
+				     scram_fd *fp,
+				     pileup_t *p),
+		     int (*col_add)(void *client_data,
+				    scram_fd *fp,
+				    pileup_col_t *c),
+		     void *client_data);
+
+/* Default region size for pileup_loop_mt() */
+#define PILEUP_REGION_LEN 10000000
+
+int pileup_loop_mt(const char *fn, t_pool *pool, int region_len,
+		   int (*seq_init)(void *client_data,
+				   scram_fd *fp,
+				   pileup_t *p),
+		   int (*seq_add)(void *client_data,
+				  scram_fd *fp,
+				  pileup_t *p,
+				  int depth,
+				  int pos,
+				  int nth,
+				  int is_insert),
+		   void *(*region_init)(void *arg, int refid,
+					int start, int end),
+		   int (*region_done)(void *arg, void *client_data,
+				      int status),
+		   void *arg);
+
 #endif
@@ -59,6 +59,10 @@
 
 #include <io_lib/scram.h>
 #include <io_lib/os.h>
+#include <io_lib/async_io.h>
+
+/* Number of records fetched per scram_get_seqs() call */
+#define SEQ_BATCH 256
 
 static char *parse_format(char *str) {
     if (strcmp(str, "sam") == 0 || strcmp(str, "SAM") == 0)
@@ -90,6 +94,69 @@ static char *detect_format(char *fn) {
     return "";
 }
 
+/*
+ * Loads a BED file of regions, converting from 0-based half-open to
+ * 1-based inclusive coordinates.
+ *
+ * Returns an array of ranges on success, with the count in *nr;
+ *         NULL on failure
+ */
+static cram_range *load_bed(SAM_hdr *h, char *fn, int *nr) {
+    FILE *fp;
+    char line[8192], name[1024];
+    cram_range *r = NULL, *tmp;
+    int n = 0, a = 0, lineno = 0;
+    long start, end;
+
+    if (!(fp = fopen(fn, "r"))) {
+	perror(fn);
+	return NULL;
+    }
+
+    while (fgets(line, 8192, fp)) {
+	lineno++;
+	if (*line == '#' || *line == '\n' ||
+	    strncmp(line, "track", 5) == 0 || strncmp(line, "browser", 7) == 0)
+	    continue;
+
+	if (sscanf(line, "%1023s %ld %ld", name, &start, &end) != 3 ||
+	    start < 0 || end < start) {
+	    fprintf(stderr, "Malformed BED line %d in %s\n", lineno, fn);
+	    goto err;
+	}
+
+	if (n >= a) {
+	    a = a ? a*2 : 256;
+	    if (!(tmp = realloc(r, a * sizeof(*r))))
+		goto err;
+	    r = tmp;
+	}
+
+	if ((r[n].refid = sam_hdr_name2ref(h, name)) < 0) {
+	    fprintf(stderr, "Unknown reference name '%s'\n", name);
+	    goto err;
+	}
+	r[n].start = start+1;
+	r[n].end   = end;
+	n++;
+    }
+    fclose(fp);
+
+    if (n == 0) {
+	fprintf(stderr, "No regions found in %s\n", fn);
+	free(r);
+	return NULL;
+    }
+
+    *nr = n;
+    return r;
+
+ err:
+    fclose(fp);
+    free(r);
+    return NULL;
+}
+
 static void usage(FILE *fp) {
     fprintf(fp, "  -=- sCRAMble -=-     version %s\n", PACKAGE_VERSION);
     fprintf(fp, "Author: James Bonfield, Wellcome Trust Sanger Institute. 2013-2018\n\n");
@@ -103,7 +170,9 @@ static void usage(FILE *fp) {
     fprintf(fp, "    -0 or -u       No compression.\n");
     //fprintf(fp, "    -v             Verbose output.\n");
     fprintf(fp, "    -H             [SAM] Do not print header\n");
-    fprintf(fp, "    -R range       [Cram] Specifies the refseq:start-end range\n");
+    fprintf(fp, "    -R range       Specifies the refseq:start-end range (needs an index)\n");
+    fprintf(fp, "    -L file.bed    [Cram] Only output reads overlapping these regions\n");
+    fprintf(fp, "    -i             Also write an index (.bai or .crai) for the output\n");
     fprintf(fp, "    -r ref.fa      [Cram] Specifies the reference file.\n");
     fprintf(fp, "    -b integer     [Cram] Max. bases per slice, default %d.\n",
 	    BASES_PER_SLICE);
@@ -134,6 +203,12 @@ static void usage(FILE *fp) {
     fprintf(fp, "    -q             Don't add scramble @PG header line\n");
     fprintf(fp, "    -N integer     Stop decoding after 'integer' sequences\n");
     fprintf(fp, "    -t N           Use N threads (availability varies by format)\n");
+    fprintf(fp, "    -A MB          Read up to MB megabytes of input in the background\n");
+    fprintf(fp, "    -W MB          Queue up to MB megabytes of output to write in the background\n");
+    fprintf(fp, "    -K             With -W, drop written output from the page cache\n");
+    fprintf(fp, "    -D             [Cram] With -t, decode each slice's blocks in parallel\n");
+    fprintf(fp, "    -Y MB          [Cram] With -t, limit decoding to roughly MB megabytes\n");
+    fprintf(fp, "    -y             [Cram] Map reference files into memory where possible\n");
     fprintf(fp, "    -B             Enable Illumina 8 quality-binning system (lossy)\n");
     fprintf(fp, "    -!             Disable all checking of checksums\n");
     fprintf(fp, "    -g FILE        Convert to Bam using index (file.gzi)\n");
@@ -143,7 +218,7 @@ static void usage(FILE *fp) {
 
 int main(int argc, char **argv) {
     scram_fd *in, *out;
-    bam_seq_t *s;
+    bam_seq_t *s[SEQ_BATCH];
     char imode[10], *in_f = "", omode[10], *out_f = "", *index_fn = NULL, *index_out_fn = NULL;
     int level = '\0'; // nul terminate string => auto level
     int c, verbose = 0;
@@ -167,11 +242,15 @@ int main(int argc, char **argv) {
     int preserve_aux_size = 0;
     int add_pg = 1;
     int archive = 0;
+    int write_index = 0;
+    char *bed_fn = NULL;
+    int read_ahead = 0, write_behind = 0, wb_flags = 0;
+    int parallel_blocks = 0, decode_mem = 0, ref_mmap = 0;
 
     scram_init();
 
     /* Parse command line arguments */
-    while ((c = getopt(argc, argv, "u0123456789hvs:S:V:r:xeEI:O:R:!MmajJZt:BN:F:Hb:nPpqg:G:fTX:")) != -1) {
+    while ((c = getopt(argc, argv, "u0123456789hvs:S:V:r:xeEI:O:R:!MmajJZt:BN:F:Hb:nPpqg:G:fTX:iL:A:W:KDY:y")) != -1) {
 	switch (c) {
 	case 'X':
 	    if (strcmp(optarg, "default") == 0 || strcmp(optarg, "normal") == 0) {
@@ -301,6 +380,14 @@ int main(int argc, char **argv) {
 	    break;
 	}
 
+	case 'i':
+	    write_index = 1;
+	    break;
+
+	case 'L':
+	    bed_fn = optarg;
+	    break;
+
 	case '!':
 	    ignore_md5 = 1;
 	    break;
@@ -385,6 +472,30 @@ int main(int argc, char **argv) {
 	    max_reads = atoi(optarg);
 	    break;
 
+	case 'A':
+	    read_ahead = atoi(optarg);
+	    break;
+
+	case 'W':
+	    write_behind = atoi(optarg);
+	    break;
+
+	case 'K':
+	    wb_flags |= WRITE_BEHIND_DONTNEED;
+	    break;
+
+	case 'D':
+	    parallel_blocks = 1;
+	    break;
+
+	case 'Y':
+	    decode_mem = atoi(optarg);
+	    break;
+
+	case 'y':
+	    ref_mmap = 1;
+	    break;
+
 	case 'g':
 	    index_fn = optarg;
 	    break;
@@ -417,6 +528,11 @@ int main(int argc, char **argv) {
 	fprintf(stderr, "Usage: scramble [input_file [output_file]]\n");
 	return 1;
     }
+
+    if (write_index && argc - optind < 2) {
+	fprintf(stderr, "The -i option requires an output filename\n");
+	return 1;
+    }
     
 
     /* Open up input and output files */
@@ -574,6 +690,34 @@ int main(int argc, char **argv) {
 	    return 1;
     }
 
+    if (parallel_blocks) {
+	if (scram_set_option(in, CRAM_OPT_PARALLEL_BLOCKS, parallel_blocks))
+	    return 1;
+    }
+
+    if (ref_mmap) {
+	if (scram_set_option(in,  CRAM_OPT_REF_MMAP, ref_mmap))
+	    return 1;
+	if (scram_set_option(out, CRAM_OPT_REF_MMAP, ref_mmap))
+	    return 1;
+    }
+
+    if (decode_mem > 0) {
+	if (scram_set_option(in, CRAM_OPT_DECODE_MEM, decode_mem))
+	    return 1;
+    }
+
+    if (read_ahead > 0) {
+	if (scram_set_option(in, CRAM_OPT_READ_AHEAD, read_ahead))
+	    return 1;
+    }
+
+    if (write_behind > 0) {
+	if (scram_set_option(out, CRAM_OPT_WRITE_BEHIND, write_behind,
+			     wb_flags))
+	    return 1;
+    }
+
     if (ignore_md5) {
 	if (scram_set_option(in, CRAM_OPT_IGNORE_MD5, ignore_md5))
 	    return 1;
@@ -631,20 +775,24 @@ int main(int argc, char **argv) {
 	    return 1;
     }
 
+    /* BAM indices are built on the fly; CRAM ones once written */
+    if (write_index && out->is_bam) {
+	if (bam_index_build(out->b, argv[optind+1], 0) != 0)
+	    return 1;
+    }
+
 
-    /* Support for sub-range queries, currently implemented for CRAM only */
+    /* Support for sub-range queries */
     if (*ref_name != 0) {
 	cram_range r;
 	int refid;
 
-	if (in->is_bam) {
-	    fprintf(stderr, "Currently the -R option is only implemented for CRAM indices\n");
+	if (argc - optind < 1 || scram_index_load(in, argv[optind]) != 0) {
+	    fprintf(stderr, "The -R option requires an indexed input file\n");
 	    return 1;
 	}
-	    
-	cram_index_load(in->c, argv[optind]);
 
-	refid = sam_hdr_name2ref(in->c->header, ref_name);
+	refid = sam_hdr_name2ref(scram_get_header(in), ref_name);
 
 	if (refid == -1 && *ref_name != '*') {
 	    fprintf(stderr, "Unknown reference name '%s'\n", ref_name);
@@ -657,16 +805,53 @@ int main(int argc, char **argv) {
 	    return 1;
     }
 
-    /* Do the actual file format conversion */
-    s = NULL;
+    /* Multiple regions from a BED file */
+    if (bed_fn) {
+	cram_range *r;
+	int nr;
+
+	if (*ref_name) {
+	    fprintf(stderr, "The -R and -L options are mutually exclusive\n");
+	    return 1;
+	}
 
-    while (scram_get_seq(in, &s) >= 0) {
-	if (-1 == scram_put_seq(out, s)) {
-	    fprintf(stderr, "Failed to encode sequence\n");
+	if (in->is_bam) {
+	    fprintf(stderr, "The -L option requires CRAM input\n");
 	    return 1;
 	}
-	if (max_reads >= 0)
-	    if (--max_reads == 0)
+
+	if (argc - optind < 1 || scram_index_load(in, argv[optind]) != 0) {
+	    fprintf(stderr, "The -L option requires an indexed input file\n");
+	    return 1;
+	}
+
+	if (!(r = load_bed(scram_get_header(in), bed_fn, &nr)))
+	    return 1;
+
+	if (cram_set_regions(in->c, r, nr) != 0) {
+	    free(r);
+	    return 1;
+	}
+	free(r);
+    }
+
+    /* Do the actual file format conversion */
+    for (;;) {
+	int i, n = max_reads > 0 && max_reads < SEQ_BATCH
+	    ? max_reads : SEQ_BATCH;
+
+	if ((n = scram_get_seqs(in, s, n)) < 0)
+	    break;
+
+	for (i = 0; i < n; i++) {
+	    if (-1 == scram_put_seq(out, s[i])) {
+		fprintf(stderr, "Failed to encode sequence\n");
+		return 1;
+	    }
+	}
+
+	if (max_reads > 0)
+	    if ((max_reads -= n) == 0)
 		break;
     }
 
@@ -700,11 +885,24 @@ int main(int argc, char **argv) {
 	return 1;
     }
 
+    if (write_index && omode[1] == 'c') {
+	cram_fd *fd;
+
+	if (!(fd = cram_open(argv[optind+1], "rb"))) {
+	    fprintf(stderr, "Failed to open file %s\n", argv[optind+1]);
+	    return 1;
+	}
+	cram_set_option(fd, CRAM_OPT_REQUIRED_FIELDS,
+			SAM_RNAME | SAM_POS | SAM_CIGAR);
+	if (cram_index_build(fd, argv[optind+1]) != 0) {
+	    cram_close(fd);
+	    return 1;
+	}
+	cram_close(fd);
+    }
+
     if (p)
 	t_pool_destroy(p, 0);
 
-    if (s)
-	free(s);
-
     return 0;
 }